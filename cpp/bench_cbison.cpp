@@ -0,0 +1,731 @@
+// Benchmarks of the cbison.hpp helpers, one section per helper.
+//
+// Usage: bench_cbison [<path to engine library> [prefix]]
+// Without an engine library, runs against the mock engine of
+// test_mock_engine.hpp, whose grammars are literal strings and whose masks
+// cost next to nothing, so the numbers are the helpers' own overhead. With
+// one, grammars are regexes and JSON schemas over a byte tokenizer.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+#include "cbison.hpp"
+#include "cbison_static.hpp"
+#include "test_mock_engine.hpp"
+
+CBISON_DECLARE_STATIC_ENGINE(MockEngine, mock);
+
+struct MockEngineFull : MockEngine {
+  static int32_t validate_tokens(cbison_matcher_t m, const uint32_t *t,
+                                 size_t n) {
+    return mock_cbison_validate_tokens(m, t, n);
+  }
+  static int32_t reset(cbison_matcher_t m) { return mock_cbison_reset(m); }
+};
+
+using Clock = std::chrono::steady_clock;
+using Grammar = std::pair<std::string, std::string>; // type, text
+
+// wall time spent per benchmark
+static constexpr double MIN_US = 200e3;
+
+class ByteTokenizer : public cbison::CppTokenizer {
+public:
+  ByteTokenizer() : CppTokenizer(257, 0x100, false) {}
+
+  std::vector<uint8_t> getToken(uint32_t token_id) const override {
+    if (token_id < 0x100)
+      return {static_cast<uint8_t>(token_id)};
+    if (token_id == eos_token_id) {
+      static constexpr char eos_str[] = "<|eos|>";
+      return std::vector<uint8_t>(eos_str, eos_str + sizeof(eos_str) - 1);
+    }
+    return {};
+  }
+
+  bool isSpecialToken(uint32_t token_id) const override {
+    return token_id == eos_token_id;
+  }
+
+  std::vector<uint32_t> tokenizeBytes(const std::string &input) const override {
+    return std::vector<uint32_t>(
+        reinterpret_cast<const uint8_t *>(input.data()),
+        reinterpret_cast<const uint8_t *>(input.data()) + input.size());
+  }
+};
+
+// Model vocabulary with the byte tokens in reverse order, then EOS, then
+// n_added special tokens that ByteTokenizer doesn't have.
+class AddedTokensTokenizer : public cbison::CppTokenizer {
+public:
+  explicit AddedTokensTokenizer(size_t n_added)
+      : CppTokenizer(257 + n_added, 0x100, false) {}
+
+  std::vector<uint8_t> getToken(uint32_t token_id) const override {
+    if (token_id < 0x100)
+      return {static_cast<uint8_t>(0xff - token_id)};
+    std::string s = token_id == eos_token_id
+                        ? "<|eos|>"
+                        : "<|added_" + std::to_string(token_id) + "|>";
+    return std::vector<uint8_t>(s.begin(), s.end());
+  }
+
+  bool isSpecialToken(uint32_t token_id) const override {
+    return token_id >= 0x100;
+  }
+
+  std::vector<uint32_t> tokenizeBytes(const std::string &input) const override {
+    std::vector<uint32_t> r;
+    for (unsigned char c : input)
+      r.push_back(0xff - c);
+    return r;
+  }
+};
+
+struct Env {
+  const cbison::Factory &f;
+  const cbison::Tokenizer &tok;
+  bool mock;
+  cbison::CbisonEngineDll *engine; // nullptr with the mock
+
+  cbison::Matcher newMatcher(const Grammar &g) const {
+    return f.newMatcher(g.first, g.second);
+  }
+
+  // grammar matching exactly s
+  Grammar literal(const std::string &s) const {
+    if (mock)
+      return {"lit", s};
+    std::string re;
+    for (char c : s) {
+      if (std::string("\\^$.|?*+()[]{}/").find(c) != std::string::npos)
+        re.push_back('\\');
+      re.push_back(c);
+    }
+    return {"regex", re};
+  }
+
+  // object with n integer properties: the keys and punctuation are forced,
+  // the values are not (with the mock, the values are fixed too)
+  Grammar schema(size_t n) const {
+    std::string obj = "{", props, required;
+    for (size_t i = 0; i < n; ++i) {
+      std::string key = "\"property_" + std::to_string(i) + "\"";
+      obj += (i ? "," : "") + key + ":" + std::to_string(i);
+      props += (i ? "," : "") + key + ":{\"type\":\"integer\"}";
+      required += (i ? "," : "") + key;
+    }
+    obj += "}";
+    if (mock)
+      return {"lit", obj};
+    return {"json", "{\"type\":\"object\",\"properties\":{" + props +
+                        "},\"required\":[" + required +
+                        "],\"additionalProperties\":false}"};
+  }
+};
+
+// Calls fn for at least MIN_US.
+// @return Microseconds per call.
+template <typename F>
+static double per_call_us(F &&fn, size_t *n_calls = nullptr) {
+  size_t n = 0;
+  auto t0 = Clock::now();
+  double us = 0;
+  do {
+    fn();
+    ++n;
+    us = std::chrono::duration<double, std::micro>(Clock::now() - t0).count();
+  } while (us < MIN_US);
+  if (n_calls)
+    *n_calls = n;
+  return us / double(n);
+}
+
+static void report(const std::string &name, double value, const char *unit) {
+  std::printf("  %-48s %12.2f %s\n", name.c_str(), value, unit);
+}
+
+static uint32_t first_allowed(const std::vector<uint32_t> &mask) {
+  for (size_t w = 0; w < mask.size(); ++w)
+    if (mask[w])
+      return uint32_t(w * 32 + __builtin_ctz(mask[w]));
+  return CBISON_NO_TOKEN;
+}
+
+// Jump-forward throughput on a schema whose keys are forced:
+// native compute_ff_tokens(), when the engine has it, vs emulation from
+// masks, vs no fast-forward at all (one mask and token per step, as when
+// every token comes from the model). Unforced tokens are the first
+// allowed ones.
+static void bench_fast_forward(const Env &env) {
+  std::printf("fast-forward\n");
+  Grammar g = env.schema(32);
+  std::vector<uint32_t> mask(env.f.maskByteLen() / 4);
+  size_t n_steps = 0;
+  double base_us = per_call_us([&] {
+    auto m = env.newMatcher(g);
+    n_steps = 0;
+    while (!m.isStopped()) {
+      if (m.computeMask(mask.data()) != 0)
+        break;
+      uint32_t t = first_allowed(mask);
+      if (t == CBISON_NO_TOKEN || m.consumeTokens({t}) != 0)
+        abort();
+      n_steps++;
+    }
+  });
+  report("no fast-forward per document", base_us, "us");
+  report("no fast-forward steps per document", double(n_steps), "steps");
+  for (bool emulate : {false, true}) {
+    if (!emulate && !env.f.get()->compute_ff_tokens)
+      continue;
+    cbison::FastForward ff(env.tok, 1000);
+    ff.setEmulate(emulate);
+    size_t n_calls;
+    double us = per_call_us(
+        [&] {
+          auto m = env.newMatcher(g);
+          std::vector<uint32_t> history;
+          cbison::FastForwardResult res;
+          while (!m.isStopped()) {
+            if (ff.run(m, history, res) != 0)
+              abort();
+            history.resize(history.size() - res.n_drop);
+            history.insert(history.end(), res.tokens.begin(),
+                           res.tokens.end());
+            if (m.isStopped() || m.computeMask(mask.data()) != 0)
+              break;
+            uint32_t t = first_allowed(mask);
+            if (t == CBISON_NO_TOKEN || m.consumeTokens({t}) != 0)
+              abort();
+            history.push_back(t);
+          }
+        },
+        &n_calls);
+    double s = us * double(n_calls) / 1e6;
+    const char *mode = emulate ? "emulated" : "native";
+    report(std::string(mode) + " forced tokens/s",
+           double(ff.stats().forced_tokens) / s, "tok/s");
+    report(std::string(mode) + " per document", us, "us");
+    report(std::string(mode) + " steps per document",
+           double(ff.stats().calls) / double(n_calls), "steps");
+    report(std::string(mode) + " speedup vs no fast-forward", base_us / us,
+           "x");
+  }
+}
+
+// Per-call cost of consume_tokens() and validate_tokens() with one token,
+// through the factory's function pointers, through cbison::Matcher, and
+// with the static binding of cbison_static.hpp, which the compiler can
+// inline. The engine entry points must be linked in, so this runs on the
+// mock only.
+static void bench_static_binding(const Env &env) {
+  if (!env.mock)
+    return;
+  std::printf("static binding\n");
+  constexpr size_t N = 4096;
+  Grammar g = env.literal(std::string(N, 'a'));
+  cbison_factory_t api = env.f.get();
+  cbison::static_binding::Factory<MockEngineFull> sf(api);
+  auto m = env.newMatcher(g);
+  auto sm = sf.newMatcher(g.first, g.second);
+  const uint32_t t = 'a';
+  // keeps the compiler from dropping inlined validate_tokens() calls
+  volatile int32_t sink = 0;
+
+  // N calls per run; consume starts over with reset()
+  report("consume_tokens, function pointer", per_call_us([&] {
+           m.reset();
+           for (size_t i = 0; i < N; ++i)
+             api->consume_tokens(m.get(), &t, 1);
+         }) * 1e3 / N,
+         "ns");
+  report("consume_tokens, cbison::Matcher", per_call_us([&] {
+           m.reset();
+           for (size_t i = 0; i < N; ++i)
+             m.consumeTokens({t});
+         }) * 1e3 / N,
+         "ns");
+  report("consume_tokens, static binding", per_call_us([&] {
+           sm.reset();
+           for (size_t i = 0; i < N; ++i)
+             sm.consumeTokens(&t, 1);
+         }) * 1e3 / N,
+         "ns");
+
+  m.reset();
+  sm.reset();
+  report("validate_tokens, function pointer", per_call_us([&] {
+           for (size_t i = 0; i < N; ++i)
+             sink = sink + api->validate_tokens(m.get(), &t, 1);
+         }) * 1e3 / N,
+         "ns");
+  report("validate_tokens, cbison::Matcher", per_call_us([&] {
+           for (size_t i = 0; i < N; ++i)
+             sink = sink + m.validateTokens({t});
+         }) * 1e3 / N,
+         "ns");
+  report("validate_tokens, static binding", per_call_us([&] {
+           for (size_t i = 0; i < N; ++i)
+             sink = sink + sm.validateTokens(&t, 1);
+         }) * 1e3 / N,
+         "ns");
+  (void)sink;
+}
+
+// Cost of copying a matcher with fork() and clone(), as its input grows
+// (depth: tokens consumed so far) and as copies accumulate (fan-out: copies
+// alive at once). Memory is matcher_memory_usage() per copy after each
+// copy has advanced one token, when the engine reports it.
+static void bench_fork(const Env &env) {
+  std::printf("fork vs clone\n");
+  std::vector<uint32_t> mask(env.f.maskByteLen() / 4);
+  auto base = env.newMatcher(env.schema(128));
+  size_t depth = 0;
+  for (size_t target : {16, 256, 2048}) {
+    for (; depth < target && !base.isStopped(); ++depth) {
+      if (base.computeMask(mask.data()) != 0 ||
+          base.consumeTokens({first_allowed(mask)}) != 0)
+        abort();
+    }
+    if (base.computeMask(mask.data()) != 0)
+      abort();
+    uint32_t next = first_allowed(mask);
+    for (size_t fan_out : {1, 16, 256}) {
+      for (bool fork : {true, false}) {
+        if (fork && !base.hasFork())
+          continue;
+        std::vector<cbison::Matcher> copies;
+        copies.reserve(fan_out);
+        double us = per_call_us([&] {
+          copies.clear();
+          for (size_t i = 0; i < fan_out; ++i)
+            copies.push_back(fork ? base.fork() : base.clone());
+        });
+        std::string name = std::string(fork ? "fork" : "clone") + ", depth " +
+                           std::to_string(depth) + " x" +
+                           std::to_string(fan_out);
+        report(name, us / double(fan_out), "us/copy");
+        size_t bytes = 0;
+        bool have_bytes = true;
+        for (auto &c : copies) {
+          if (c.consumeTokens({next}) != 0)
+            abort();
+          auto b = c.memoryUsage();
+          have_bytes = have_bytes && b;
+          bytes += b.value_or(0);
+        }
+        if (have_bytes)
+          report(name + " memory", double(bytes) / double(fan_out),
+                 "B/copy");
+      }
+    }
+  }
+}
+
+// Serving a model vocabulary with 32k tokens (mostly added special tokens)
+// through RemappedFactory over the existing factory, vs a separate factory
+// built for the model tokenizer: setup time, and the cost of a mask at the
+// start of a grammar. With the mock, the separate factory costs nothing to
+// build, and only the mask numbers are meaningful.
+static void bench_remap(const Env &env) {
+  std::printf("remapped factory\n");
+  auto mt = new AddedTokensTokenizer(32000 - 257);
+  cbison_tokenizer_t mt_api = mt->c_api();
+  cbison::Tokenizer model_tok(mt_api);
+  mt_api->decr_ref_count(mt_api);
+  size_t n_vocab = model_tok.vocabSize();
+
+  auto new_remapped = [&] {
+    auto map = cbison::RemappedFactory::mapByBytes(mt_api, env.tok.get());
+    auto rf = new cbison::RemappedFactory(env.f.get(), std::move(map),
+                                          mt_api->eos_token_id);
+    return rf->c_api();
+  };
+  auto new_separate = [&] {
+    std::string err;
+    cbison_factory_t sf = env.engine
+                              ? env.engine->new_factory(mt_api, "{}", err)
+                              : mock_new_factory(n_vocab);
+    if (!sf) {
+      std::cerr << "Failed to create factory: " << err << '\n';
+      abort();
+    }
+    return sf;
+  };
+  report("setup, remap", per_call_us([&] {
+           cbison_factory_t f = new_remapped();
+           f->decr_ref_count(f);
+         }) / 1e3,
+         "ms");
+  report("setup, separate factory", per_call_us([&] {
+           cbison_factory_t f = new_separate();
+           f->decr_ref_count(f);
+         }) / 1e3,
+         "ms");
+
+  cbison_factory_t rptr = new_remapped(), sptr = new_separate();
+  const cbison::Factory remapped(rptr), separate(sptr);
+  rptr->decr_ref_count(rptr);
+  sptr->decr_ref_count(sptr);
+  std::vector<uint32_t> mask(remapped.maskByteLen() / 4);
+  Grammar g = env.literal("hello");
+  for (auto [name, f] : {std::pair{"engine factory", &env.f},
+                         std::pair{"remapped", &remapped},
+                         std::pair{"separate factory", &separate}}) {
+    auto m = f->newMatcher(g.first, g.second);
+    report(std::string("mask, ") + name, per_call_us([&] {
+             if (m.computeMask(mask.data()) != 0)
+               abort();
+           }),
+           "us");
+  }
+}
+
+// Tokens of a document of g, taking the first allowed token at each step,
+// up to EOS (excluded) or max_tokens.
+static std::vector<uint32_t> first_allowed_doc(const Env &env,
+                                               const Grammar &g,
+                                               size_t max_tokens) {
+  std::vector<uint32_t> mask(env.f.maskByteLen() / 4), doc;
+  auto m = env.newMatcher(g);
+  while (doc.size() < max_tokens && m.computeMask(mask.data()) == 0) {
+    uint32_t t = first_allowed(mask);
+    if (t == CBISON_NO_TOKEN || t == env.f.get()->eos_token_id ||
+        m.consumeTokens({t}) != 0)
+      break;
+    doc.push_back(t);
+  }
+  return doc;
+}
+
+// Latency of backtracking k tokens at the end of a document: the engine's
+// rollback(), CheckpointedMatcher's checkpoints (every 16 tokens; with the
+// adaptive spacing, this loop would checkpoint every token), and replaying
+// the whole document after reset() (what CheckpointedMatcher does without
+// clone_matcher). Tokens are consumed one at a time, as in decoding; each
+// round re-consumes the k tokens, outside the timing.
+static void bench_rollback(const Env &env) {
+  std::printf("rollback\n");
+  Grammar g = env.schema(64);
+  std::vector<uint32_t> doc = first_allowed_doc(env, g, 1024);
+  cbison_factory_t api = env.f.get();
+
+  // consume(t) takes one token
+  auto time_rollback = [&](size_t k, auto &&consume, auto &&rollback) {
+    for (auto t = doc.begin(); t != doc.end() - k; ++t)
+      if (consume(*t) != 0)
+        abort();
+    double us = 0;
+    size_t n = 0;
+    auto t_end = Clock::now() + std::chrono::microseconds(int64_t(MIN_US));
+    while (Clock::now() < t_end) {
+      for (auto t = doc.end() - k; t != doc.end(); ++t)
+        if (consume(*t) != 0)
+          abort();
+      auto t0 = Clock::now();
+      if (rollback(k) != 0)
+        abort();
+      us += std::chrono::duration<double, std::micro>(Clock::now() - t0)
+                .count();
+      ++n;
+    }
+    return us / double(n);
+  };
+
+  for (size_t k : {1, 8, 64}) {
+    std::string suffix = ", " + std::to_string(k) + " of " +
+                         std::to_string(doc.size()) + " tokens";
+    for (bool native : {true, false}) {
+      if (native ? !api->rollback : !api->clone_matcher)
+        continue;
+      cbison::CheckpointOptions opts;
+      opts.prefer_native = native;
+      opts.min_interval = opts.max_interval = 16;
+      cbison::CheckpointedMatcher cm(env.newMatcher(g), opts);
+      double us = time_rollback(
+          k, [&](uint32_t t) { return cm.consumeTokens({t}); },
+          [&](size_t n) { return cm.rollback(n); });
+      report(std::string(native ? "native" : "checkpoint") + suffix, us,
+             "us");
+      if (!native)
+        report("  tokens replayed per rollback",
+               double(cm.stats().tokens_replayed) /
+                   double(cm.stats().rollbacks),
+               "tok");
+    }
+    if (api->reset) {
+      auto m = env.newMatcher(g);
+      std::vector<uint32_t> head(doc.begin(), doc.end() - k);
+      double us = time_rollback(
+          k, [&](uint32_t t) { return m.consumeTokens({t}); },
+          [&](size_t) {
+            return m.reset() == 0 ? m.consumeTokens(head) : -1;
+          });
+      report("full replay" + suffix, us, "us");
+    }
+  }
+}
+
+// Streaming detokenization of a batch of 256 sequences, one token each per
+// step, of mixed ASCII and multi-byte UTF-8 text: StreamDecoder::decodeStep(),
+// decode() per sequence, and get_token() per token with no UTF-8 handling
+// (what callers do without StreamDecoder).
+static void bench_stream_decode(const Env &env) {
+  std::printf("stream decode, batch 256\n");
+  constexpr size_t BATCH = 256;
+  std::string text;
+  for (int i = 0; i < 64; ++i)
+    text += "{\"naïve\": \"日本語のテキスト\", "
+            "\"emoji\": \"🙂\", \"n\": " +
+            std::to_string(i) + "}\n";
+  std::vector<uint32_t> stream = env.tok.tokenizeString(text);
+  std::vector<size_t> start(BATCH);
+  for (size_t i = 0; i < BATCH; ++i)
+    start[i] = i * 7 % stream.size();
+
+  cbison::StreamDecoder dec(env.tok);
+  std::vector<uint32_t> step_tokens(BATCH);
+  size_t step = 0;
+  auto next_step = [&] {
+    for (size_t i = 0; i < BATCH; ++i)
+      step_tokens[i] = stream[(start[i] + step) % stream.size()];
+    ++step;
+  };
+  std::string out;
+  std::vector<size_t> offsets;
+  auto report_step = [&](const std::string &name, double us) {
+    report(name, us, "us/step");
+    report(name + " tokens/s", double(BATCH) / us, "Mtok/s");
+  };
+
+  report_step("decodeStep", per_call_us([&] {
+                next_step();
+                out.clear();
+                if (dec.decodeStep(step_tokens, out, offsets) != 0)
+                  abort();
+              }));
+  for (size_t i = 0; i < BATCH; ++i)
+    dec.reset(i);
+  std::vector<std::string> outs(BATCH);
+  report_step("decode per sequence", per_call_us([&] {
+                next_step();
+                for (size_t i = 0; i < BATCH; ++i) {
+                  outs[i].clear();
+                  if (dec.decode(i, {step_tokens[i]}, outs[i]) != 0)
+                    abort();
+                }
+              }));
+  report_step("get_token per token", per_call_us([&] {
+                next_step();
+                for (size_t i = 0; i < BATCH; ++i) {
+                  auto b = env.tok.getToken(step_tokens[i]);
+                  outs[i].assign(b.begin(), b.end());
+                }
+              }));
+}
+
+// Sampling without ConstrainedSampler: the logits are copied with -inf for
+// disallowed tokens, then the argmax, or a draw from the softmax, is taken
+// over the full vocabulary; top-p sorts the whole softmax.
+static uint32_t mask_then_sample(const std::vector<float> &logits,
+                                 const uint32_t *mask,
+                                 const cbison::SamplingParams &p,
+                                 std::vector<float> &buf,
+                                 std::vector<uint32_t> &order,
+                                 std::mt19937_64 &rng) {
+  float temperature = p.temperature;
+  size_t n = logits.size();
+  buf.resize(n);
+  for (size_t i = 0; i < n; ++i)
+    buf[i] = (mask[i / 32] >> (i % 32)) & 1 ? logits[i] : -INFINITY;
+  size_t best = 0;
+  for (size_t i = 1; i < n; ++i)
+    if (buf[i] > buf[best])
+      best = i;
+  if (temperature == 0)
+    return uint32_t(best);
+  float mx = buf[best];
+  double sum = 0;
+  for (size_t i = 0; i < n; ++i) {
+    buf[i] = std::exp((buf[i] - mx) / temperature);
+    sum += buf[i];
+  }
+  if (p.top_p < 1.0f) {
+    order.resize(n);
+    for (size_t i = 0; i < n; ++i)
+      order[i] = uint32_t(i);
+    std::sort(order.begin(), order.end(),
+              [&](uint32_t a, uint32_t b) { return buf[a] > buf[b]; });
+    double acc = 0;
+    size_t keep = 0;
+    while (keep < n && acc < p.top_p * sum)
+      acc += buf[order[keep++]];
+    double r = std::uniform_real_distribution<double>(0, acc)(rng);
+    for (size_t i = 0; i < keep; ++i) {
+      r -= buf[order[i]];
+      if (r <= 0)
+        return order[i];
+    }
+    return order[0];
+  }
+  double r = std::uniform_real_distribution<double>(0, sum)(rng);
+  for (size_t i = 0; i < n; ++i) {
+    r -= buf[i];
+    if (r <= 0 && buf[i] > 0)
+      return uint32_t(i);
+  }
+  return uint32_t(best);
+}
+
+// ConstrainedSampler vs mask_then_sample() over a 128k vocabulary, with
+// masks allowing 16 tokens, half of them, and all but one in 7; greedy, at
+// temperature 0.7, and with top-p 0.9 on top.
+static void bench_sampler() {
+  std::printf("constrained sampling, 128k vocabulary\n");
+  constexpr size_t N = 128256;
+  std::vector<float> logits(N), buf;
+  std::vector<uint32_t> order;
+  for (size_t i = 0; i < N; ++i)
+    logits[i] = float((i * 7919) % 10007) / 1000.0f - 5.0f;
+  cbison::ConstrainedSampler sampler(N);
+  std::mt19937_64 rng(0);
+
+  std::vector<uint32_t> mask((N + 31) / 32);
+  auto set_mask = [&](auto &&allowed) {
+    for (size_t i = 0; i < N; ++i)
+      if (allowed(i))
+        mask[i / 32] |= 1u << (i % 32);
+      else
+        mask[i / 32] &= ~(1u << (i % 32));
+  };
+  std::pair<const char *, std::function<bool(size_t)>> masks[] = {
+      {"16 allowed", [](size_t i) { return i % (N / 16) == 5; }},
+      {"half allowed", [](size_t i) { return i % 2 == 0; }},
+      {"6/7 allowed", [](size_t i) { return i % 7 != 3; }},
+  };
+  for (auto &[mask_name, allowed] : masks) {
+    set_mask(allowed);
+    cbison::SamplingParams greedy, tempered, top_p;
+    greedy.temperature = 0;
+    tempered.temperature = top_p.temperature = 0.7f;
+    top_p.top_p = 0.9f;
+    for (auto [params_name, p] : {std::pair{", greedy", greedy},
+                                  std::pair{", t=0.7", tempered},
+                                  std::pair{", t=0.7 top-p", top_p}}) {
+      std::string name = mask_name + std::string(params_name);
+      uint64_t seed = 0;
+      report(name + ", sampler", per_call_us([&] {
+               if (sampler.sample(logits.data(), mask.data(), p, seed++) ==
+                   CBISON_NO_TOKEN)
+                 abort();
+             }),
+             "us");
+      report(name + ", mask then sample", per_call_us([&] {
+               mask_then_sample(logits, mask.data(), p, buf, order, rng);
+             }),
+             "us");
+    }
+  }
+}
+
+// SpeculativeMasker over a document of a schema, with a predictor that
+// proposes the right token with the given accuracy, plus EOS, and a
+// simulated 200us forward pass between prepare() and commit(). Reports
+// the hit rate, commit() latency on hits and misses (vs consuming and
+// masking in line), and branch CPU time per token, all and wasted.
+static void bench_speculative(const Env &env) {
+  std::printf("speculative masking\n");
+  Grammar g = env.schema(64);
+  std::vector<uint32_t> doc = first_allowed_doc(env, g, 512);
+  std::vector<uint32_t> mask(env.f.maskByteLen() / 4);
+  uint32_t eos = env.f.get()->eos_token_id;
+  auto spin = [](std::chrono::microseconds d) {
+    auto t_end = Clock::now() + d;
+    while (Clock::now() < t_end)
+      ;
+  };
+
+  {
+    auto m = env.newMatcher(g);
+    double us = 0;
+    for (uint32_t t : doc) {
+      auto t0 = Clock::now();
+      if (m.consumeTokens({t}) != 0 || m.computeMask(mask.data()) != 0)
+        abort();
+      us += std::chrono::duration<double, std::micro>(Clock::now() - t0)
+                .count();
+    }
+    report("in line consume + mask", us / double(doc.size()), "us/tok");
+  }
+
+  for (double accuracy : {0.0, 0.5, 0.9}) {
+    cbison::SpeculativeMasker spec(env.f, {}, 2);
+    std::mt19937_64 rng(0);
+    std::bernoulli_distribution right(accuracy);
+    auto m = env.newMatcher(g);
+    for (uint32_t t : doc) {
+      std::vector<uint32_t> cands = {eos};
+      if (right(rng))
+        cands.push_back(t);
+      spec.prepare(m, cands);
+      spin(std::chrono::microseconds(200));
+      if (spec.commit(m, t, mask.data()) < 0)
+        abort();
+    }
+    auto st = spec.stats();
+    double n = double(doc.size());
+    std::string name = "accuracy " + std::to_string(int(accuracy * 100)) + "%";
+    report(name + ", hit rate", st.hitRate() * 100, "%");
+    report(name + ", commit on hit", st.hit_commit_us, "us");
+    report(name + ", commit on miss", st.miss_commit_us, "us");
+    report(name + ", branch CPU", st.branch_cpu_us / n, "us/tok");
+    report(name + ", wasted branch CPU", st.wastedCpuUs() / n, "us/tok");
+  }
+}
+
+int main(int argc, char *argv[]) {
+  cbison::CbisonEngineDll engine;
+  auto bt = new ByteTokenizer();
+  cbison_tokenizer_t t0 = bt->c_api();
+  cbison::Tokenizer tok(t0);
+  cbison_factory_t fptr;
+  bool mock = argc < 2;
+  if (mock) {
+    fptr = mock_new_factory(tok.vocabSize());
+  } else {
+    if (!engine.load(argv[1], argc >= 3 ? argv[2] : "")) {
+      std::cerr << "Failed to load engine library: " << argv[1] << '\n';
+      return 1;
+    }
+    std::string err;
+    fptr = engine.new_factory(t0, "{}", err);
+    if (!fptr) {
+      std::cerr << "Failed to create factory: " << err << '\n';
+      return 1;
+    }
+  }
+  t0->decr_ref_count(t0);
+  cbison::Factory f(fptr);
+  fptr->decr_ref_count(fptr);
+  Env env{f, tok, mock, mock ? nullptr : &engine};
+
+  std::printf("engine: %s\n", mock ? "mock" : argv[1]);
+  bench_fast_forward(env);
+  bench_static_binding(env);
+  bench_fork(env);
+  bench_remap(env);
+  bench_rollback(env);
+  bench_stream_decode(env);
+  bench_sampler();
+  bench_speculative(env);
+  return 0;
+}
@@ -6,14 +6,58 @@
 #include <string>
 #include <optional>
 #include <filesystem>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <thread>
+#include <chrono>
+#include <unordered_map>
+#include <future>
+#include <string_view>
 #include "cbison_api.h"
 
 namespace cbison {
 
+/// State of a matcher taken for a preempted sequence, see
+/// Matcher::snapshot() and Factory::restoreMatcher().
+struct MatcherSnapshot {
+  /// Engine snapshot; empty if the engine does not support snapshots.
+  std::vector<uint8_t> data;
+  /// Tokens to replay on restore when data is empty.
+  std::vector<uint32_t> tokens;
+};
+
+/// Counters of the mask memo of a Matcher, see Matcher::enableMaskMemo().
+struct MaskMemoStats {
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  /// Masks dropped because a different token was consumed at their
+  /// position or earlier.
+  uint64_t invalidated = 0;
+  size_t entries = 0;
+
+  double hitRate() const noexcept {
+    return hits + misses ? double(hits) / double(hits + misses) : 0.0;
+  }
+};
+
 /// C++ wrapper for a CBISON matcher instance.
 class Matcher {
+  struct MaskMemo;
+
   cbison_factory_t api_;
   cbison_matcher_t m_;
+  uint64_t id_;
+  mutable uint64_t version_ = 0;
+  std::unique_ptr<MaskMemo> memo_;
+
+  friend class Factory;
+  bool memoLookup(uint32_t *dest) const noexcept;
+  void memoStore(const uint32_t *mask) const noexcept;
 
 public:
   /// Wrap existing matcher pointer (takes ownership of the matcher).
@@ -32,19 +76,74 @@ public:
 
   cbison_matcher_t get() const noexcept { return m_; }
 
+  /// Process-wide unique id of the wrapped matcher; moves with it. Unlike
+  /// get(), it is never reused after the matcher is freed, so it can key
+  /// per-matcher state.
+  uint64_t id() const noexcept { return id_; }
+
+  /// Number of calls through this wrapper that may have changed the state
+  /// of the matcher (consume, rollback, reset); the same id() and version
+  /// mean the same state.
+  uint64_t version() const noexcept { return version_; }
+
+  /// Factory (vtable) this matcher belongs to.
+  cbison_factory_t api() const noexcept { return api_; }
+
   /// Clone the matcher.
   /// @return New Matcher.
   Matcher clone() const noexcept;
 
+  /// Fork the matcher, sharing unchanged state with this one (see
+  /// fork_matcher()); falls back to clone() if the engine does not support
+  /// forking.
+  /// @return New Matcher.
+  Matcher fork() const noexcept;
+
+  /// Whether the engine provides native fork_matcher().
+  bool hasFork() const noexcept {
+    return api_->version_minor >= 6 && api_->fork_matcher != nullptr;
+  }
+
+  /// Remember the masks of up to `capacity` recent states, indexed by the
+  /// number of tokens consumed and checked against the tokens consumed
+  /// since, so that a state reached again after rollback() or reset() and
+  /// re-consuming the same tokens is served without calling the engine.
+  /// Only changes made through this wrapper are tracked; call
+  /// invalidateMaskMemo() after mutating get() directly. Off by default,
+  /// since each entry takes mask_byte_len bytes.
+  /// @param at_start  Whether the matcher is in its initial state (e.g.,
+  ///                  fresh from Factory::newMatcher()) when the memo is
+  ///                  created. If not, the first reset() drops the masks
+  ///                  remembered until then.
+  void enableMaskMemo(size_t capacity = 8, bool at_start = false) noexcept;
+
+  /// Drop all remembered masks; the next reset() drops those remembered
+  /// until then, too.
+  void invalidateMaskMemo() const noexcept;
+
+  /// Statistics of the mask memo (zeros if not enabled).
+  MaskMemoStats maskMemoStats() const noexcept;
+
   /// Compute token mask for current state.
   /// @return Vector of representing bitmask for the entire tokenizer
   std::vector<uint32_t> computeMask() const noexcept;
 
+  /// Compute token mask for current state into caller-provided buffer.
+  /// @param dest  Buffer of mask_byte_len bytes.
+  /// @return 0 on success, -1 on error.
+  int computeMask(uint32_t *dest) const noexcept;
+
   /// Compute fast-forward (forced) tokens.
   /// @param max_tokens  Maximum buffer size.
-  /// @return Vector of token IDs, can be empty.
+  /// @return Vector of token IDs, can be empty (always empty when the engine
+  /// does not provide compute_ff_tokens(); see hasFFTokens()).
   std::vector<uint32_t> computeFFTokens(size_t max_tokens = 100) const noexcept;
 
+  /// Whether the engine computes fast-forward tokens natively.
+  bool hasFFTokens() const noexcept {
+    return api_->compute_ff_tokens != nullptr;
+  }
+
   /// Get last error message from matcher.
   /// @return Optional string; std::nullopt if no error.
   std::optional<std::string> getError() const noexcept;
@@ -65,16 +164,42 @@ public:
   /// @return 0 on success, -1 on error.
   int consumeTokens(const std::vector<uint32_t> &tokens) const noexcept;
 
+  /// Whether the engine supports snapshot_matcher()/restore_matcher().
+  bool hasSnapshot() const noexcept {
+    return api_->version_minor >= 4 && api_->snapshot_matcher &&
+           api_->restore_matcher;
+  }
+
+  /// Serialize matcher state for later restore.
+  /// @param replay_tokens  Tokens consumed by the matcher so far; kept in
+  ///                       the snapshot only if the engine cannot serialize
+  ///                       the state natively.
+  MatcherSnapshot snapshot(std::vector<uint32_t> replay_tokens = {}) const noexcept;
+
+  /// Approximate memory used by the matcher, including rollback history.
+  /// @return Number of bytes; std::nullopt if the engine does not report it.
+  std::optional<size_t> memoryUsage() const noexcept;
+
   /// Reset matcher to initial state.
   /// @return 0 on success, -1 on error.
-  int reset() const noexcept { return api_->reset ? api_->reset(m_) : -1; }
+  int reset() const noexcept;
 
   /// Backtrack matcher by n tokens.
   /// @param n  Number of tokens to rollback.
   /// @return 0 on success, -1 on error.
   int rollback(size_t n) const noexcept;
+
+  /// Take over the engine matcher (and id) of o, keeping the mask memo of
+  /// this wrapper, which move assignment would replace with o's. o must be
+  /// in the state this matcher reaches by rollback(n_rollback) and then
+  /// consuming tokens, e.g., a fork advanced separately; the memo is
+  /// updated as for those calls.
+  void replaceWith(Matcher &&o, size_t n_rollback,
+                   const std::vector<uint32_t> &tokens) noexcept;
 };
 
+class ThreadPool;
+
 /// C++ wrapper for a CBISON factory.
 class Factory {
   cbison_factory_t f_;
@@ -87,12 +212,21 @@ public:
   /// Frees the factory.
   ~Factory() noexcept;
 
+  Factory(const Factory &) = delete;
+  Factory &operator=(const Factory &) = delete;
+
+  cbison_factory_t get() const noexcept { return f_; }
+
   /// Vocabulary size.
   size_t nVocab() const noexcept { return f_->n_vocab; }
 
   /// Mask byte length: ceil(n_vocab/32)*4.
   size_t maskByteLen() const noexcept { return f_->mask_byte_len; }
 
+  /// Approximate memory used by the factory, excluding live matchers.
+  /// @return Number of bytes; std::nullopt if the engine does not report it.
+  std::optional<size_t> memoryUsage() const noexcept;
+
   /// Create new matcher.
   /// @param type     Grammar type ("regex", "json", etc.).
   /// @param grammar  Grammar string.
@@ -100,6 +234,13 @@ public:
   Matcher newMatcher(const std::string &type,
                      const std::string &grammar) const noexcept;
 
+  /// Re-create a matcher from a snapshot taken from a matcher with the same
+  /// type and grammar. Restores natively if possible, and otherwise creates
+  /// a new matcher and replays the snapshot's tokens.
+  /// @return Matcher; getError() yields error if any.
+  Matcher restoreMatcher(const std::string &type, const std::string &grammar,
+                         const MatcherSnapshot &snap) const noexcept;
+
   /// Validate grammar without creating matcher.
   /// @param type     Grammar type.
   /// @param grammar  Grammar string.
@@ -113,6 +254,201 @@ public:
   /// @return 0 on success, -1 on error.
   int computeMasks(
       const std::vector<std::pair<Matcher *, uint32_t *>> &reqs) const noexcept;
+
+  /// Whether the engine provides native batch compute_masks().
+  bool hasComputeMasks() const noexcept { return f_->compute_masks != nullptr; }
+
+  /// Batch compute masks into a model-shaped buffer (see
+  /// cbison_mask_layout). Uses the engine's compute_masks_strided() if
+  /// present; otherwise bit masks are computed in place (or in a scratch
+  /// buffer for expanded formats) and the padding is filled in.
+  /// @param rows    Matcher for each row; nullptr rows are left untouched.
+  /// @param layout  Destination buffer description.
+  /// @return 0 on success, -1 on error.
+  int computeMasksStrided(const std::vector<Matcher *> &rows,
+                          const cbison_mask_layout_t &layout) const noexcept;
+
+  /// Batch compute masks, giving up on rows not finished within timeout.
+  /// @param reqs     Vector of (Matcher*, dest_pointer) pairs.
+  /// @param timeout  Time budget for the whole batch.
+  /// @param late     Resized to reqs.size(); set to 1 for rows that missed
+  ///                 the deadline (their destination is unspecified).
+  /// @return 0 on success, -1 on error or if the engine does not provide
+  /// compute_masks_deadline().
+  int computeMasks(const std::vector<std::pair<Matcher *, uint32_t *>> &reqs,
+                   std::chrono::microseconds timeout,
+                   std::vector<uint8_t> &late) const noexcept;
+
+  /// Whether the engine provides native compute_masks_deadline().
+  bool hasComputeMasksDeadline() const noexcept {
+    return f_->version_minor >= 2 && f_->compute_masks_deadline != nullptr;
+  }
+
+  /// Run a fused decoding step (consume, fast-forward, flags, masks) for a
+  /// batch of matchers; see step_batch() in cbison_api.h.
+  /// Uses the engine's step_batch() if present; otherwise composes it from
+  /// the other entry points, one request per task on pool (if given).
+  /// Matchers are advanced through the raw pointers in reqs, so state kept
+  /// by the Matcher wrapper is not updated; call invalidateMaskMemo() on
+  /// matchers with a mask memo afterwards.
+  /// @param reqs    Requests; flags and n_ff_tokens are filled in.
+  /// @param layout  Mask buffer, or nullptr to skip masks.
+  /// @param pool    Thread pool for the fallback, or nullptr.
+  /// @return 0 on success, -1 on error.
+  int stepBatch(std::vector<cbison_step_req_t> &reqs,
+                const cbison_mask_layout_t *layout,
+                ThreadPool *pool = nullptr) const noexcept;
+
+  /// Whether the engine provides native step_batch().
+  bool hasStepBatch() const noexcept {
+    return f_->version_minor >= 5 && f_->step_batch != nullptr;
+  }
+
+  /// Whether the engine provides native compute_masks_strided().
+  bool hasComputeMasksStrided() const noexcept {
+    return f_->version_minor >= 1 && f_->compute_masks_strided != nullptr;
+  }
+};
+
+/// Size of a single mask row in bytes for the given format and padded
+/// vocabulary size; 0 for unknown format.
+size_t maskRowBytes(uint32_t format, size_t padded_vocab) noexcept;
+
+/// Write a bit mask (as produced by compute_mask()) into row `row` of the
+/// buffer described by layout, filling the padding. Can be used by engines
+/// implementing compute_masks_strided().
+/// @param bits     Bit mask covering at least n_vocab tokens.
+/// @param n_vocab  Number of tokens in the vocabulary.
+void writeMaskRow(const uint32_t *bits, size_t n_vocab,
+                  const cbison_mask_layout_t &layout, size_t row) noexcept;
+
+/// Fixed-size pool of worker threads used by the batching helpers.
+class ThreadPool {
+  std::vector<std::thread> workers_;
+  std::deque<std::function<void()>> queue_;
+  std::mutex mu_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+
+  void workerLoop();
+
+public:
+  /// Start the workers.
+  /// @param n_threads  Number of threads; 0 means hardware concurrency.
+  explicit ThreadPool(size_t n_threads = 0);
+
+  /// Joins all workers; queued tasks are still run.
+  ~ThreadPool() noexcept;
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  /// Number of worker threads.
+  size_t size() const noexcept { return workers_.size(); }
+
+  /// Run task asynchronously on one of the workers.
+  void submit(std::function<void()> task);
+
+  /// Run fn(0) .. fn(n-1) on the pool and the calling thread; returns when
+  /// all calls have finished. Safe to call from a pool worker.
+  void parallelFor(size_t n, const std::function<void(size_t)> &fn) noexcept;
+};
+
+/// Latency of ConstrainedBatch::step() phases, in microseconds.
+struct BatchStepStats {
+  uint64_t steps = 0;
+  double last_consume_us = 0;
+  double last_prune_us = 0;
+  double last_mask_us = 0;
+  double last_total_us = 0;
+  double sum_total_us = 0;
+  double max_total_us = 0;
+};
+
+/// Runs the per-step constrained decoding cycle for a dynamic set of
+/// matchers: consume sampled (and optionally fast-forward) tokens, drop
+/// stopped sequences, and compute masks for the rest.
+///
+/// Each admitted matcher gets a stable slot, which is also its row in a
+/// persistent [max_batch, mask_words] mask buffer. Not thread-safe; all
+/// methods are to be called from a single (scheduler) thread.
+class ConstrainedBatch {
+public:
+  /// Outcome of a single step().
+  struct StepResult {
+    /// Slots dropped in this step (stopped or errored); already released.
+    std::vector<size_t> stopped;
+    /// (slot, message) for dropped slots that ended in an error.
+    std::vector<std::pair<size_t, std::string>> errors;
+    /// (slot, tokens) fast-forward tokens consumed in this step; only
+    /// filled when fast-forward is enabled.
+    std::vector<std::pair<size_t, std::vector<uint32_t>>> ff_tokens;
+  };
+
+  /// @param factory    Factory the matchers come from; must outlive this.
+  /// @param max_batch  Number of slots (rows of the mask buffer).
+  /// @param n_threads  Thread pool size; 0 means hardware concurrency.
+  ConstrainedBatch(const Factory &factory, size_t max_batch,
+                   size_t n_threads = 0);
+
+  ConstrainedBatch(const ConstrainedBatch &) = delete;
+  ConstrainedBatch &operator=(const ConstrainedBatch &) = delete;
+
+  /// Take ownership of a matcher and assign it a free slot.
+  /// Used both for new sequences and for re-admission after preempt().
+  /// @return Slot index, or -1 if the batch is full or matcher is invalid.
+  int admit(Matcher &&m) noexcept;
+
+  /// Remove a sequence from the batch without freeing its matcher.
+  /// @return The matcher, or std::nullopt if the slot is not active.
+  std::optional<Matcher> preempt(size_t slot) noexcept;
+
+  /// Free the matcher in the given slot (no-op for inactive slots).
+  void release(size_t slot) noexcept;
+
+  /// Run one decoding step.
+  /// @param sampled  (slot, token) pairs sampled for the previous masks;
+  ///                 slots without an entry (e.g., just admitted) are only
+  ///                 pruned and masked.
+  /// @param res      Filled with stopped slots and fast-forward tokens.
+  /// @return 0 on success, -1 if a slot appears twice in sampled (nothing
+  /// is done then) or if mask computation failed.
+  int step(const std::vector<std::pair<size_t, uint32_t>> &sampled,
+           StepResult &res) noexcept;
+
+  /// Consume fast-forward tokens in step() after the sampled token.
+  void setFastForward(bool enabled) noexcept { ff_enabled_ = enabled; }
+
+  size_t maxBatch() const noexcept { return slots_.size(); }
+  size_t numActive() const noexcept { return n_active_; }
+  bool isActive(size_t slot) const noexcept;
+
+  /// Matcher in the given slot, or nullptr if inactive.
+  Matcher *matcher(size_t slot) noexcept;
+
+  /// Number of uint32_t words per mask row.
+  size_t maskWords() const noexcept { return words_; }
+
+  /// The [max_batch, mask_words] mask buffer; rows of inactive slots are
+  /// zero.
+  const uint32_t *masks() const noexcept { return masks_.data(); }
+  const uint32_t *maskRow(size_t slot) const noexcept {
+    return masks_.data() + slot * words_;
+  }
+
+  const BatchStepStats &stats() const noexcept { return stats_; }
+  void resetStats() noexcept { stats_ = BatchStepStats(); }
+
+private:
+  const Factory &factory_;
+  size_t words_;
+  std::vector<std::optional<Matcher>> slots_;
+  std::vector<size_t> free_slots_;
+  std::vector<uint32_t> masks_;
+  size_t n_active_ = 0;
+  bool ff_enabled_ = false;
+  BatchStepStats stats_;
+  ThreadPool pool_;
 };
 
 /// C++ wrapper for a CBISON tokenizer instance.
@@ -137,6 +473,16 @@ public:
   /// Return vector of bytes for given token.
   std::vector<uint8_t> getToken(uint32_t token_id) const noexcept;
 
+  /// Check if token is special (e.g., EOS); false also on error.
+  bool isSpecialToken(uint32_t token_id) const noexcept {
+    return t_->is_special_token(t_, token_id) == 1;
+  }
+
+  /// Whether the tokenizer provides tokenize_bytes().
+  bool hasTokenizeBytes() const noexcept {
+    return t_->tokenize_bytes != nullptr;
+  }
+
   /// Tokenize bytes, return token ids.
   std::vector<uint32_t>
   tokenizeBytes(const std::vector<uint8_t> &bytes) const noexcept;
@@ -144,6 +490,20 @@ public:
   /// Tokenize string (UTF-8), returns token ids.
   std::vector<uint32_t> tokenizeString(const std::string &s) const noexcept;
 
+  /// Whether the tokenizer provides native tokenize_bytes_batch().
+  bool hasTokenizeBytesBatch() const noexcept {
+    return t_->version_minor >= 1 && t_->tokenize_bytes_batch != nullptr;
+  }
+
+  /// Tokenize many byte strings in one call (see tokenize_bytes_batch());
+  /// falls back to calling tokenize_bytes() for each input.
+  /// @param inputs   Byte strings.
+  /// @param tokens   Output: tokens of all inputs, concatenated.
+  /// @param offsets  Output: inputs.size() + 1 offsets into tokens.
+  void tokenizeBytesBatch(const std::vector<std::string_view> &inputs,
+                          std::vector<uint32_t> &tokens,
+                          std::vector<size_t> &offsets) const noexcept;
+
   /// Vocabulary size.
   size_t vocabSize() const noexcept { return t_->n_vocab; }
 
@@ -156,9 +516,933 @@ public:
   }
 };
 
+/// Result of FastForward::run().
+struct FastForwardResult {
+  /// Number of forced tokens found in the matcher state.
+  size_t n_forced = 0;
+  /// Number of trailing history tokens replaced by retokenization.
+  size_t n_drop = 0;
+  /// Tokens to append (after dropping n_drop); none of them need sampling.
+  std::vector<uint32_t> tokens;
+  /// First position whose KV entry must be (re)computed; equals
+  /// history.size() - n_drop.
+  size_t kv_recompute_from = 0;
+  /// Whether forced tokens were found by mask emulation.
+  bool emulated = false;
+};
+
+/// Counters accumulated by FastForward.
+struct FastForwardStats {
+  uint64_t calls = 0;
+  uint64_t forced_tokens = 0;   ///< tokens appended without sampling
+  uint64_t emulated_tokens = 0; ///< forced tokens found by emulation
+  uint64_t retokenized = 0;     ///< calls where the splice was retokenized
+  uint64_t dropped_tokens = 0;  ///< history tokens replaced by retokenizing
+  double total_us = 0;
+};
+
+/// Jump-forward decoding driver.
+///
+/// Advances a matcher past its forced tokens, obtained from
+/// compute_ff_tokens() or, when the engine lacks it, by emulation: while
+/// all allowed tokens share a byte prefix and one of them is exactly that
+/// prefix, that token is consumed. Emulation gives up on masks with more
+/// than 256 allowed tokens, so it can miss forced bytes that a native
+/// implementation would find. The last few history tokens together
+/// with the forced ones are then retokenized with tokenize_bytes(), so the
+/// splice boundary matches what the tokenizer would produce for the text
+/// (e.g., `"` + `name` forced after `{` becomes `{"` + `name`). This part
+/// requires rollback() in the engine.
+class FastForward {
+public:
+  /// @param tok         Tokenizer the factory was built for; must outlive
+  ///                    this.
+  /// @param max_tokens  Maximum number of forced tokens per run().
+  /// @param window      Number of trailing history tokens retokenized
+  ///                    together with the forced ones.
+  FastForward(const Tokenizer &tok, size_t max_tokens = 100,
+              size_t window = 4) noexcept
+      : tok_(tok), max_tokens_(max_tokens), window_(window) {}
+
+  /// Advance the matcher past the forced tokens.
+  /// @param m        Matcher that has consumed exactly `history`.
+  /// @param history  Tokens of the sequence so far.
+  /// @param res      Tokens to splice into the sequence.
+  /// @return 0 on success, -1 if the matcher failed to consume tokens
+  ///         (then it no longer matches `history` and should be dropped).
+  int run(const Matcher &m, const std::vector<uint32_t> &history,
+          FastForwardResult &res) noexcept;
+
+  /// Force emulation even if the engine computes forced tokens natively.
+  void setEmulate(bool always) noexcept { always_emulate_ = always; }
+
+  const FastForwardStats &stats() const noexcept { return stats_; }
+
+private:
+  const Tokenizer &tok_;
+  size_t max_tokens_;
+  size_t window_;
+  bool always_emulate_ = false;
+  FastForwardStats stats_;
+
+  int emulate(const Matcher &m, std::vector<uint32_t> &forced) noexcept;
+  int retokenize(const Matcher &m, const std::vector<uint32_t> &history,
+                 const std::vector<uint32_t> &forced,
+                 FastForwardResult &res) noexcept;
+};
+
+/// Counters of OptimisticDecoder for a single grammar type.
+struct OptimisticStats {
+  uint64_t steps = 0;      ///< calls to select()
+  uint64_t optimistic = 0; ///< steps where candidates were validated
+  uint64_t fallbacks = 0;  ///< optimistic steps with all candidates rejected
+  uint64_t masked = 0;     ///< steps that computed the full mask
+  double validate_us = 0;  ///< moving average of candidate validation time
+  double mask_us = 0;      ///< moving average of compute_mask() time
+  /// Moving average of the fallback rate; decides always_mask.
+  double recent_fallback_rate = 0;
+  bool always_mask = false;
+
+  /// Fallback rate over all optimistic steps.
+  double fallbackRate() const noexcept {
+    return optimistic ? double(fallbacks) / double(optimistic) : 0.0;
+  }
+};
+
+/// Optimistic sample-then-validate decoding.
+///
+/// Instead of computing the full mask every step, the caller samples a few
+/// candidates from the unmasked distribution, and select() checks them with
+/// single-token validate_tokens(). Only when all of them are rejected is the
+/// mask computed, and the caller resamples with it.
+///
+/// Costs are tracked per grammar type; types where validation plus
+/// fallbacks cost more than always computing the mask are switched to
+/// always-mask, and re-probed every probe_interval steps.
+/// Thread-safe.
+class OptimisticDecoder {
+public:
+  struct Options {
+    /// Steps of a grammar type before its policy can switch.
+    uint64_t min_steps = 64;
+    /// In always-mask mode, try optimistic validation every this many steps.
+    uint64_t probe_interval = 256;
+  };
+
+  OptimisticDecoder() noexcept : OptimisticDecoder(Options()) {}
+  explicit OptimisticDecoder(const Options &opts) noexcept : opts_(opts) {}
+
+  /// Pick a grammar-legal token or compute the mask.
+  /// @param m             Matcher for the sequence.
+  /// @param grammar_type  Type passed to newMatcher(); the statistics key.
+  /// @param candidates    Sampled tokens, in order of preference.
+  /// @param token         Set to the first accepted candidate.
+  /// @param mask          Buffer of mask_byte_len bytes; filled when all
+  ///                      candidates are rejected (or in always-mask mode).
+  /// @return 1 if token was set, 0 if mask was computed (resample with it),
+  /// -1 on error.
+  int select(const Matcher &m, const std::string &grammar_type,
+             const std::vector<uint32_t> &candidates, uint32_t &token,
+             uint32_t *mask) noexcept;
+
+  /// Statistics for the given grammar type (zeros if never seen).
+  OptimisticStats stats(const std::string &grammar_type) const noexcept;
+
+  /// Statistics for all grammar types seen so far.
+  std::vector<std::pair<std::string, OptimisticStats>>
+  allStats() const noexcept;
+
+private:
+  Options opts_;
+  mutable std::mutex mu_;
+  std::vector<std::pair<std::string, OptimisticStats>> types_;
+
+  OptimisticStats &typeStats(const std::string &grammar_type);
+  bool shouldTryOptimistic(const std::string &grammar_type);
+  void record(const std::string &grammar_type, bool tried, bool fell_back,
+              double validate_us, double mask_us);
+};
+
+/// What DeadlineMasker does with rows that miss the deadline.
+enum class LatePolicy {
+  /// The mask is finished in the background, into a buffer of its own.
+  /// DeadlineMasker::waitLate() waits for it and writes it to the row's
+  /// destination; a later computeMasks() call with the row not advanced
+  /// meanwhile gets it as Ready, or Late again if it is still running.
+  FinishLate,
+  /// The last mask computed for the matcher is used instead (falls back to
+  /// ValidateOnSample if there is none). It may allow tokens that are not
+  /// valid anymore, so the sampled token has to be validated.
+  CachedMask,
+  /// All tokens are allowed; the sampled token has to be checked with
+  /// validate_tokens() (e.g., through OptimisticDecoder).
+  ValidateOnSample,
+};
+
+/// Per-row outcome of DeadlineMasker::computeMasks().
+enum class MaskRowStatus : uint8_t {
+  Ready,            ///< mask computed in time
+  Late,             ///< FinishLate: mask delivered later (see FinishLate)
+  Cached,           ///< stale mask from an earlier step
+  ValidateOnSample, ///< all tokens allowed; validate the sampled token
+};
+
+/// Tail-latency counters of DeadlineMasker.
+struct DeadlineStats {
+  uint64_t calls = 0;
+  uint64_t rows = 0;
+  uint64_t late_rows = 0;
+  uint64_t calls_with_late = 0;
+  uint64_t cached_rows = 0;   ///< late rows served from cache
+  uint64_t validate_rows = 0; ///< late rows served as all-allowed
+  uint64_t waited_rows = 0;   ///< late rows waited for (no native fork)
+  double max_call_us = 0;
+  double sum_call_us = 0;
+  double max_late_us = 0; ///< slowest late row, measured from call start
+};
+
+/// Batch mask computation with a deadline.
+///
+/// Rows that are not done within the time budget are handled according to
+/// a LatePolicy, so a single pathological grammar state does not stall the
+/// whole batch. Uses the engine's compute_masks_deadline() when available
+/// (late rows are then abandoned by the engine); otherwise rows are
+/// computed on an internal thread pool, each on a fork of its matcher, and
+/// late ones keep running in the background on the fork. The caller's
+/// matchers are thus never used after computeMasks() returns. A matcher
+/// that is still late from an earlier call is treated as late again
+/// without starting another computation. Without native fork_matcher()
+/// (a clone copies the whole state, which may cost as much as the mask),
+/// rows are computed in place and waited for past the deadline.
+///
+/// Methods are to be called from a single thread.
+class DeadlineMasker {
+public:
+  /// @param factory    Factory the matchers come from; must outlive this.
+  /// @param policy     Treatment of late rows.
+  /// @param n_threads  Thread pool size; 0 means hardware concurrency.
+  DeadlineMasker(const Factory &factory, LatePolicy policy,
+                 size_t n_threads = 0);
+
+  /// Waits for late rows.
+  ~DeadlineMasker() noexcept;
+
+  DeadlineMasker(const DeadlineMasker &) = delete;
+  DeadlineMasker &operator=(const DeadlineMasker &) = delete;
+
+  /// Batch compute masks with a deadline.
+  /// @param reqs     Vector of (Matcher*, dest_pointer) pairs; with
+  ///                 FinishLate, the buffer of a Late row must stay alive
+  ///                 until waitLate(), or until the row is passed again.
+  /// @param timeout  Time budget for the whole batch.
+  /// @param status   Resized to reqs.size(); outcome of each row.
+  /// @return 0 on success, -1 on error.
+  int computeMasks(const std::vector<std::pair<Matcher *, uint32_t *>> &reqs,
+                   std::chrono::microseconds timeout,
+                   std::vector<MaskRowStatus> &status) noexcept;
+
+  /// Wait until all late rows are finished; with FinishLate, their masks
+  /// are then written to their destinations.
+  void waitLate() noexcept;
+
+  /// Drop the cached or late mask of a matcher; call before freeing it
+  /// with LatePolicy::CachedMask or FinishLate.
+  void forget(const Matcher &m) noexcept;
+
+  const DeadlineStats &stats() const noexcept { return stats_; }
+
+private:
+  struct Shared;
+
+  const Factory &factory_;
+  LatePolicy policy_;
+  std::shared_ptr<Shared> sh_;
+  DeadlineStats stats_;
+  ThreadPool pool_;
+
+  void applyPolicy(const Matcher &m, uint32_t *dest, MaskRowStatus &status);
+  int finishLate(const Matcher &m, uint32_t *dest,
+                 std::chrono::steady_clock::time_point t0, uint64_t epoch,
+                 MaskRowStatus &status);
+};
+
+/// Memory used by matchers of a single grammar type.
+struct GrammarMemoryUsage {
+  size_t matchers = 0; ///< number of tracked matchers
+  size_t bytes = 0;    ///< total reported by the engine
+  size_t unknown = 0;  ///< matchers the engine could not report on
+};
+
+/// Aggregate memory usage, see MemoryBudget::usage().
+struct MemoryUsage {
+  size_t total = 0;
+  size_t factories = 0;
+  size_t matchers = 0;
+  std::vector<std::pair<std::string, GrammarMemoryUsage>> by_type;
+};
+
+/// Global memory cap for matchers and factories.
+///
+/// Aggregates matcher_memory_usage() of tracked matchers and
+/// factory_memory_usage() of registered factories. When the total exceeds
+/// the cap, enforce() runs trimming callbacks (e.g., shrinking rollback
+/// history, dropping cached grammars, preempting sequences) in order of
+/// priority until usage is back under the cap.
+/// Thread-safe as far as its own state goes; usage() and enforce() call
+/// matcher_memory_usage() on tracked matchers, so, like any other call on
+/// a matcher, they must not overlap with calls advancing those matchers on
+/// other threads (e.g., call them between decoding steps).
+class MemoryBudget {
+public:
+  /// Trimming callback; gets the number of bytes over the cap and returns
+  /// (an estimate of) the number of bytes it freed.
+  using TrimFn = std::function<size_t(size_t excess)>;
+
+  /// @param cap_bytes  Global cap; 0 means unlimited.
+  explicit MemoryBudget(size_t cap_bytes = 0) noexcept : cap_(cap_bytes) {}
+
+  void setCap(size_t cap_bytes) noexcept;
+  size_t cap() const noexcept;
+
+  /// Count the factory's own memory; it must stay alive until removed.
+  void addFactory(const Factory &f) noexcept;
+  void removeFactory(const Factory &f) noexcept;
+
+  /// Start tracking a matcher under the given grammar type. The wrapper is
+  /// tracked, not the engine matcher, so m may replace its engine matcher
+  /// (see Matcher::replaceWith()), but must not be moved.
+  void track(const Matcher &m, const std::string &grammar_type) noexcept;
+
+  /// Stop tracking a matcher; call before it is destroyed.
+  void untrack(const Matcher &m) noexcept;
+
+  /// Register a trimming callback; lower priority runs first.
+  void addTrimCallback(TrimFn fn, int priority = 0) noexcept;
+
+  /// Query the engines for current usage.
+  MemoryUsage usage() const noexcept;
+
+  /// Run trimming callbacks while usage exceeds the cap.
+  /// @return Usage after trimming.
+  MemoryUsage enforce() noexcept;
+
+private:
+  mutable std::mutex mu_;
+  size_t cap_;
+  std::vector<cbison_factory_t> factories_;
+  std::unordered_map<const Matcher *, std::string> matchers_;
+  std::vector<std::pair<int, TrimFn>> trimmers_;
+
+  MemoryUsage usageLocked() const;
+};
+
+/// Options for MaskArena.
+struct MaskArenaOptions {
+  /// Maximum number of slots; address space for all of them is reserved up
+  /// front, so growing the batch never moves rows.
+  size_t max_slots = 1024;
+  /// Number of buffers: 2 for double, 3 for triple buffering.
+  size_t n_buffers = 2;
+  /// Back the arena with huge pages (explicit if available, otherwise
+  /// transparent huge pages are requested).
+  bool huge_pages = false;
+  /// mlock() rows as the batch grows, so they are never paged out.
+  bool lock_memory = false;
+};
+
+/// Statistics of MaskArena.
+struct MaskArenaStats {
+  size_t live_slots = 0;
+  size_t high_water = 0;      ///< highest slot ever used plus one
+  double fragmentation = 0;   ///< free slots below high_water / high_water
+  size_t reserved_bytes = 0;  ///< address space reserved
+  size_t resident_bytes = 0;  ///< pages actually backed by memory
+  size_t locked_bytes = 0;    ///< bytes locked with mlock()
+  bool huge_pages = false;    ///< whether huge pages are in use
+  long minor_faults = 0;      ///< process-wide, since arena creation
+  long major_faults = 0;      ///< process-wide, since arena creation
+};
+
+/// Pooled storage for batch masks.
+///
+/// Rows are 64-byte aligned and addressed by stable slot; each of the
+/// n_buffers buffers holds a row for every slot, so the masks for step t+1
+/// can be written into one buffer while the sampler (or a DMA transfer)
+/// still reads step t from another.
+/// Not thread-safe.
+class MaskArena {
+public:
+  /// @param mask_byte_len  Bytes per mask (Factory::maskByteLen()).
+  MaskArena(size_t mask_byte_len, const MaskArenaOptions &opts = {});
+  ~MaskArena() noexcept;
+
+  MaskArena(const MaskArena &) = delete;
+  MaskArena &operator=(const MaskArena &) = delete;
+
+  /// Whether memory was successfully reserved.
+  bool ok() const noexcept { return base_ != nullptr; }
+
+  /// Allocate the lowest free slot; its rows are zeroed.
+  /// @return Slot index, or -1 if all max_slots are in use.
+  int allocSlot() noexcept;
+
+  /// Return a slot to the pool.
+  void freeSlot(size_t slot) noexcept;
+
+  /// Switch to the next buffer (round-robin) and return its index.
+  size_t advance() noexcept;
+
+  /// Index of the buffer written in the current step.
+  size_t current() const noexcept { return cur_; }
+
+  /// Distance between rows in bytes; a multiple of 64.
+  size_t rowStride() const noexcept { return stride_; }
+
+  size_t maxSlots() const noexcept { return opts_.max_slots; }
+
+  /// Start of buffer b ([max_slots, rowStride()] bytes).
+  uint32_t *buffer(size_t b) const noexcept {
+    return reinterpret_cast<uint32_t *>(base_ + b * buffer_bytes_);
+  }
+
+  /// Row of slot in buffer b.
+  uint32_t *row(size_t b, size_t slot) const noexcept {
+    return reinterpret_cast<uint32_t *>(base_ + b * buffer_bytes_ +
+                                        slot * stride_);
+  }
+
+  /// Row of slot in the current buffer.
+  uint32_t *row(size_t slot) const noexcept { return row(cur_, slot); }
+
+  /// Layout of buffer b (rows indexed by slot) for
+  /// Factory::computeMasksStrided().
+  cbison_mask_layout_t layout(size_t b) const noexcept;
+
+  MaskArenaStats stats() const noexcept;
+
+private:
+  MaskArenaOptions opts_;
+  size_t mask_byte_len_;
+  size_t stride_;
+  size_t buffer_bytes_ = 0;
+  size_t mapped_bytes_ = 0;
+  uint8_t *base_ = nullptr;
+  bool huge_ = false;
+  size_t cur_ = 0;
+  size_t high_water_ = 0;
+  size_t locked_rows_ = 0;
+  std::vector<size_t> free_; // free slots below high_water_, a min-heap
+  long faults_min0_ = 0, faults_maj0_ = 0;
+};
+
+/// Options for MatcherPrefixCache.
+struct PrefixCacheOptions {
+  /// Memory budget for cached states; least recently used ones are evicted
+  /// beyond it.
+  size_t max_bytes = 256 << 20;
+  /// Prefixes shorter than this are not cached.
+  size_t min_prefix = 4;
+  /// Size assumed for a cached state when the engine does not report
+  /// matcher_memory_usage().
+  size_t state_bytes = 64 << 10;
+};
+
+/// Statistics of MatcherPrefixCache.
+struct PrefixCacheStats {
+  uint64_t lookups = 0;
+  uint64_t hits = 0;            ///< lookups starting from a cached state
+  uint64_t tokens_reused = 0;   ///< tokens not replayed thanks to the cache
+  uint64_t tokens_replayed = 0; ///< tokens consumed after the cached state
+  uint64_t insertions = 0;
+  uint64_t evictions = 0;
+  size_t entries = 0;
+  size_t bytes = 0;
+};
+
+/// Cache of matcher states keyed by (grammar, consumed-token prefix), like
+/// prefix caching of the KV cache: requests with the same grammar often
+/// start with the same forced or sampled tokens, and a new matcher can
+/// start from the deepest cached state instead of replaying all of them.
+///
+/// States live in a radix tree per grammar; they are stored at the end of
+/// each looked-up sequence and at the points where sequences diverge.
+/// Cached states are kept as forks (see Matcher::fork()), or as snapshots
+/// when the engine cannot clone; with neither, nothing is cached. Forks and
+/// snapshots are taken outside of the cache lock. Thread-safe.
+class MatcherPrefixCache {
+public:
+  /// @param factory  Factory the matchers come from; must outlive this.
+  explicit MatcherPrefixCache(const Factory &factory,
+                              PrefixCacheOptions opts = {});
+  ~MatcherPrefixCache() noexcept;
+
+  MatcherPrefixCache(const MatcherPrefixCache &) = delete;
+  MatcherPrefixCache &operator=(const MatcherPrefixCache &) = delete;
+
+  /// Create a matcher that has consumed the given tokens, starting from the
+  /// deepest cached prefix, and cache the new states.
+  /// @param n_cached  If not null, set to the number of tokens covered by
+  ///                  the cache.
+  /// @return Matcher; getError() yields error if any (e.g., tokens not
+  ///         allowed by the grammar).
+  Matcher newMatcher(const std::string &type, const std::string &grammar,
+                     const std::vector<uint32_t> &tokens,
+                     size_t *n_cached = nullptr) noexcept;
+
+  /// Cache the state of m, which has consumed tokens from the start of
+  /// the grammar (e.g., after fast-forwarding).
+  void insert(const std::string &type, const std::string &grammar,
+              const std::vector<uint32_t> &tokens, const Matcher &m) noexcept;
+
+  /// Evict least recently used states until at least `bytes` are freed;
+  /// usable as a MemoryBudget trimming callback.
+  /// @return Bytes freed.
+  size_t trim(size_t bytes) noexcept;
+
+  /// Drop all cached states.
+  void clear() noexcept;
+
+  PrefixCacheStats stats() const noexcept;
+
+private:
+  struct Entry;
+  struct Node;
+
+  const Factory &factory_;
+  PrefixCacheOptions opts_;
+  mutable std::mutex mu_;
+  std::unordered_map<std::string, std::unique_ptr<Node>> roots_;
+  std::list<Node *> lru_;
+  PrefixCacheStats stats_;
+
+  bool canFork() const noexcept;
+  void store(const std::string &key, const std::vector<uint32_t> &tokens,
+             size_t len, const Matcher &m);
+  void insertLocked(const std::string &key, const std::vector<uint32_t> &tokens,
+                    size_t len, std::shared_ptr<Entry> &e);
+  void evictLocked(Node *n);
+  size_t evictUntilLocked(size_t max_bytes);
+};
+
+/// Options for CheckpointedMatcher.
+struct CheckpointOptions {
+  /// Maximum number of checkpoints kept; the oldest ones are dropped beyond
+  /// it, which limits how far back rollback can go.
+  size_t max_checkpoints = 32;
+  /// Memory budget for checkpoints (as reported by matcher_memory_usage(),
+  /// or state_bytes per checkpoint).
+  size_t max_bytes = 32 << 20;
+  /// Bounds of the distance between checkpoints, in tokens.
+  size_t min_interval = 1;
+  size_t max_interval = 256;
+  /// Size assumed for a checkpoint when the engine does not report
+  /// matcher_memory_usage().
+  size_t state_bytes = 64 << 10;
+  /// Use the engine's rollback() when it has one, and take no checkpoints.
+  bool prefer_native = true;
+};
+
+/// Statistics of CheckpointedMatcher.
+struct CheckpointStats {
+  uint64_t consumed = 0;          ///< tokens consumed
+  uint64_t rollbacks = 0;         ///< successful rollback() calls
+  uint64_t native_rollbacks = 0;  ///< of those, done by the engine
+  uint64_t tokens_replayed = 0;   ///< tokens re-consumed after a restore
+  uint64_t checkpoints_taken = 0;
+  uint64_t checkpoints_dropped = 0;
+  double consume_us = 0;          ///< moving average per consumed token
+  double checkpoint_us = 0;       ///< moving average per checkpoint
+  size_t interval = 0;            ///< current checkpoint spacing
+  size_t checkpoints = 0;         ///< checkpoints held now
+  size_t bytes = 0;               ///< memory held by checkpoints
+};
+
+/// Rollback for any engine that can clone matchers.
+///
+/// When the engine leaves rollback() NULL, the matcher is forked every few
+/// tokens into a ring of checkpoints, and rollback() restores the latest
+/// checkpoint at or before the target and replays the tokens since. The
+/// spacing minimizes the expected cost per token, checkpoint_cost/interval
+/// + rollback_rate * consume_cost * interval/2, using measured consume and
+/// checkpoint times and the observed rollback rate. Without clone_matcher,
+/// rollback resets the matcher and replays everything consumed since
+/// construction (the matcher has to start at the beginning of the grammar).
+/// Not thread-safe, like Matcher.
+class CheckpointedMatcher {
+public:
+  /// @param m  Matcher to wrap; rollback cannot go before its current
+  ///           state. Its mask memo, if enabled, carries over restored
+  ///           checkpoints (see Matcher::replaceWith()).
+  explicit CheckpointedMatcher(Matcher m, CheckpointOptions opts = {}) noexcept;
+
+  CheckpointedMatcher(CheckpointedMatcher &&) noexcept = default;
+  CheckpointedMatcher &operator=(CheckpointedMatcher &&) noexcept = default;
+
+  /// The live matcher, for computing masks etc. Replaced by rollback();
+  /// do not consume tokens or roll back through it directly.
+  const Matcher &matcher() const noexcept { return m_; }
+
+  /// Consume tokens, taking a checkpoint when due.
+  /// @return 0 on success, -1 on error.
+  int consumeTokens(const std::vector<uint32_t> &tokens) noexcept;
+
+  /// Backtrack by n tokens. With checkpoints, nothing changes on error
+  /// either. Without clone_matcher, the matcher is reset and replayed in
+  /// place, and a failed replay leaves it unusable (it can only be reset).
+  /// @return 0 on success, -1 if n exceeds maxRollback() (nothing changes
+  /// then) or on error.
+  int rollback(size_t n) noexcept;
+
+  /// Go back to the state at construction (native reset() if available).
+  /// @return 0 on success, -1 on error.
+  int reset() noexcept;
+
+  /// Tokens consumed since construction or reset, net of rollbacks.
+  size_t position() const noexcept { return pos_; }
+
+  /// How many tokens rollback() can currently undo.
+  size_t maxRollback() const noexcept;
+
+  /// Whether rollback() is done by the engine.
+  bool isNative() const noexcept { return native_; }
+
+  CheckpointStats stats() const noexcept;
+
+private:
+  struct Checkpoint {
+    size_t pos;
+    Matcher m;
+    size_t bytes;
+  };
+
+  Matcher m_;
+  CheckpointOptions opts_;
+  bool native_;
+  bool can_fork_;
+  size_t pos_ = 0;
+  size_t base_pos_ = 0; // position of tokens_[0]
+  std::vector<uint32_t> tokens_;
+  std::deque<Checkpoint> ring_;
+  size_t interval_;
+  size_t since_checkpoint_ = 0;
+  CheckpointStats stats_;
+
+  void checkpoint() noexcept;
+  void dropOldest() noexcept;
+  void adaptInterval() noexcept;
+};
+
+/// How StreamDecoder outputs special tokens (e.g., <|eot_id|>).
+enum class SpecialTokenPolicy {
+  Skip,   ///< left out of the text
+  Render, ///< their bytes from get_token() are written out
+};
+
+/// Incremental detokenization for streaming many sequences.
+///
+/// The bytes of all tokens are fetched once at construction into a flat
+/// table, so decoding does not call the tokenizer. Each sequence keeps the
+/// bytes of a UTF-8 character split across tokens until it is complete;
+/// only valid UTF-8 is output, with U+FFFD for invalid sequences.
+/// Not thread-safe.
+class StreamDecoder {
+public:
+  /// Tokens to append to one sequence.
+  struct Req {
+    size_t seq;
+    const uint32_t *tokens;
+    size_t n_tokens;
+  };
+
+  /// @param tok      Tokenizer; only used during construction.
+  /// @param special  What to do with special tokens. When rendered, a
+  ///                 leading 0xFF marker byte (used by some tokenizers to
+  ///                 tell special tokens from text) is dropped.
+  explicit StreamDecoder(
+      const Tokenizer &tok,
+      SpecialTokenPolicy special = SpecialTokenPolicy::Skip) noexcept;
+
+  /// Append the text of tokens of sequence seq to out.
+  /// @return 0 on success, -1 if some tokens were out of range (they are
+  /// skipped).
+  int decode(size_t seq, const std::vector<uint32_t> &tokens,
+             std::string &out) noexcept;
+
+  /// Decode tokens of many sequences in one call.
+  /// @param reqs     Requests; a sequence may appear more than once.
+  /// @param out      Output: text of all requests, concatenated.
+  /// @param offsets  Output: reqs.size() + 1 offsets into out.
+  /// @return 0 on success, -1 if some tokens were out of range.
+  int decodeBatch(const std::vector<Req> &reqs, std::string &out,
+                  std::vector<size_t> &offsets) noexcept;
+
+  /// Decode one step of a batch: tokens[i] is appended to sequence i
+  /// (CBISON_NO_TOKEN for none); output as in decodeBatch().
+  int decodeStep(const std::vector<uint32_t> &tokens, std::string &out,
+                 std::vector<size_t> &offsets) noexcept;
+
+  /// Write out the incomplete character at the end of sequence seq (as
+  /// U+FFFD), e.g., when the sequence stops.
+  void flush(size_t seq, std::string &out) noexcept;
+
+  /// Forget the state of sequence seq (e.g., when its slot is reused).
+  void reset(size_t seq) noexcept;
+
+  /// Bytes of sequence seq held back as an incomplete character.
+  size_t pendingBytes(size_t seq) const noexcept;
+
+  /// Bytes of the given token; empty if out of range.
+  std::string_view tokenBytes(uint32_t token_id) const noexcept;
+
+  size_t vocabSize() const noexcept { return special_.size(); }
+
+private:
+  struct SeqState {
+    uint8_t pending[4] = {};
+    uint8_t n_pending = 0;
+    uint8_t need = 0; // continuation bytes still expected
+  };
+
+  SpecialTokenPolicy policy_;
+  std::string bytes_;
+  std::vector<uint32_t> offsets_;
+  std::vector<uint8_t> special_;
+  std::vector<SeqState> seqs_;
+
+  SeqState &state(size_t seq);
+  int append(SeqState &st, const uint32_t *tokens, size_t n,
+             std::string &out) noexcept;
+  static void appendUtf8(SeqState &st, const uint8_t *p, size_t n,
+                         std::string &out) noexcept;
+  static void flushState(SeqState &st, std::string &out) noexcept;
+};
+
+/// Parameters of ConstrainedSampler.
+struct SamplingParams {
+  /// Softmax temperature; 0 picks the most likely allowed token.
+  float temperature = 1.0f;
+  /// Keep only the k most likely allowed tokens; 0 keeps all.
+  size_t top_k = 0;
+  /// Keep the most likely allowed tokens covering this probability mass.
+  float top_p = 1.0f;
+  /// Drop tokens less likely than min_p times the most likely one.
+  float min_p = 0.0f;
+};
+
+/// One row of ConstrainedSampler::sampleBatch().
+struct SampleRow {
+  /// At least n_vocab logits.
+  const float *logits = nullptr;
+  /// Allowed tokens as a bit mask (see compute_mask()), or nullptr to use
+  /// the allowed list instead.
+  const uint32_t *mask = nullptr;
+  const uint32_t *allowed = nullptr;
+  size_t n_allowed = 0;
+  SamplingParams params;
+  /// The same seed, logits and allowed tokens give the same token.
+  uint64_t seed = 0;
+  /// Output: sampled token; CBISON_NO_TOKEN if no token is allowed.
+  uint32_t token = CBISON_NO_TOKEN;
+};
+
+/// Counters of ConstrainedSampler.
+struct SamplerStats {
+  uint64_t rows = 0;
+  uint64_t dense = 0;  ///< rows sampled by scanning the whole mask
+  uint64_t sparse = 0; ///< rows sampled from the list of allowed tokens
+  uint64_t empty = 0;  ///< rows with no allowed token
+};
+
+/// Sampling restricted to the tokens allowed by a mask.
+///
+/// Instead of masking the logits and running softmax and top-k/top-p over
+/// the whole vocabulary, only allowed tokens are looked at. Masks allowing
+/// few tokens are turned into a candidate list; for dense masks without
+/// top-k/top-p the maximum (AVX2 when available), normalizer and sample are
+/// computed in passes over the mask. Thread-safe.
+class ConstrainedSampler {
+public:
+  /// @param n_vocab  Number of tokens (Factory::nVocab()).
+  /// @param pool     Pool for sampleBatch(); nullptr runs all rows on the
+  ///                 calling thread. Must outlive this.
+  explicit ConstrainedSampler(size_t n_vocab,
+                              ThreadPool *pool = nullptr) noexcept
+      : n_vocab_(n_vocab), pool_(pool) {}
+
+  /// Sample one token from the tokens allowed by mask.
+  /// @return Token; CBISON_NO_TOKEN if no token is allowed.
+  uint32_t sample(const float *logits, const uint32_t *mask,
+                  const SamplingParams &params, uint64_t seed) noexcept;
+
+  /// Sample one token from the listed tokens.
+  /// @return Token; CBISON_NO_TOKEN if the list has no valid token.
+  uint32_t sample(const float *logits, const std::vector<uint32_t> &allowed,
+                  const SamplingParams &params, uint64_t seed) noexcept;
+
+  /// Sample all rows, in parallel on the pool.
+  /// @return 0 on success, -1 if some row had no allowed token.
+  int sampleBatch(std::vector<SampleRow> &rows) noexcept;
+
+  SamplerStats stats() const noexcept;
+
+private:
+  size_t n_vocab_;
+  ThreadPool *pool_;
+  std::atomic<uint64_t> rows_{0};
+  std::atomic<uint64_t> dense_{0};
+  std::atomic<uint64_t> sparse_{0};
+  std::atomic<uint64_t> empty_{0};
+
+  void sampleRow(SampleRow &row) noexcept;
+};
+
+/// Counters of SpeculativeMasker.
+struct SpeculativeStats {
+  uint64_t prepared = 0;  ///< prepare() calls
+  uint64_t branches = 0;  ///< candidate branches started
+  uint64_t hits = 0;      ///< commit() with a prepared branch for the token
+  uint64_t misses = 0;    ///< commit() that consumed and masked in line
+  uint64_t waited = 0;    ///< hits whose branch was not finished yet
+  double branch_cpu_us = 0; ///< total time spent in branch tasks
+  double useful_cpu_us = 0; ///< of that, in branches that were promoted
+  double hit_commit_us = 0;  ///< moving average of commit() latency on hits
+  double miss_commit_us = 0; ///< moving average of commit() latency on misses
+
+  double hitRate() const noexcept {
+    return hits + misses ? double(hits) / double(hits + misses) : 0.0;
+  }
+  double wastedCpuUs() const noexcept { return branch_cpu_us - useful_cpu_us; }
+};
+
+/// Options for SpeculativeMasker.
+struct SpeculativeOptions {
+  /// Branches prepared per matcher; further candidates are ignored.
+  size_t max_branches = 4;
+};
+
+/// Next-step mask precomputation while the model runs.
+///
+/// prepare() forks the matcher for each likely next token (e.g., from a
+/// draft model or the previous step's top-k), and the forks consume their
+/// token and compute the mask on the pool, while the forward pass keeps
+/// the GPU busy. When commit() gets a prepared token, the fork replaces the
+/// matcher and its mask is copied out; otherwise the token is consumed and
+/// the mask computed in line. Needs clone_matcher(); without it every
+/// commit() is a miss. Thread-safe.
+class SpeculativeMasker {
+public:
+  /// @param factory    Factory the matchers come from; must outlive this.
+  /// @param n_threads  Thread pool size; 0 means hardware concurrency.
+  explicit SpeculativeMasker(const Factory &factory,
+                             SpeculativeOptions opts = {},
+                             size_t n_threads = 0);
+
+  /// Cancels pending branches and waits for running ones.
+  ~SpeculativeMasker() noexcept;
+
+  SpeculativeMasker(const SpeculativeMasker &) = delete;
+  SpeculativeMasker &operator=(const SpeculativeMasker &) = delete;
+
+  /// Start preparing branches of m for the candidate tokens, replacing
+  /// earlier ones for m. Forks are taken before returning, so m can be
+  /// used meanwhile. Branches are kept by m.id() and dropped by the next
+  /// commit() if m was changed otherwise (Matcher::version()); call
+  /// cancel() before freeing m, or they are kept until this is destroyed.
+  void prepare(const Matcher &m,
+               const std::vector<uint32_t> &candidates) noexcept;
+
+  /// Advance m by the sampled token and compute the next mask. A promoted
+  /// branch replaces the engine matcher of m with Matcher::replaceWith(),
+  /// so a mask memo of m is kept.
+  /// @param mask  Buffer of mask_byte_len bytes; unspecified if the
+  ///              matcher stopped and the engine gives no mask then.
+  /// @return 1 if a prepared branch was promoted, 0 if computed in line,
+  /// -1 on error (token not allowed, or mask computation failed).
+  int commit(Matcher &m, uint32_t token, uint32_t *mask) noexcept;
+
+  /// Drop branches prepared for m (e.g., when the sequence is aborted).
+  void cancel(const Matcher &m) noexcept;
+
+  SpeculativeStats stats() const noexcept;
+
+private:
+  struct Branch;
+  struct Prepared;
+  struct Shared;
+
+  const Factory &factory_;
+  SpeculativeOptions opts_;
+  std::shared_ptr<Shared> sh_;
+  ThreadPool pool_;
+
+  std::shared_ptr<Prepared> take(uint64_t id) noexcept;
+};
+
+/// Grammar and token stream run during factory warmup.
+struct WarmupItem {
+  std::string grammar_type;
+  std::string grammar;
+  /// Tokens to consume; if empty, `text` is tokenized instead.
+  std::vector<uint32_t> tokens;
+  std::string text;
+};
+
+/// Breakdown of engine startup time, in milliseconds.
+struct StartupTimings {
+  double dll_load_ms = 0;
+  double tokenizer_ms = 0;
+  double factory_ms = 0;
+  double warmup_ms = 0;
+};
+
+/**
+ * Handle to a factory being constructed in the background, see
+ * CbisonEngineDll::new_factory_async().
+ */
+class PendingFactory {
+public:
+  struct Result {
+    cbison_factory_t factory = nullptr;
+    std::string error;
+    StartupTimings timings;
+  };
+
+  PendingFactory() = default;
+  explicit PendingFactory(std::future<Result> f) : fut_(std::move(f)) {}
+
+  /// Waits for construction and frees the factory if it was never taken.
+  ~PendingFactory() noexcept;
+
+  PendingFactory(PendingFactory &&) = default;
+  /// Waits for and frees the factory being replaced, as the destructor.
+  PendingFactory &operator=(PendingFactory &&o) noexcept;
+
+  /// Whether construction and warmup have finished (does not block).
+  bool ready() const noexcept;
+
+  /**
+   * Blocks until the factory is constructed and warmed up.
+   * Can be called only once; the caller owns the returned reference.
+   *
+   * @param error_string Will be set to a diagnostic message, if any.
+   * @return Factory handle, or nullptr on error.
+   */
+  cbison_factory_t wait(std::string &error_string);
+
+  /// Startup timings; complete once wait() has returned.
+  const StartupTimings &timings() const noexcept { return timings_; }
+
+private:
+  std::future<Result> fut_;
+  StartupTimings timings_;
+
+  void release() noexcept;
+};
+
 class CbisonEngineDll {
   void *handle_ = nullptr;
   std::string prefix_;
+  StartupTimings timings_;
 
   template <typename T> T get_sym(const std::string &name) const;
 
@@ -200,6 +1484,34 @@ public:
                                const std::string &options_json,
                                std::string &error_string);
 
+  /**
+   * Like new_factory(), but constructs the factory on a background thread,
+   * and then warms it up by running the given grammars and token streams
+   * (computing masks and consuming tokens), to populate engine caches before
+   * the first real request.
+   * Increments tokenizer's refcount until construction is done.
+   *
+   * @param tokenizer Tokenizer handle.
+   * @param options_json Optional engine-specific options.
+   * @param warmup Grammars to run; see default_warmup().
+   * @return Handle to wait() on.
+   */
+  PendingFactory new_factory_async(cbison_tokenizer_t tokenizer,
+                                   const std::string &options_json,
+                                   std::vector<WarmupItem> warmup = {});
+
+  /**
+   * A small set of JSON, JSON schema and regex grammars with matching
+   * inputs, suitable for warmup.
+   */
+  static std::vector<WarmupItem> default_warmup();
+
+  /**
+   * Time spent loading the DLL and in the most recent tokenizer and
+   * (synchronous) factory construction.
+   */
+  const StartupTimings &timings() const noexcept { return timings_; }
+
   /**
    * Constructs a minimal single-byte tokenizer (used for testing).
    *
@@ -223,6 +1535,10 @@ class CppTokenizer {
                                             size_t output_tokens_len);
     static void incr_ref_trampoline(cbison_tokenizer_t api);
     static void decr_ref_trampoline(cbison_tokenizer_t api);
+    static size_t tokenize_bytes_batch_trampoline(
+        cbison_tokenizer_t api, const char *bytes, const size_t *input_offsets,
+        size_t n_inputs, uint32_t *output_tokens, size_t output_tokens_len,
+        size_t *output_offsets);
   
   public:
     CppTokenizer(size_t vocab, uint32_t eos, bool utf8_required);
@@ -238,6 +1554,11 @@ class CppTokenizer {
   
     /// Tokenize a string to token ids.
     virtual std::vector<uint32_t> tokenizeBytes(const std::string &input) const = 0;
+
+    /// Tokenize many strings; the default calls tokenizeBytes() for each
+    /// input, in parallel on a shared ThreadPool for larger batches.
+    virtual std::vector<std::vector<uint32_t>>
+    tokenizeBytesBatch(const std::vector<std::string_view> &inputs) const;
   
   protected:
     size_t n_vocab;
@@ -245,4 +1566,62 @@ class CppTokenizer {
     bool tokenize_bytes_requires_utf8;
   };
 
+/**
+ * Presents a factory in a different token space, e.g., for a model whose
+ * vocabulary has added tokens or reordered special tokens with respect to
+ * the tokenizer the factory was built for. This lets a single factory serve
+ * models with close, but not identical, vocabularies.
+ *
+ * Tokens are translated on consume_tokens() and validate_tokens() (and back
+ * for fast-forward tokens), and masks are computed by the wrapped factory
+ * and then permuted into the model token space.
+ *
+ * Like CppTokenizer, it is created with refcount 1; use c_api() as any
+ * other factory.
+ */
+class RemappedFactory {
+  cbison_factory api_struct_;
+  std::atomic<int> ref_count_{1};
+  cbison_factory_t inner_;
+  size_t inner_words_;
+  // engine token per model token, padded to a multiple of 32; unmapped
+  // tokens point to a bit that is always zero
+  std::vector<uint32_t> to_engine_;
+  // model tokens per engine token (CSR)
+  std::vector<uint32_t> to_model_start_;
+  std::vector<uint32_t> to_model_;
+  mutable std::atomic<uint64_t> n_gather_{0};
+  mutable std::atomic<uint64_t> n_scatter_{0};
+
+  friend struct RemappedFactoryImpl;
+
+  void remapMask(const uint32_t *engine_mask, uint32_t *model_mask) const noexcept;
+
+public:
+  /// @param inner            Factory to wrap (its refcount is incremented).
+  /// @param model_to_engine  Engine token for each model token (the size
+  ///                         becomes n_vocab), or CBISON_NO_TOKEN for model
+  ///                         tokens that are never allowed.
+  /// @param eos_token_id     Model EOS token; always mapped to engine EOS.
+  RemappedFactory(cbison_factory_t inner,
+                  std::vector<uint32_t> model_to_engine,
+                  uint32_t eos_token_id);
+  ~RemappedFactory();
+
+  RemappedFactory(const RemappedFactory &) = delete;
+  RemappedFactory &operator=(const RemappedFactory &) = delete;
+
+  cbison_factory_t c_api() { return &api_struct_; }
+
+  /// Build model_to_engine by matching token bytes (special tokens only
+  /// match special tokens); model EOS maps to engine EOS.
+  static std::vector<uint32_t> mapByBytes(cbison_tokenizer_t model,
+                                          cbison_tokenizer_t engine);
+
+  /// Number of masks permuted with the dense gather kernel and with the
+  /// sparse scatter path (used when few tokens are allowed).
+  uint64_t gatherCount() const noexcept { return n_gather_.load(); }
+  uint64_t scatterCount() const noexcept { return n_scatter_.load(); }
+};
+
 } // namespace cbison
\ No newline at end of file
@@ -10,11 +10,11 @@
 
 #define CBISON_FACTORY_MAGIC 0x1bb53ed3
 #define CBISON_FACTORY_VERSION_MAJOR 1
-#define CBISON_FACTORY_VERSION_MINOR 0
+#define CBISON_FACTORY_VERSION_MINOR 6
 
 #define CBISON_TOKENIZER_MAGIC 0xff79e338
 #define CBISON_TOKENIZER_VERSION_MAJOR 1
-#define CBISON_TOKENIZER_VERSION_MINOR 0
+#define CBISON_TOKENIZER_VERSION_MINOR 1
 
 #ifndef CBISON_SKIP_STRUCTS
 typedef struct cbison_matcher *cbison_matcher_t;
@@ -29,6 +29,8 @@ typedef cbison_matcher_t cbison_matcher_ptr_t;
 typedef cbison_tokenizer_t cbison_tokenizer_ptr_t;
 
 typedef struct cbison_mask_req cbison_mask_req_t;
+typedef struct cbison_mask_layout cbison_mask_layout_t;
+typedef struct cbison_step_req cbison_step_req_t;
 
 /**
  * Typically provided by the inference engine to the structured output
@@ -126,7 +128,28 @@ struct cbison_tokenizer {
    */
   void (*decr_ref_count)(cbison_tokenizer_ptr_t api);
 
-  void *reserved_ptr[16];
+  /**
+   * Tokenize a number of byte strings at once, possibly in parallel.
+   * The inputs are concatenated in bytes; input i spans
+   * bytes[input_offsets[i]..input_offsets[i + 1]], so input_offsets has
+   * n_inputs + 1 entries.
+   * Tokens of input i are written to
+   * output_tokens[output_offsets[i]..output_offsets[i + 1]]; output_offsets
+   * has n_inputs + 1 entries and is always filled in.
+   * Returns the total number of tokens; if it is larger than
+   * output_tokens_len, the content of output_tokens is unspecified and the
+   * call should be repeated with a larger buffer.
+   *
+   * Must be thread-safe and reentrant, like tokenize_bytes().
+   * This is optional (can be NULL); added in version 1.1.
+   */
+  size_t (*tokenize_bytes_batch)(cbison_tokenizer_t api, const char *bytes,
+                                 const size_t *input_offsets, size_t n_inputs,
+                                 uint32_t *output_tokens,
+                                 size_t output_tokens_len,
+                                 size_t *output_offsets);
+
+  void *reserved_ptr[15];
 };
 
 /**
@@ -323,7 +346,108 @@ struct cbison_factory {
   int32_t (*compute_masks)(cbison_factory_t api, cbison_mask_req_t *reqs,
                            size_t n_reqs);
 
-  void *reserved_ptr[16];
+  /**
+   * Compute masks for a number of matchers directly into a model-shaped
+   * buffer, described by layout.
+   * Row i of the buffer gets the mask of matchers[i]; rows with NULL
+   * matcher are left untouched.
+   * Same concurrency rules as compute_masks() apply.
+   * Returns 0 on success and -1 on error (including invalid layout).
+   * This is optional (can be NULL); added in version 1.1.
+   */
+  int32_t (*compute_masks_strided)(cbison_factory_t api,
+                                   const cbison_matcher_ptr_t *matchers,
+                                   size_t n_rows,
+                                   const cbison_mask_layout_t *layout);
+
+  /**
+   * Like compute_masks(), but returns once timeout_us microseconds have
+   * passed, even if not all masks are computed.
+   * late must point to n_reqs bytes; late[i] is set to 1 if the mask for
+   * reqs[i] was not finished in time (its mask_dest is then unspecified),
+   * and to 0 otherwise.
+   * Computation of late masks is abandoned: the engine does not write to
+   * their mask_dest after returning, and their matchers can be used
+   * right away.
+   * Returns 0 on success (even if some masks are late) and -1 on error.
+   * This is optional (can be NULL); added in version 1.2.
+   */
+  int32_t (*compute_masks_deadline)(cbison_factory_t api,
+                                    cbison_mask_req_t *reqs, size_t n_reqs,
+                                    uint64_t timeout_us, uint8_t *late);
+
+  /**
+   * Approximate number of bytes used by the matcher, including its rollback
+   * history, but not memory shared with the factory or other matchers.
+   * This is optional (can be NULL); added in version 1.3.
+   */
+  size_t (*matcher_memory_usage)(cbison_matcher_t matcher);
+
+  /**
+   * Approximate number of bytes used by the factory itself (vocabulary
+   * data, caches of compiled grammars, etc.), excluding live matchers.
+   * This is optional (can be NULL); added in version 1.3.
+   */
+  size_t (*factory_memory_usage)(cbison_factory_t api);
+
+  /**
+   * Serialize the state of the matcher into a compact byte buffer, to be
+   * passed to restore_matcher() later (e.g., when a preempted sequence is
+   * resumed).
+   * The buffer starts with impl_magic and an engine-specific format version
+   * (4 bytes each, little-endian); the rest is engine-specific. It does not
+   * need to contain the grammar, nor the rollback history.
+   * Returns the size of the snapshot (which can be larger than output_len,
+   * in which case nothing is written), or 0 on error (including matcher in
+   * error state).
+   * This is optional (can be NULL); added in version 1.4.
+   */
+  size_t (*snapshot_matcher)(cbison_matcher_t matcher, uint8_t *output,
+                             size_t output_len);
+
+  /**
+   * Re-create a matcher from a snapshot, taken from a matcher created with
+   * the same grammar_type and grammar.
+   * Always returns a non-null value. Call get_error() on the result
+   * to check for errors (e.g., snapshot from another engine or version).
+   * The restored matcher cannot be rolled back past the snapshot point.
+   * Must be provided if snapshot_matcher is.
+   */
+  cbison_matcher_ptr_t (*restore_matcher)(cbison_factory_t api,
+                                          const char *grammar_type,
+                                          const char *grammar,
+                                          const uint8_t *snapshot,
+                                          size_t snapshot_len);
+
+  /**
+   * Run a decoding step for a number of matchers, in parallel.
+   * For each request: consume the token (unless CBISON_NO_TOKEN),
+   * if ff_tokens is non-NULL compute and consume the fast-forward tokens,
+   * set the flags, and, unless the matcher is stopped, compute its mask
+   * into row mask_row of the buffer described by layout (layout can be
+   * NULL to skip masks).
+   * Same concurrency rules as compute_masks() apply.
+   * Returns 0 on success and -1 on error (errors of individual matchers
+   * are only reported in their flags).
+   * This is optional (can be NULL); added in version 1.5.
+   */
+  int32_t (*step_batch)(cbison_factory_t api, cbison_step_req_t *reqs,
+                        size_t n_reqs, const cbison_mask_layout_t *layout);
+
+  /**
+   * Fork the matcher: like clone_matcher(), but the fork shares its
+   * immutable state (e.g., token history and parser stacks) with the
+   * original, copy-on-write, so that the cost and memory of a fork are
+   * proportional to the state that later diverges, not to the length of
+   * the input so far.
+   * Forks are semantically independent: each can be advanced, rolled back
+   * or freed in any order, and different forks can be used from different
+   * threads concurrently.
+   * This is optional (can be NULL); added in version 1.6.
+   */
+  cbison_matcher_ptr_t (*fork_matcher)(cbison_matcher_t matcher);
+
+  void *reserved_ptr[8];
 };
 
 /**
@@ -342,6 +466,106 @@ struct cbison_mask_req {
   uint32_t *mask_dest;
 };
 
+/**
+ * Bit per token, packed in uint32_t words (as in compute_mask()).
+ */
+#define CBISON_MASK_FORMAT_BITS 0
+/**
+ * One byte per token: 1 if allowed, 0 if not.
+ */
+#define CBISON_MASK_FORMAT_BOOL 1
+/**
+ * One bfloat16 per token, to be added to logits: 0.0 (0x0000) if allowed,
+ * -inf (0xff80) if not.
+ */
+#define CBISON_MASK_FORMAT_BF16 2
+
+/**
+ * Describes a destination buffer for compute_masks_strided().
+ */
+struct cbison_mask_layout {
+  /**
+   * Start of row 0.
+   */
+  void *base;
+
+  /**
+   * Distance between consecutive rows in bytes.
+   * It must be at least the row size implied by format and padded_vocab,
+   * and a multiple of 4 for CBISON_MASK_FORMAT_BITS.
+   */
+  size_t row_stride;
+
+  /**
+   * Number of token entries per row; at least n_vocab.
+   * Entries from n_vocab to padded_vocab (and, for CBISON_MASK_FORMAT_BITS,
+   * up to the end of the last word) are padding.
+   */
+  size_t padded_vocab;
+
+  /**
+   * One of CBISON_MASK_FORMAT_*.
+   */
+  uint32_t format;
+
+  /**
+   * Padding entries are set to allowed if non-zero, and disallowed otherwise.
+   */
+  uint32_t pad_allowed;
+};
+
+/**
+ * Token value meaning "nothing to consume" in cbison_step_req.
+ */
+#define CBISON_NO_TOKEN 0xffffffffu
+
+/**
+ * Flags set in cbison_step_req.flags.
+ */
+#define CBISON_STEP_STOPPED 0x1
+#define CBISON_STEP_ACCEPTING 0x2
+#define CBISON_STEP_ERROR 0x4
+
+/**
+ * Represents a single matcher in step_batch().
+ */
+struct cbison_step_req {
+  /**
+   * The matcher to advance.
+   */
+  cbison_matcher_ptr_t matcher;
+
+  /**
+   * Token to consume, or CBISON_NO_TOKEN.
+   */
+  uint32_t token;
+
+  /**
+   * Output: combination of CBISON_STEP_* after the step.
+   */
+  uint32_t flags;
+
+  /**
+   * Row of the mask buffer to write the mask to.
+   */
+  size_t mask_row;
+
+  /**
+   * Buffer for fast-forward tokens, or NULL to not compute them.
+   */
+  uint32_t *ff_tokens;
+
+  /**
+   * Size of ff_tokens buffer (in tokens).
+   */
+  size_t ff_tokens_len;
+
+  /**
+   * Output: number of fast-forward tokens written (and consumed).
+   */
+  size_t n_ff_tokens;
+};
+
 //
 // DLL interface
 //
@@ -353,6 +577,15 @@ struct cbison_mask_req {
 //
 // All except for cbison_new_factory() are optional.
 
+// Engines meant to be linked statically may in addition export the functions
+// they store in cbison_factory, under the field name: <prefix>_cbison_<field>
+// with the field's type (e.g., llg_cbison_compute_mask() of the type of
+// cbison_factory.compute_mask). cbison_static.hpp binds to these at compile
+// time. validate_grammar, new_matcher, get_error, compute_mask,
+// consume_tokens, is_accepting, is_stopped and free_matcher are then
+// required; the rest are optional. The factory itself is still obtained
+// from <prefix>_cbison_new_factory().
+
 /**
  * Construct a new CBISON factory for a given tokenizer and options.
  * The reference count of the tokenizer is incremented
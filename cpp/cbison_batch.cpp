@@ -0,0 +1,142 @@
+#include "cbison.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+namespace cbison {
+
+using Clock = std::chrono::steady_clock;
+
+static double elapsed_us(Clock::time_point t0, Clock::time_point t1) {
+  return std::chrono::duration<double, std::micro>(t1 - t0).count();
+}
+
+ConstrainedBatch::ConstrainedBatch(const Factory &factory, size_t max_batch,
+                                   size_t n_threads)
+    : factory_(factory), words_(factory.maskByteLen() / 4), slots_(max_batch),
+      masks_(max_batch * words_, 0), pool_(n_threads) {
+  free_slots_.reserve(max_batch);
+  // hand out low slots first
+  for (size_t i = max_batch; i > 0; --i)
+    free_slots_.push_back(i - 1);
+}
+
+int ConstrainedBatch::admit(Matcher &&m) noexcept {
+  if (free_slots_.empty() || !m.get())
+    return -1;
+  size_t slot = free_slots_.back();
+  free_slots_.pop_back();
+  slots_[slot].emplace(std::move(m));
+  n_active_++;
+  return static_cast<int>(slot);
+}
+
+bool ConstrainedBatch::isActive(size_t slot) const noexcept {
+  return slot < slots_.size() && slots_[slot].has_value();
+}
+
+Matcher *ConstrainedBatch::matcher(size_t slot) noexcept {
+  return isActive(slot) ? &*slots_[slot] : nullptr;
+}
+
+std::optional<Matcher> ConstrainedBatch::preempt(size_t slot) noexcept {
+  if (!isActive(slot))
+    return std::nullopt;
+  std::optional<Matcher> r(std::move(slots_[slot]));
+  slots_[slot].reset();
+  std::memset(masks_.data() + slot * words_, 0, words_ * 4);
+  free_slots_.push_back(slot);
+  n_active_--;
+  return r;
+}
+
+void ConstrainedBatch::release(size_t slot) noexcept { preempt(slot); }
+
+int ConstrainedBatch::step(
+    const std::vector<std::pair<size_t, uint32_t>> &sampled,
+    StepResult &res) noexcept {
+  res.stopped.clear();
+  res.errors.clear();
+  res.ff_tokens.clear();
+
+  // a slot sampled twice would be consumed concurrently
+  std::vector<uint8_t> seen(slots_.size(), 0);
+  for (auto &e : sampled) {
+    if (e.first >= seen.size())
+      continue;
+    if (seen[e.first])
+      return -1;
+    seen[e.first] = 1;
+  }
+
+  auto t0 = Clock::now();
+
+  // consume sampled tokens (and fast-forward tokens following them)
+  std::vector<std::vector<uint32_t>> ff(ff_enabled_ ? slots_.size() : 0);
+  pool_.parallelFor(sampled.size(), [&](size_t i) {
+    size_t slot = sampled[i].first;
+    if (!isActive(slot))
+      return;
+    const Matcher &m = *slots_[slot];
+    if (m.consumeTokens({sampled[i].second}) != 0)
+      return;
+    if (ff_enabled_ && !m.isStopped()) {
+      auto toks = m.computeFFTokens();
+      if (!toks.empty() && m.consumeTokens(toks) == 0)
+        ff[slot] = std::move(toks);
+    }
+  });
+  for (size_t slot = 0; slot < ff.size(); ++slot)
+    if (!ff[slot].empty())
+      res.ff_tokens.emplace_back(slot, std::move(ff[slot]));
+
+  auto t1 = Clock::now();
+
+  // drop stopped sequences
+  std::vector<std::pair<Matcher *, uint32_t *>> reqs;
+  reqs.reserve(n_active_);
+  for (size_t slot = 0; slot < slots_.size(); ++slot) {
+    if (!slots_[slot])
+      continue;
+    Matcher &m = *slots_[slot];
+    if (m.isStopped()) {
+      auto err = m.getError();
+      if (err)
+        res.errors.emplace_back(slot, std::move(*err));
+      res.stopped.push_back(slot);
+      release(slot);
+      continue;
+    }
+    reqs.emplace_back(&m, masks_.data() + slot * words_);
+  }
+
+  auto t2 = Clock::now();
+
+  // compute masks for the remaining ones
+  int rc = 0;
+  if (factory_.hasComputeMasks()) {
+    if (!reqs.empty())
+      rc = factory_.computeMasks(reqs);
+  } else {
+    std::atomic<int> failed{0};
+    pool_.parallelFor(reqs.size(), [&](size_t i) {
+      if (reqs[i].first->computeMask(reqs[i].second) != 0)
+        failed.store(1, std::memory_order_relaxed);
+    });
+    rc = failed.load() ? -1 : 0;
+  }
+
+  auto t3 = Clock::now();
+
+  stats_.steps++;
+  stats_.last_consume_us = elapsed_us(t0, t1);
+  stats_.last_prune_us = elapsed_us(t1, t2);
+  stats_.last_mask_us = elapsed_us(t2, t3);
+  stats_.last_total_us = elapsed_us(t0, t3);
+  stats_.sum_total_us += stats_.last_total_us;
+  stats_.max_total_us = std::max(stats_.max_total_us, stats_.last_total_us);
+
+  return rc;
+}
+
+} // namespace cbison
@@ -0,0 +1,205 @@
+#include "cbison.hpp"
+#include <algorithm>
+#include <cmath>
+
+namespace cbison {
+
+using Clock = std::chrono::steady_clock;
+
+// weight of a new sample in the moving averages
+static constexpr double EMA_ALPHA = 0.05;
+
+// spacing used until there are measurements to go by
+static constexpr size_t INITIAL_INTERVAL = 8;
+
+static double ema(double avg, double sample) {
+  return avg == 0 ? sample : avg + EMA_ALPHA * (sample - avg);
+}
+
+static double elapsed_us(Clock::time_point t0) {
+  return std::chrono::duration<double, std::micro>(Clock::now() - t0).count();
+}
+
+CheckpointedMatcher::CheckpointedMatcher(Matcher m,
+                                         CheckpointOptions opts) noexcept
+    : m_(std::move(m)), opts_(opts) {
+  cbison_factory_t api = m_.api();
+  opts_.max_checkpoints = std::max<size_t>(opts_.max_checkpoints, 1);
+  opts_.min_interval = std::max<size_t>(opts_.min_interval, 1);
+  opts_.max_interval = std::max(opts_.max_interval, opts_.min_interval);
+  native_ = opts_.prefer_native && api->rollback != nullptr;
+  can_fork_ = api->clone_matcher != nullptr || m_.hasFork();
+  interval_ = std::clamp(INITIAL_INTERVAL, opts_.min_interval,
+                         opts_.max_interval);
+  stats_.interval = interval_;
+  if (!native_ && can_fork_ && !m_.getError())
+    checkpoint();
+}
+
+size_t CheckpointedMatcher::maxRollback() const noexcept {
+  if (native_)
+    return pos_;
+  if (can_fork_)
+    return ring_.empty() ? 0 : pos_ - ring_.front().pos;
+  return m_.api()->reset ? pos_ : 0;
+}
+
+int CheckpointedMatcher::consumeTokens(
+    const std::vector<uint32_t> &tokens) noexcept {
+  if (tokens.empty())
+    return 0;
+  if (native_) {
+    if (m_.consumeTokens(tokens) != 0)
+      return -1;
+    pos_ += tokens.size();
+    stats_.consumed += tokens.size();
+    return 0;
+  }
+
+  auto t0 = Clock::now();
+  if (m_.consumeTokens(tokens) != 0)
+    return -1;
+  stats_.consume_us =
+      ema(stats_.consume_us, elapsed_us(t0) / double(tokens.size()));
+  tokens_.insert(tokens_.end(), tokens.begin(), tokens.end());
+  pos_ += tokens.size();
+  stats_.consumed += tokens.size();
+  since_checkpoint_ += tokens.size();
+  if (can_fork_ && since_checkpoint_ >= interval_)
+    checkpoint();
+  return 0;
+}
+
+void CheckpointedMatcher::checkpoint() noexcept {
+  auto t0 = Clock::now();
+  Matcher c = m_.fork();
+  if (c.getError())
+    return;
+  stats_.checkpoint_us = ema(stats_.checkpoint_us, elapsed_us(t0));
+  size_t bytes = c.memoryUsage().value_or(opts_.state_bytes);
+  ring_.push_back(Checkpoint{pos_, std::move(c), bytes});
+  stats_.bytes += bytes;
+  stats_.checkpoints_taken++;
+  since_checkpoint_ = 0;
+
+  // the newest checkpoint is always kept, even if alone over the budget
+  while (ring_.size() > 1 && (ring_.size() > opts_.max_checkpoints ||
+                              stats_.bytes > opts_.max_bytes))
+    dropOldest();
+  adaptInterval();
+}
+
+void CheckpointedMatcher::dropOldest() noexcept {
+  stats_.bytes -= ring_.front().bytes;
+  stats_.checkpoints_dropped++;
+  ring_.pop_front();
+  if (!ring_.empty()) {
+    // tokens before the oldest checkpoint are never replayed
+    size_t drop = ring_.front().pos - base_pos_;
+    tokens_.erase(tokens_.begin(), tokens_.begin() + drop);
+    base_pos_ = ring_.front().pos;
+  }
+}
+
+void CheckpointedMatcher::adaptInterval() noexcept {
+  // minimize checkpoint_us / I + rate * consume_us * I / 2 over I
+  double rate = stats_.consumed ? double(stats_.rollbacks) /
+                                      double(stats_.consumed)
+                                : 0.0;
+  double iv = double(opts_.max_interval);
+  if (rate > 0 && stats_.consume_us > 0)
+    iv = std::sqrt(2 * stats_.checkpoint_us / (rate * stats_.consume_us));
+  interval_ = std::clamp(size_t(std::llround(std::min(iv, 1e9))),
+                         opts_.min_interval, opts_.max_interval);
+  stats_.interval = interval_;
+}
+
+int CheckpointedMatcher::rollback(size_t n) noexcept {
+  if (n == 0)
+    return 0;
+  if (n > maxRollback())
+    return -1;
+  if (native_) {
+    if (m_.rollback(n) != 0)
+      return -1;
+    pos_ -= n;
+    stats_.rollbacks++;
+    stats_.native_rollbacks++;
+    return 0;
+  }
+
+  size_t target = pos_ - n;
+  size_t from = 0;
+  // The checkpoint is replayed on a fork, so a failed replay leaves m_
+  // and the ring as they were. Without forks, m_ itself is reset and
+  // replayed; it is left unusable if that fails.
+  std::optional<Matcher> m;
+  if (can_fork_) {
+    auto cp = ring_.rbegin();
+    while (cp->pos > target)
+      ++cp;
+    m.emplace(cp->m.fork());
+    if (m->getError())
+      return -1;
+    from = cp->pos;
+  } else {
+    if (m_.reset() != 0)
+      return -1;
+    from = base_pos_;
+  }
+
+  std::vector<uint32_t> replay(tokens_.begin() + (from - base_pos_),
+                               tokens_.begin() + (target - base_pos_));
+  if (!replay.empty()) {
+    auto t0 = Clock::now();
+    if ((m ? *m : m_).consumeTokens(replay) != 0) {
+      if (!m)
+        m_.invalidateMaskMemo();
+      return -1;
+    }
+    stats_.consume_us =
+        ema(stats_.consume_us, elapsed_us(t0) / double(replay.size()));
+    stats_.tokens_replayed += replay.size();
+  }
+  if (m) {
+    while (ring_.back().pos > target) {
+      stats_.bytes -= ring_.back().bytes;
+      ring_.pop_back();
+    }
+    // keeps the mask memo of m_, if any
+    m_.replaceWith(std::move(*m), pos_ - from, replay);
+  }
+
+  tokens_.resize(target - base_pos_);
+  pos_ = target;
+  since_checkpoint_ = target - from;
+  stats_.rollbacks++;
+  adaptInterval();
+  return 0;
+}
+
+int CheckpointedMatcher::reset() noexcept {
+  if (!m_.api()->reset)
+    return rollback(pos_);
+  if (m_.reset() != 0)
+    return -1;
+  while (!ring_.empty()) {
+    stats_.bytes -= ring_.back().bytes;
+    ring_.pop_back();
+  }
+  tokens_.clear();
+  pos_ = 0;
+  base_pos_ = 0;
+  since_checkpoint_ = 0;
+  if (!native_ && can_fork_)
+    checkpoint();
+  return 0;
+}
+
+CheckpointStats CheckpointedMatcher::stats() const noexcept {
+  CheckpointStats st = stats_;
+  st.checkpoints = ring_.size();
+  return st;
+}
+
+} // namespace cbison
@@ -0,0 +1,355 @@
+#include "cbison.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace cbison {
+
+using Clock = std::chrono::steady_clock;
+
+static double elapsed_us(Clock::time_point t0, Clock::time_point t1) {
+  return std::chrono::duration<double, std::micro>(t1 - t0).count();
+}
+
+// State shared with the background tasks, which may outlive a call.
+struct DeadlineMasker::Shared {
+  struct Cached {
+    uint64_t epoch;
+    std::vector<uint32_t> mask;
+  };
+  // a row left running in the background
+  struct LateRow {
+    uint64_t version; // Matcher::version() the mask is for
+    uint32_t *dest;   // where waitLate() writes it (FinishLate)
+    bool done = false;
+    int rc = 0;
+    std::vector<uint32_t> mask;
+  };
+  // a row of a computeMasks() call without compute_masks_deadline()
+  struct RowJob {
+    uint64_t id;
+    cbison_matcher_t m; // the caller's matcher or a fork of it
+    std::optional<Matcher> fork;
+    uint32_t *dest;
+    std::vector<uint32_t> buf;
+    int rc = 0;
+    bool skip = false;   // late from an earlier call, not computed again
+    bool done = false;
+    bool waited = false; // not forked, waited for past the deadline
+    std::shared_ptr<LateRow> late; // set when left running
+  };
+  struct CallState {
+    std::vector<RowJob> rows;
+    size_t pending = 0;
+  };
+
+  std::mutex mu;
+  std::condition_variable cv;
+  cbison_factory_t api;
+  size_t words;
+  bool use_cache;
+  bool finish_late;
+  uint64_t epoch = 0; // computeMasks() calls so far
+  size_t late = 0;    // late tasks still running
+  // by matcher id; with FinishLate, kept until the mask is delivered
+  std::unordered_map<uint64_t, std::shared_ptr<LateRow>> late_rows;
+  std::unordered_map<uint64_t, Cached> cache;
+  double max_late_us = 0;
+
+  // all called with mu held
+  void store(uint64_t id, uint64_t ep, const uint32_t *mask) {
+    if (!use_cache)
+      return;
+    auto &c = cache[id];
+    // a late mask must not replace one from a later call
+    if (!c.mask.empty() && c.epoch > ep)
+      return;
+    c.epoch = ep;
+    c.mask.assign(mask, mask + words);
+  }
+  std::shared_ptr<LateRow> addLate(const Matcher &m, uint32_t *dest) {
+    auto lr = std::make_shared<LateRow>();
+    lr->version = m.version();
+    lr->dest = dest;
+    late_rows[m.id()] = lr;
+    late++;
+    return lr;
+  }
+  void lateDone(uint64_t id, const std::shared_ptr<LateRow> &lr, uint64_t ep,
+                int rc, std::vector<uint32_t> &&mask, Clock::time_point t0) {
+    if (rc == 0)
+      store(id, ep, mask.data());
+    auto it = late_rows.find(id);
+    // not if dropped by forget() or for a matcher advanced meanwhile
+    if (it != late_rows.end() && it->second == lr) {
+      if (finish_late) {
+        lr->done = true;
+        lr->rc = rc;
+        lr->mask = std::move(mask);
+      } else {
+        late_rows.erase(it);
+      }
+    }
+    late--;
+    max_late_us = std::max(max_late_us, elapsed_us(t0, Clock::now()));
+    cv.notify_all();
+  }
+};
+
+DeadlineMasker::DeadlineMasker(const Factory &factory, LatePolicy policy,
+                               size_t n_threads)
+    : factory_(factory), policy_(policy), sh_(std::make_shared<Shared>()),
+      pool_(n_threads) {
+  sh_->api = factory.get();
+  sh_->words = factory.maskByteLen() / 4;
+  sh_->use_cache = policy == LatePolicy::CachedMask;
+  sh_->finish_late = policy == LatePolicy::FinishLate;
+}
+
+DeadlineMasker::~DeadlineMasker() noexcept {
+  // late masks are not written out anymore
+  std::unique_lock<std::mutex> lock(sh_->mu);
+  sh_->cv.wait(lock, [&] { return sh_->late == 0; });
+}
+
+void DeadlineMasker::waitLate() noexcept {
+  std::unique_lock<std::mutex> lock(sh_->mu);
+  sh_->cv.wait(lock, [&] { return sh_->late == 0; });
+  stats_.max_late_us = sh_->max_late_us;
+  for (auto &[id, lr] : sh_->late_rows)
+    if (lr->rc == 0)
+      std::memcpy(lr->dest, lr->mask.data(), sh_->words * 4);
+  sh_->late_rows.clear();
+}
+
+void DeadlineMasker::forget(const Matcher &m) noexcept {
+  std::lock_guard<std::mutex> lock(sh_->mu);
+  sh_->cache.erase(m.id());
+  sh_->late_rows.erase(m.id());
+}
+
+// Fork to compute on in the background; nullopt unless the engine has
+// native fork_matcher(): a clone copies the whole state, which may cost as
+// much as the mask itself.
+static std::optional<Matcher> forkForMask(const Matcher &m) {
+  if (!m.hasFork())
+    return std::nullopt;
+  Matcher f = m.fork();
+  if (f.getError())
+    return std::nullopt;
+  return f;
+}
+
+// Fill dest for a late row according to policy (other than FinishLate).
+void DeadlineMasker::applyPolicy(const Matcher &m, uint32_t *dest,
+                                 MaskRowStatus &status) {
+  size_t words = sh_->words;
+  if (policy_ == LatePolicy::CachedMask) {
+    std::lock_guard<std::mutex> lock(sh_->mu);
+    auto it = sh_->cache.find(m.id());
+    if (it != sh_->cache.end()) {
+      std::memcpy(dest, it->second.mask.data(), words * 4);
+      status = MaskRowStatus::Cached;
+      stats_.cached_rows++;
+      return;
+    }
+  }
+  size_t n_vocab = factory_.nVocab();
+  std::fill(dest, dest + words, 0xffffffff);
+  if (n_vocab % 32)
+    dest[n_vocab / 32] = (1u << (n_vocab % 32)) - 1;
+  status = MaskRowStatus::ValidateOnSample;
+  stats_.validate_rows++;
+}
+
+// Compute the mask of a row abandoned by the engine on a fork in the
+// background; without a fork, it is computed right away.
+int DeadlineMasker::finishLate(const Matcher &m, uint32_t *dest,
+                               Clock::time_point t0, uint64_t epoch,
+                               MaskRowStatus &status) {
+  auto f = forkForMask(m);
+  if (!f) {
+    stats_.waited_rows++;
+    return sh_->api->compute_mask(m.get(), dest, sh_->words * 4);
+  }
+  status = MaskRowStatus::Late;
+  auto sh = sh_;
+  std::shared_ptr<Shared::LateRow> lr;
+  {
+    std::lock_guard<std::mutex> lock(sh->mu);
+    lr = sh->addLate(m, dest);
+  }
+  auto fm = std::make_shared<Matcher>(std::move(*f));
+  pool_.submit([sh, fm, lr, id = m.id(), t0, epoch]() mutable {
+    std::vector<uint32_t> buf(sh->words);
+    int rc = sh->api->compute_mask(fm->get(), buf.data(), sh->words * 4);
+    // freed before lateDone(), which may let the factory go away
+    fm.reset();
+    std::lock_guard<std::mutex> lock(sh->mu);
+    sh->lateDone(id, lr, epoch, rc, std::move(buf), t0);
+  });
+  return 0;
+}
+
+int DeadlineMasker::computeMasks(
+    const std::vector<std::pair<Matcher *, uint32_t *>> &reqs,
+    std::chrono::microseconds timeout,
+    std::vector<MaskRowStatus> &status) noexcept {
+  auto t0 = Clock::now();
+  size_t n = reqs.size();
+  size_t words = sh_->words;
+  status.assign(n, MaskRowStatus::Ready);
+  uint64_t epoch;
+  int rc = 0;
+  size_t n_late = 0;
+  std::vector<bool> skip(n);
+  {
+    std::lock_guard<std::mutex> lock(sh_->mu);
+    epoch = ++sh_->epoch;
+    // A matcher still late from an earlier call is late again, rather than
+    // taking up another worker. With FinishLate, a mask finished since is
+    // delivered now, and one for a matcher advanced meanwhile is dropped.
+    for (size_t i = 0; i < n; ++i) {
+      const Matcher &m = *reqs[i].first;
+      auto it = sh_->late_rows.find(m.id());
+      if (it == sh_->late_rows.end())
+        continue;
+      auto &lr = *it->second;
+      if (sh_->finish_late && lr.version != m.version()) {
+        sh_->late_rows.erase(it);
+        continue;
+      }
+      skip[i] = true;
+      if (lr.done) {
+        if (lr.rc == 0)
+          std::memcpy(reqs[i].second, lr.mask.data(), words * 4);
+        else
+          rc = -1;
+        sh_->late_rows.erase(it);
+      } else {
+        lr.dest = reqs[i].second;
+        status[i] = MaskRowStatus::Late;
+        n_late++;
+      }
+    }
+  }
+
+  if (factory_.hasComputeMasksDeadline()) {
+    std::vector<std::pair<Matcher *, uint32_t *>> sub;
+    std::vector<size_t> idx;
+    for (size_t i = 0; i < n; ++i)
+      if (!skip[i]) {
+        sub.push_back(reqs[i]);
+        idx.push_back(i);
+      }
+    std::vector<uint8_t> late;
+    if (!sub.empty() && factory_.computeMasks(sub, timeout, late) != 0)
+      rc = -1;
+    for (size_t j = 0; j < sub.size() && rc == 0; ++j) {
+      const Matcher &m = *sub[j].first;
+      uint32_t *dest = sub[j].second;
+      if (!late[j]) {
+        std::lock_guard<std::mutex> lock(sh_->mu);
+        sh_->store(m.id(), epoch, dest);
+        continue;
+      }
+      n_late++;
+      if (policy_ == LatePolicy::FinishLate) {
+        if (finishLate(m, dest, t0, epoch, status[idx[j]]) != 0)
+          rc = -1;
+      } else {
+        applyPolicy(m, dest, status[idx[j]]);
+      }
+    }
+  } else {
+    auto st = std::make_shared<Shared::CallState>();
+    st->rows.resize(n);
+    // Rows are computed on forks, so that a late one can be left running
+    // without touching the caller's matcher. Without native forks, rows
+    // are computed in place and waited for past the deadline.
+    for (size_t i = 0; i < n; ++i) {
+      auto &row = st->rows[i];
+      row.id = reqs[i].first->id();
+      row.dest = reqs[i].second;
+      row.skip = skip[i];
+      if (row.skip)
+        continue;
+      row.fork = forkForMask(*reqs[i].first);
+      row.m = row.fork ? row.fork->get() : reqs[i].first->get();
+      row.buf.resize(words);
+      st->pending++;
+    }
+    auto sh = sh_;
+    for (size_t i = 0; i < n; ++i) {
+      if (st->rows[i].skip)
+        continue;
+      pool_.submit([sh, st, i, t0, epoch] {
+        auto &row = st->rows[i];
+        int r = sh->api->compute_mask(row.m, row.buf.data(), sh->words * 4);
+        std::lock_guard<std::mutex> lock(sh->mu);
+        row.rc = r;
+        row.done = true;
+        st->pending--;
+        if (row.late) {
+          row.fork.reset();
+          sh->lateDone(row.id, row.late, epoch, r, std::move(row.buf), t0);
+        } else {
+          sh->cv.notify_all();
+        }
+      });
+    }
+
+    std::unique_lock<std::mutex> lock(sh_->mu);
+    sh_->cv.wait_until(lock, t0 + timeout, [&] { return st->pending == 0; });
+    for (auto &row : st->rows)
+      if (!row.skip && !row.done && !row.fork)
+        row.waited = true;
+    sh_->cv.wait(lock, [&] {
+      for (auto &row : st->rows)
+        if (row.waited && !row.done)
+          return false;
+      return true;
+    });
+    for (size_t i = 0; i < n; ++i) {
+      auto &row = st->rows[i];
+      if (row.skip)
+        continue;
+      if (row.done) {
+        if (row.rc != 0)
+          rc = -1;
+        std::memcpy(row.dest, row.buf.data(), words * 4);
+        sh_->store(row.id, epoch, row.buf.data());
+        row.fork.reset();
+        if (row.waited) {
+          n_late++;
+          stats_.waited_rows++;
+        }
+        continue;
+      }
+      n_late++;
+      row.late = sh_->addLate(*reqs[i].first, row.dest);
+      status[i] = MaskRowStatus::Late;
+    }
+    lock.unlock();
+  }
+
+  if (policy_ != LatePolicy::FinishLate)
+    for (size_t i = 0; i < n; ++i)
+      if (status[i] == MaskRowStatus::Late)
+        applyPolicy(*reqs[i].first, reqs[i].second, status[i]);
+
+  double us = elapsed_us(t0, Clock::now());
+  stats_.calls++;
+  stats_.rows += n;
+  stats_.late_rows += n_late;
+  if (n_late)
+    stats_.calls_with_late++;
+  stats_.sum_call_us += us;
+  stats_.max_call_us = std::max(stats_.max_call_us, us);
+  {
+    std::lock_guard<std::mutex> lock(sh_->mu);
+    stats_.max_late_us = sh_->max_late_us;
+  }
+  return rc;
+}
+
+} // namespace cbison
@@ -1,18 +1,86 @@
 #include "cbison.hpp"
+#include <algorithm>
+#include <cstring>
 
 namespace cbison {
 
+struct Matcher::MaskMemo {
+  struct Entry {
+    size_t pos;
+    uint64_t last_use;
+    std::vector<uint32_t> mask;
+  };
+
+  size_t capacity;
+  size_t words;
+  size_t pos = 0;     // tokens consumed since the memo was enabled
+  bool valid = true;  // cleared by a failed consume until reset()
+  bool at_start;      // whether pos 0 is the initial state
+  std::vector<uint32_t> history; // may extend past pos after rollback
+  std::vector<Entry> entries;
+  uint64_t clock = 0;
+  MaskMemoStats stats;
+
+  // forget masks of states past len tokens
+  void truncate(size_t len) {
+    history.resize(len);
+    size_t before = entries.size();
+    entries.erase(std::remove_if(entries.begin(), entries.end(),
+                                 [&](const Entry &e) { return e.pos > len; }),
+                  entries.end());
+    stats.invalidated += before - entries.size();
+  }
+
+  // start over from the current state, which need not be the initial one
+  void clear() {
+    stats.invalidated += entries.size();
+    entries.clear();
+    history.clear();
+    pos = 0;
+    at_start = false;
+  }
+
+  void rolledBack(size_t n) {
+    if (n <= pos)
+      pos -= n;
+    else
+      clear(); // before the memo was enabled
+  }
+
+  void consumed(const std::vector<uint32_t> &tokens) {
+    for (uint32_t t : tokens) {
+      if (pos < history.size() && history[pos] != t)
+        truncate(pos);
+      if (pos == history.size())
+        history.push_back(t);
+      pos++;
+    }
+  }
+
+  Entry *find() {
+    for (auto &e : entries)
+      if (e.pos == pos)
+        return &e;
+    return nullptr;
+  }
+};
+
 // we don't have to increment ref count on api because the matcher will hold on
 // to it
+static std::atomic<uint64_t> next_matcher_id{1};
+
 Matcher::Matcher(cbison_factory_t api, cbison_matcher_t m) noexcept
-    : api_(api), m_(m) {}
+    : api_(api), m_(m),
+      id_(next_matcher_id.fetch_add(1, std::memory_order_relaxed)) {}
 
 Matcher::~Matcher() noexcept {
   if (m_)
     api_->free_matcher(m_);
 }
 
-Matcher::Matcher(Matcher &&o) noexcept : api_(o.api_), m_(o.m_) {
+Matcher::Matcher(Matcher &&o) noexcept
+    : api_(o.api_), m_(o.m_), id_(o.id_), version_(o.version_),
+      memo_(std::move(o.memo_)) {
   o.m_ = nullptr;
 }
 
@@ -21,25 +89,110 @@ Matcher &Matcher::operator=(Matcher &&o) noexcept {
     api_->free_matcher(m_);
   api_ = o.api_;
   m_ = o.m_;
+  id_ = o.id_;
+  version_ = o.version_;
+  memo_ = std::move(o.memo_);
   o.m_ = nullptr;
   return *this;
 }
 
+void Matcher::enableMaskMemo(size_t capacity, bool at_start) noexcept {
+  if (capacity == 0) {
+    memo_.reset();
+    return;
+  }
+  if (!memo_) {
+    memo_ = std::make_unique<MaskMemo>();
+    memo_->words = api_->mask_byte_len / 4;
+    memo_->at_start = at_start;
+  }
+  memo_->capacity = capacity;
+  while (memo_->entries.size() > capacity) {
+    memo_->entries.erase(memo_->entries.begin());
+    memo_->stats.invalidated++;
+  }
+}
+
+void Matcher::invalidateMaskMemo() const noexcept {
+  if (memo_)
+    memo_->clear();
+}
+
+MaskMemoStats Matcher::maskMemoStats() const noexcept {
+  if (!memo_)
+    return {};
+  MaskMemoStats st = memo_->stats;
+  st.entries = memo_->entries.size();
+  return st;
+}
+
+bool Matcher::memoLookup(uint32_t *dest) const noexcept {
+  if (!memo_ || !memo_->valid)
+    return false;
+  auto e = memo_->find();
+  if (!e) {
+    memo_->stats.misses++;
+    return false;
+  }
+  e->last_use = ++memo_->clock;
+  memcpy(dest, e->mask.data(), memo_->words * 4);
+  memo_->stats.hits++;
+  return true;
+}
+
+void Matcher::memoStore(const uint32_t *mask) const noexcept {
+  if (!memo_ || !memo_->valid)
+    return;
+  auto e = memo_->find();
+  if (!e) {
+    auto &entries = memo_->entries;
+    if (entries.size() >= memo_->capacity) {
+      auto lru = std::min_element(entries.begin(), entries.end(),
+                                  [](const MaskMemo::Entry &a,
+                                     const MaskMemo::Entry &b) {
+                                    return a.last_use < b.last_use;
+                                  });
+      entries.erase(lru);
+    }
+    entries.push_back(MaskMemo::Entry{memo_->pos, 0, {}});
+    e = &entries.back();
+  }
+  e->last_use = ++memo_->clock;
+  e->mask.assign(mask, mask + memo_->words);
+}
+
 Matcher Matcher::clone() const noexcept {
   auto c = api_->clone_matcher(m_);
   return Matcher(api_, c);
 }
 
+Matcher Matcher::fork() const noexcept {
+  if (!hasFork())
+    return clone();
+  return Matcher(api_, api_->fork_matcher(m_));
+}
+
 std::vector<uint32_t> Matcher::computeMask() const noexcept {
   size_t bytes = api_->mask_byte_len;
   size_t words = bytes / 4;
   std::vector<uint32_t> mask(words);
-  api_->compute_mask(m_, mask.data(), bytes);
+  computeMask(mask.data());
   return mask;
 }
 
+int Matcher::computeMask(uint32_t *dest) const noexcept {
+  if (memoLookup(dest))
+    return 0;
+  int r = api_->compute_mask(m_, dest, api_->mask_byte_len);
+  if (r == 0)
+    memoStore(dest);
+  return r;
+}
+
 std::vector<uint32_t>
 Matcher::computeFFTokens(size_t max_tokens) const noexcept {
+  if (!api_->compute_ff_tokens)
+    return {};
   std::vector<uint32_t> buf(max_tokens);
   int32_t n = api_->compute_ff_tokens(m_, buf.data(), max_tokens);
   if (n < 0)
@@ -61,11 +214,81 @@ int Matcher::validateTokens(
 }
 
 int Matcher::consumeTokens(const std::vector<uint32_t> &tokens) const noexcept {
-  return api_->consume_tokens(m_, tokens.data(), tokens.size());
+  int r = api_->consume_tokens(m_, tokens.data(), tokens.size());
+  version_++;
+  if (memo_) {
+    if (r == 0 && memo_->valid) {
+      memo_->consumed(tokens);
+    } else {
+      memo_->clear();
+      memo_->valid = false;
+    }
+  }
+  return r;
+}
+
+MatcherSnapshot
+Matcher::snapshot(std::vector<uint32_t> replay_tokens) const noexcept {
+  MatcherSnapshot snap;
+  if (hasSnapshot()) {
+    size_t n = api_->snapshot_matcher(m_, nullptr, 0);
+    if (n > 0) {
+      snap.data.resize(n);
+      if (api_->snapshot_matcher(m_, snap.data.data(), n) == n)
+        return snap;
+      snap.data.clear();
+    }
+  }
+  snap.tokens = std::move(replay_tokens);
+  return snap;
+}
+
+std::optional<size_t> Matcher::memoryUsage() const noexcept {
+  if (api_->version_minor < 3 || !api_->matcher_memory_usage)
+    return std::nullopt;
+  return api_->matcher_memory_usage(m_);
+}
+
+int Matcher::reset() const noexcept {
+  if (!api_->reset)
+    return -1;
+  int r = api_->reset(m_);
+  version_++;
+  if (r == 0 && memo_) {
+    // the history stays valid if positions count from the initial state
+    if (!memo_->at_start)
+      memo_->clear();
+    memo_->at_start = true;
+    memo_->pos = 0;
+    memo_->valid = true;
+  }
+  return r;
 }
 
 int Matcher::rollback(size_t n) const noexcept {
-  return api_->rollback ? api_->rollback(m_, n) : -1;
+  if (!api_->rollback)
+    return -1;
+  int r = api_->rollback(m_, n);
+  version_++;
+  if (r == 0 && memo_)
+    memo_->rolledBack(n);
+  return r;
+}
+
+void Matcher::replaceWith(Matcher &&o, size_t n_rollback,
+                          const std::vector<uint32_t> &tokens) noexcept {
+  if (m_)
+    api_->free_matcher(m_);
+  api_ = o.api_;
+  m_ = o.m_;
+  id_ = o.id_;
+  version_ = std::max(version_, o.version_) + 1;
+  o.m_ = nullptr;
+  if (memo_) {
+    memo_->rolledBack(n_rollback);
+    if (memo_->valid)
+      memo_->consumed(tokens);
+  }
 }
 
 Factory::Factory(void *addr) noexcept
@@ -79,12 +302,32 @@ Factory::~Factory() noexcept {
     f_->decr_ref_count(f_);
 }
 
+std::optional<size_t> Factory::memoryUsage() const noexcept {
+  if (f_->version_minor < 3 || !f_->factory_memory_usage)
+    return std::nullopt;
+  return f_->factory_memory_usage(f_);
+}
+
 Matcher Factory::newMatcher(const std::string &type,
                             const std::string &grammar) const noexcept {
   auto m = f_->new_matcher(f_, type.c_str(), grammar.c_str());
   return Matcher(f_, m);
 }
 
+Matcher Factory::restoreMatcher(const std::string &type,
+                                const std::string &grammar,
+                                const MatcherSnapshot &snap) const noexcept {
+  if (!snap.data.empty() && f_->version_minor >= 4 && f_->restore_matcher) {
+    auto m = f_->restore_matcher(f_, type.c_str(), grammar.c_str(),
+                                 snap.data.data(), snap.data.size());
+    return Matcher(f_, m);
+  }
+  auto m = newMatcher(type, grammar);
+  if (!snap.tokens.empty())
+    m.consumeTokens(snap.tokens);
+  return m;
+}
+
 std::pair<bool, std::string>
 Factory::validateGrammar(const std::string &type,
                          const std::string &grammar) const noexcept {
@@ -98,13 +341,46 @@ Factory::validateGrammar(const std::string &type,
 
 int Factory::computeMasks(
     const std::vector<std::pair<Matcher *, uint32_t *>> &reqs) const noexcept {
+  if (!f_->compute_masks)
+    return -1;
+  // rows served from mask memos are left out of the engine call
+  std::vector<cbison_mask_req_t> c;
+  std::vector<const Matcher *> computed;
+  c.reserve(reqs.size());
+  for (auto &r : reqs) {
+    if (r.first->memoLookup(r.second))
+      continue;
+    cbison_mask_req_t req{};
+    req.matcher = r.first->get();
+    req.mask_dest = r.second;
+    c.push_back(req);
+    computed.push_back(r.first);
+  }
+  if (c.empty())
+    return 0;
+  int rc = f_->compute_masks(f_, c.data(), c.size());
+  if (rc == 0)
+    for (size_t i = 0; i < c.size(); ++i)
+      computed[i]->memoStore(c[i].mask_dest);
+  return rc;
+}
+
+int Factory::computeMasks(
+    const std::vector<std::pair<Matcher *, uint32_t *>> &reqs,
+    std::chrono::microseconds timeout,
+    std::vector<uint8_t> &late) const noexcept {
   size_t n = reqs.size();
+  late.assign(n, 0);
+  if (!hasComputeMasksDeadline())
+    return -1;
   std::vector<cbison_mask_req_t> c(n);
   for (size_t i = 0; i < n; ++i) {
     c[i].matcher = reqs[i].first->get();
     c[i].mask_dest = reqs[i].second;
   }
-  return f_->compute_masks ? f_->compute_masks(f_, c.data(), n) : -1;
+  return f_->compute_masks_deadline(f_, c.data(), n,
+                                    static_cast<uint64_t>(timeout.count()),
+                                    late.data());
 }
 
 Tokenizer::Tokenizer(cbison_tokenizer_t t) noexcept : t_(t) {
@@ -162,4 +438,50 @@ Tokenizer::tokenizeString(const std::string &s) const noexcept {
   return tokenizeBytes(std::vector<uint8_t>(s.begin(), s.end()));
 }
 
+void Tokenizer::tokenizeBytesBatch(const std::vector<std::string_view> &inputs,
+                                   std::vector<uint32_t> &tokens,
+                                   std::vector<size_t> &offsets) const noexcept {
+  size_t n = inputs.size();
+  offsets.assign(n + 1, 0);
+  tokens.clear();
+  if (!t_->tokenize_bytes)
+    return;
+
+  std::string bytes;
+  std::vector<size_t> in_offsets(n + 1, 0);
+  for (size_t i = 0; i < n; ++i) {
+    bytes.append(inputs[i]);
+    in_offsets[i + 1] = bytes.size();
+  }
+
+  if (hasTokenizeBytesBatch()) {
+    tokens.resize(bytes.size() + n);
+    size_t total =
+        t_->tokenize_bytes_batch(t_, bytes.data(), in_offsets.data(), n,
+                                 tokens.data(), tokens.size(), offsets.data());
+    if (total > tokens.size()) {
+      tokens.resize(total);
+      total = t_->tokenize_bytes_batch(t_, bytes.data(), in_offsets.data(), n,
+                                       tokens.data(), tokens.size(),
+                                       offsets.data());
+    }
+    tokens.resize(total);
+    return;
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    size_t len = inputs[i].size();
+    size_t start = tokens.size();
+    tokens.resize(start + len + 1);
+    size_t k = t_->tokenize_bytes(t_, inputs[i].data(), len,
+                                  tokens.data() + start, len + 1);
+    if (k > len + 1) {
+      tokens.resize(start + k);
+      t_->tokenize_bytes(t_, inputs[i].data(), len, tokens.data() + start, k);
+    }
+    tokens.resize(start + k);
+    offsets[i + 1] = tokens.size();
+  }
+}
+
 } // namespace cbison
@@ -0,0 +1,161 @@
+#include "cbison.hpp"
+#include <algorithm>
+#include <bit>
+#include <chrono>
+
+namespace cbison {
+
+static bool is_valid_utf8(const std::vector<uint8_t> &b) {
+  size_t i = 0, n = b.size();
+  while (i < n) {
+    uint8_t c = b[i];
+    size_t len = c < 0x80 ? 1 : (c >> 5) == 0x6 ? 2 : (c >> 4) == 0xe ? 3
+                              : (c >> 3) == 0x1e ? 4 : 0;
+    if (len == 0 || i + len > n)
+      return false;
+    for (size_t k = 1; k < len; ++k)
+      if ((b[i + k] & 0xc0) != 0x80)
+        return false;
+    i += len;
+  }
+  return true;
+}
+
+// allowed tokens looked at when deriving forced bytes; past this the
+// mask is taken to leave a real choice
+static constexpr size_t MAX_CANDIDATES = 256;
+
+int FastForward::emulate(const Matcher &m,
+                         std::vector<uint32_t> &forced) noexcept {
+  uint32_t eos = m.api()->eos_token_id;
+  std::vector<uint32_t> mask(m.api()->mask_byte_len / 4);
+  std::vector<uint32_t> allowed;
+  while (forced.size() < max_tokens_ && !m.isStopped()) {
+    if (m.computeMask(mask.data()) != 0)
+      return -1;
+    allowed.clear();
+    for (size_t w = 0; w < mask.size() && allowed.size() <= MAX_CANDIDATES;
+         ++w)
+      for (uint32_t bits = mask[w]; bits; bits &= bits - 1)
+        allowed.push_back(
+            static_cast<uint32_t>(w * 32 + std::countr_zero(bits)));
+    if (allowed.empty() || allowed.size() > MAX_CANDIDATES)
+      break;
+
+    // The bytes shared by all allowed tokens are forced, whichever token
+    // gets sampled. If one of the tokens is exactly these bytes, consuming
+    // it is safe; retokenize() fixes up the token boundaries afterwards.
+    // EOS is left for the sampler, as it ends the sequence.
+    uint32_t tok = CBISON_NO_TOKEN;
+    if (allowed.size() == 1) {
+      tok = allowed[0];
+    } else {
+      auto prefix = tok_.getToken(allowed[0]);
+      for (size_t i = 1; i < allowed.size() && !prefix.empty(); ++i) {
+        auto b = tok_.getToken(allowed[i]);
+        auto mm = std::mismatch(prefix.begin(), prefix.end(), b.begin(),
+                                b.end());
+        prefix.erase(mm.first, prefix.end());
+      }
+      for (size_t i = 0; i < allowed.size() && !prefix.empty(); ++i)
+        if (!tok_.isSpecialToken(allowed[i]) &&
+            tok_.getToken(allowed[i]) == prefix) {
+          tok = allowed[i];
+          break;
+        }
+    }
+    if (tok == CBISON_NO_TOKEN || tok == eos)
+      break;
+    if (m.consumeTokens({tok}) != 0)
+      return -1;
+    forced.push_back(tok);
+  }
+  return 0;
+}
+
+int FastForward::retokenize(const Matcher &m,
+                            const std::vector<uint32_t> &history,
+                            const std::vector<uint32_t> &forced,
+                            FastForwardResult &res) noexcept {
+  // don't merge across special tokens
+  size_t wsize = 0;
+  while (wsize < window_ && wsize < history.size() &&
+         !tok_.isSpecialToken(history[history.size() - wsize - 1]))
+    wsize++;
+  for (auto t : forced)
+    if (tok_.isSpecialToken(t))
+      return 0;
+
+  std::vector<uint32_t> orig(history.end() - wsize, history.end());
+  orig.insert(orig.end(), forced.begin(), forced.end());
+  std::vector<uint8_t> bytes;
+  for (auto t : orig) {
+    auto b = tok_.getToken(t);
+    bytes.insert(bytes.end(), b.begin(), b.end());
+  }
+  if (tok_.requiresUtf8() && !is_valid_utf8(bytes))
+    return 0;
+
+  auto retok = tok_.tokenizeBytes(bytes);
+  if (retok.empty() || retok == orig)
+    return 0;
+
+  size_t p = 0;
+  while (p < orig.size() && p < retok.size() && orig[p] == retok[p])
+    p++;
+  // retok being a prefix of orig would mean the tokenizer is inconsistent
+  if (p == retok.size())
+    return 0;
+
+  std::vector<uint32_t> tail(retok.begin() + p, retok.end());
+  if (m.rollback(orig.size() - p) != 0)
+    return 0;
+  // on mismatch restore the original state; failing that, the matcher no
+  // longer matches the history
+  if (m.validateTokens(tail) != static_cast<int>(tail.size()))
+    return m.consumeTokens(
+        std::vector<uint32_t>(orig.begin() + p, orig.end()));
+  if (m.consumeTokens(tail) != 0)
+    return -1;
+
+  size_t keep = std::min(p, wsize);
+  res.n_drop = wsize - keep;
+  res.tokens.assign(retok.begin() + keep, retok.end());
+  stats_.retokenized++;
+  return 0;
+}
+
+int FastForward::run(const Matcher &m, const std::vector<uint32_t> &history,
+                     FastForwardResult &res) noexcept {
+  auto t0 = std::chrono::steady_clock::now();
+  res = FastForwardResult();
+  stats_.calls++;
+
+  std::vector<uint32_t> forced;
+  if (m.hasFFTokens() && !always_emulate_) {
+    forced = m.computeFFTokens(max_tokens_);
+    if (!forced.empty() && m.consumeTokens(forced) != 0)
+      return -1;
+  } else {
+    res.emulated = true;
+    if (emulate(m, forced) != 0)
+      return -1;
+    stats_.emulated_tokens += forced.size();
+  }
+
+  res.n_forced = forced.size();
+  res.tokens = forced;
+  if (!forced.empty() && tok_.hasTokenizeBytes() && m.api()->rollback &&
+      retokenize(m, history, forced, res) != 0)
+    return -1;
+
+  res.kv_recompute_from = history.size() - res.n_drop;
+  stats_.forced_tokens += res.tokens.size();
+  stats_.dropped_tokens += res.n_drop;
+  stats_.total_us += std::chrono::duration<double, std::micro>(
+                         std::chrono::steady_clock::now() - t0)
+                         .count();
+  return 0;
+}
+
+} // namespace cbison
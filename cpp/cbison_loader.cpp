@@ -1,4 +1,5 @@
 #include "cbison.hpp"
+#include <chrono>
 
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
@@ -49,6 +50,12 @@ static void *dl_get_sym(void *handle, const char *name) {
 
 namespace cbison {
 
+using Clock = std::chrono::steady_clock;
+
+static double elapsed_ms(Clock::time_point t0) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+}
+
 template <typename T>
 T CbisonEngineDll::get_sym(const std::string &name) const {
   return reinterpret_cast<T>(dl_get_sym(handle_, name.c_str()));
@@ -56,7 +63,9 @@ T CbisonEngineDll::get_sym(const std::string &name) const {
 
 bool CbisonEngineDll::load(const std::filesystem::path &path,
                            const std::string &prefix) {
+  auto t0 = Clock::now();
   handle_ = dl_load_library(path);
+  timings_.dll_load_ms = elapsed_ms(t0);
   if (!handle_)
     return false;
 
@@ -82,8 +91,10 @@ CbisonEngineDll::new_hf_tokenizer(const std::string &tokenizer_json,
 
   constexpr size_t buf_len = 1024;
   char err_buf[buf_len] = {};
+  auto t0 = Clock::now();
   cbison_tokenizer_t tok =
       fn(tokenizer_json.c_str(), options_json.c_str(), err_buf, buf_len);
+  timings_.tokenizer_ms = elapsed_ms(t0);
   error_string = err_buf;
   return tok;
 }
@@ -101,12 +112,138 @@ cbison_factory_t CbisonEngineDll::new_factory(cbison_tokenizer_t tokenizer,
 
   constexpr size_t buf_len = 1024;
   char err_buf[buf_len] = {};
+  auto t0 = Clock::now();
   cbison_factory_t factory =
       fn(tokenizer, options_json.c_str(), err_buf, buf_len);
+  timings_.factory_ms = elapsed_ms(t0);
   error_string = err_buf;
   return factory;
 }
 
+static void run_warmup(cbison_factory_t fptr, cbison_tokenizer_t tokenizer,
+                       const std::vector<WarmupItem> &items) {
+  Factory f(fptr);
+  Tokenizer t(tokenizer);
+  std::vector<Matcher> matchers;
+  for (auto &item : items) {
+    auto m = f.newMatcher(item.grammar_type, item.grammar);
+    if (m.getError())
+      continue;
+    auto tokens = item.tokens;
+    if (tokens.empty() && !item.text.empty())
+      tokens = t.tokenizeString(item.text);
+    std::vector<uint32_t> mask(f.maskByteLen() / 4);
+    for (auto tok : tokens) {
+      m.computeMask(mask.data());
+      if (m.consumeTokens({tok}) != 0)
+        break;
+    }
+    m.reset();
+    matchers.push_back(std::move(m));
+  }
+
+  // exercise the batch path too
+  if (f.hasComputeMasks() && !matchers.empty()) {
+    size_t words = f.maskByteLen() / 4;
+    std::vector<uint32_t> masks(matchers.size() * words);
+    std::vector<std::pair<Matcher *, uint32_t *>> reqs;
+    for (size_t i = 0; i < matchers.size(); ++i)
+      reqs.emplace_back(&matchers[i], masks.data() + i * words);
+    f.computeMasks(reqs);
+  }
+}
+
+PendingFactory
+CbisonEngineDll::new_factory_async(cbison_tokenizer_t tokenizer,
+                                   const std::string &options_json,
+                                   std::vector<WarmupItem> warmup) {
+  using fn_t = cbison_new_factory_fn_t;
+  std::string sym = prefix_ + "_cbison_new_factory";
+  fn_t fn = get_sym<fn_t>(sym);
+  StartupTimings base = timings_;
+  base.factory_ms = base.warmup_ms = 0;
+
+  if (!fn) {
+    std::promise<PendingFactory::Result> p;
+    PendingFactory::Result r;
+    r.error = "Missing symbol: " + sym;
+    r.timings = base;
+    p.set_value(std::move(r));
+    return PendingFactory(p.get_future());
+  }
+
+  tokenizer->incr_ref_count(tokenizer);
+  return PendingFactory(std::async(
+      std::launch::async,
+      [fn, tokenizer, options_json, warmup = std::move(warmup), base] {
+        PendingFactory::Result r;
+        r.timings = base;
+
+        constexpr size_t buf_len = 1024;
+        char err_buf[buf_len] = {};
+        auto t0 = Clock::now();
+        r.factory = fn(tokenizer, options_json.c_str(), err_buf, buf_len);
+        r.timings.factory_ms = elapsed_ms(t0);
+        r.error = err_buf;
+
+        if (r.factory && !warmup.empty()) {
+          auto t1 = Clock::now();
+          run_warmup(r.factory, tokenizer, warmup);
+          r.timings.warmup_ms = elapsed_ms(t1);
+        }
+        tokenizer->decr_ref_count(tokenizer);
+        return r;
+      }));
+}
+
+std::vector<WarmupItem> CbisonEngineDll::default_warmup() {
+  return {
+      {"json_object", "", {}, R"({"name": "warmup", "id": 12, "ok": true})"},
+      {"json",
+       R"({"type": "object", "properties": {"a": {"type": "string"},)"
+       R"( "b": {"type": "array", "items": {"type": "integer"}}},)"
+       R"( "required": ["a", "b"]})",
+       {},
+       R"({"a": "text", "b": [1, 2, 3]})"},
+      {"regex", "[a-z]+( [a-z]+)*\\.", {}, "hello world."},
+  };
+}
+
+void PendingFactory::release() noexcept {
+  if (!fut_.valid())
+    return;
+  auto r = fut_.get();
+  if (r.factory)
+    r.factory->decr_ref_count(r.factory);
+}
+
+PendingFactory::~PendingFactory() noexcept { release(); }
+
+PendingFactory &PendingFactory::operator=(PendingFactory &&o) noexcept {
+  if (this != &o) {
+    release();
+    fut_ = std::move(o.fut_);
+    timings_ = o.timings_;
+  }
+  return *this;
+}
+
+bool PendingFactory::ready() const noexcept {
+  return fut_.valid() && fut_.wait_for(std::chrono::seconds(0)) ==
+                             std::future_status::ready;
+}
+
+cbison_factory_t PendingFactory::wait(std::string &error_string) {
+  if (!fut_.valid()) {
+    error_string = "Factory already taken";
+    return nullptr;
+  }
+  auto r = fut_.get();
+  error_string = r.error;
+  timings_ = r.timings;
+  return r.factory;
+}
+
 cbison_tokenizer_t CbisonEngineDll::new_byte_tokenizer() {
   using fn_t = cbison_new_byte_tokenizer_fn_t;
   std::string sym = prefix_ + "_cbison_new_byte_tokenizer";
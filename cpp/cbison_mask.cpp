@@ -0,0 +1,200 @@
+#include "cbison.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace cbison {
+
+static constexpr uint16_t BF16_ALLOWED = 0x0000;
+static constexpr uint16_t BF16_DISALLOWED = 0xff80; // -inf
+
+size_t maskRowBytes(uint32_t format, size_t padded_vocab) noexcept {
+  switch (format) {
+  case CBISON_MASK_FORMAT_BITS:
+    return (padded_vocab + 31) / 32 * 4;
+  case CBISON_MASK_FORMAT_BOOL:
+    return padded_vocab;
+  case CBISON_MASK_FORMAT_BF16:
+    return padded_vocab * 2;
+  default:
+    return 0;
+  }
+}
+
+template <typename T>
+static void expand_row(const uint32_t *bits, size_t n_vocab, size_t padded,
+                       bool pad_allowed, T *dst, T yes, T no) {
+  size_t full_words = n_vocab / 32;
+  for (size_t w = 0; w < full_words; ++w) {
+    uint32_t v = bits[w];
+    T *d = dst + w * 32;
+    if (v == 0) {
+      std::fill(d, d + 32, no);
+    } else if (v == 0xffffffff) {
+      std::fill(d, d + 32, yes);
+    } else {
+      for (size_t b = 0; b < 32; ++b)
+        d[b] = (v >> b) & 1 ? yes : no;
+    }
+  }
+  for (size_t i = full_words * 32; i < n_vocab; ++i)
+    dst[i] = (bits[i / 32] >> (i % 32)) & 1 ? yes : no;
+  std::fill(dst + n_vocab, dst + padded, pad_allowed ? yes : no);
+}
+
+// Fix up a bit mask row already containing n_vocab valid bits.
+static void pad_bits_row(uint32_t *row, size_t n_vocab, size_t padded,
+                         bool pad_allowed) {
+  size_t n_words = (padded + 31) / 32;
+  size_t w = n_vocab / 32;
+  if (n_vocab % 32) {
+    uint32_t valid = (1u << (n_vocab % 32)) - 1;
+    row[w] = pad_allowed ? (row[w] | ~valid) : (row[w] & valid);
+    w++;
+  }
+  for (; w < n_words; ++w)
+    row[w] = pad_allowed ? 0xffffffff : 0;
+}
+
+void writeMaskRow(const uint32_t *bits, size_t n_vocab,
+                  const cbison_mask_layout_t &layout, size_t row) noexcept {
+  uint8_t *dst = static_cast<uint8_t *>(layout.base) + row * layout.row_stride;
+  bool pad = layout.pad_allowed != 0;
+  switch (layout.format) {
+  case CBISON_MASK_FORMAT_BITS: {
+    uint32_t *d = reinterpret_cast<uint32_t *>(dst);
+    if (d != bits)
+      std::memcpy(d, bits, (n_vocab + 31) / 32 * 4);
+    pad_bits_row(d, n_vocab, layout.padded_vocab, pad);
+    break;
+  }
+  case CBISON_MASK_FORMAT_BOOL:
+    expand_row<uint8_t>(bits, n_vocab, layout.padded_vocab, pad, dst, 1, 0);
+    break;
+  case CBISON_MASK_FORMAT_BF16:
+    expand_row<uint16_t>(bits, n_vocab, layout.padded_vocab, pad,
+                         reinterpret_cast<uint16_t *>(dst), BF16_ALLOWED,
+                         BF16_DISALLOWED);
+    break;
+  }
+}
+
+int Factory::computeMasksStrided(
+    const std::vector<Matcher *> &rows,
+    const cbison_mask_layout_t &layout) const noexcept {
+  size_t row_bytes = maskRowBytes(layout.format, layout.padded_vocab);
+  if (row_bytes == 0 || layout.padded_vocab < f_->n_vocab ||
+      layout.row_stride < row_bytes || !layout.base)
+    return -1;
+  if (layout.format == CBISON_MASK_FORMAT_BITS && layout.row_stride % 4 != 0)
+    return -1;
+
+  if (hasComputeMasksStrided()) {
+    std::vector<cbison_matcher_ptr_t> ms(rows.size());
+    for (size_t i = 0; i < rows.size(); ++i)
+      ms[i] = rows[i] ? rows[i]->get() : nullptr;
+    return f_->compute_masks_strided(f_, ms.data(), ms.size(), &layout);
+  }
+
+  // bit masks go straight into the destination; expanded formats need
+  // a scratch buffer
+  bool in_place = layout.format == CBISON_MASK_FORMAT_BITS;
+  size_t words = f_->mask_byte_len / 4;
+  std::vector<uint32_t> scratch;
+  if (!in_place)
+    scratch.resize(rows.size() * words);
+
+  auto dest = [&](size_t i) {
+    return in_place ? reinterpret_cast<uint32_t *>(
+                          static_cast<uint8_t *>(layout.base) +
+                          i * layout.row_stride)
+                    : scratch.data() + i * words;
+  };
+
+  std::vector<std::pair<Matcher *, uint32_t *>> reqs;
+  for (size_t i = 0; i < rows.size(); ++i)
+    if (rows[i])
+      reqs.emplace_back(rows[i], dest(i));
+
+  int rc = 0;
+  if (hasComputeMasks()) {
+    rc = computeMasks(reqs);
+  } else {
+    for (auto &r : reqs)
+      if (r.first->computeMask(r.second) != 0)
+        rc = -1;
+  }
+
+  for (size_t i = 0; i < rows.size(); ++i)
+    if (rows[i])
+      writeMaskRow(dest(i), f_->n_vocab, layout, i);
+  return rc;
+}
+
+static void step_one(cbison_factory_t f, cbison_step_req_t &r,
+                     const cbison_mask_layout_t *layout) {
+  cbison_matcher_t m = r.matcher;
+  r.flags = 0;
+  r.n_ff_tokens = 0;
+  bool ok = true;
+  if (r.token != CBISON_NO_TOKEN)
+    ok = f->consume_tokens(m, &r.token, 1) == 0;
+  if (ok && r.ff_tokens && f->compute_ff_tokens && !f->is_stopped(m)) {
+    int32_t n = f->compute_ff_tokens(m, r.ff_tokens, r.ff_tokens_len);
+    if (n > 0) {
+      size_t nn = std::min(static_cast<size_t>(n), r.ff_tokens_len);
+      ok = f->consume_tokens(m, r.ff_tokens, nn) == 0;
+      r.n_ff_tokens = nn;
+    }
+  }
+  if (!ok || f->get_error(m))
+    r.flags |= CBISON_STEP_ERROR;
+  if (f->is_stopped(m))
+    r.flags |= CBISON_STEP_STOPPED;
+  if (f->is_accepting(m))
+    r.flags |= CBISON_STEP_ACCEPTING;
+  if (!layout || (r.flags & CBISON_STEP_STOPPED))
+    return;
+
+  size_t words = f->mask_byte_len / 4;
+  if (layout->format == CBISON_MASK_FORMAT_BITS) {
+    uint32_t *dst = reinterpret_cast<uint32_t *>(
+        static_cast<uint8_t *>(layout->base) + r.mask_row * layout->row_stride);
+    if (f->compute_mask(m, dst, f->mask_byte_len) != 0)
+      r.flags |= CBISON_STEP_ERROR;
+    writeMaskRow(dst, f->n_vocab, *layout, r.mask_row);
+  } else {
+    thread_local std::vector<uint32_t> scratch;
+    scratch.resize(words);
+    if (f->compute_mask(m, scratch.data(), f->mask_byte_len) != 0)
+      r.flags |= CBISON_STEP_ERROR;
+    writeMaskRow(scratch.data(), f->n_vocab, *layout, r.mask_row);
+  }
+}
+
+int Factory::stepBatch(std::vector<cbison_step_req_t> &reqs,
+                       const cbison_mask_layout_t *layout,
+                       ThreadPool *pool) const noexcept {
+  if (layout) {
+    size_t row_bytes = maskRowBytes(layout->format, layout->padded_vocab);
+    if (row_bytes == 0 || layout->padded_vocab < f_->n_vocab ||
+        layout->row_stride < row_bytes || !layout->base)
+      return -1;
+    if (layout->format == CBISON_MASK_FORMAT_BITS &&
+        layout->row_stride % 4 != 0)
+      return -1;
+  }
+
+  if (hasStepBatch())
+    return f_->step_batch(f_, reqs.data(), reqs.size(), layout);
+
+  auto fn = [&](size_t i) { step_one(f_, reqs[i], layout); };
+  if (pool) {
+    pool->parallelFor(reqs.size(), fn);
+  } else {
+    for (size_t i = 0; i < reqs.size(); ++i)
+      fn(i);
+  }
+  return 0;
+}
+
+} // namespace cbison
@@ -0,0 +1,182 @@
+#include "cbison.hpp"
+#include <algorithm>
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+namespace cbison {
+
+static constexpr size_t ROW_ALIGN = 64;
+static constexpr size_t HUGE_PAGE = 2 * 1024 * 1024;
+
+static size_t round_up(size_t v, size_t a) { return (v + a - 1) / a * a; }
+
+static size_t page_size() {
+#ifdef _WIN32
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  return si.dwPageSize;
+#else
+  return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+static void read_faults(long &minor, long &major) {
+#ifdef _WIN32
+  minor = major = 0;
+#else
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  minor = ru.ru_minflt;
+  major = ru.ru_majflt;
+#endif
+}
+
+MaskArena::MaskArena(size_t mask_byte_len, const MaskArenaOptions &opts)
+    : opts_(opts), mask_byte_len_(mask_byte_len),
+      stride_(round_up(mask_byte_len, ROW_ALIGN)) {
+  opts_.n_buffers = std::max<size_t>(1, opts_.n_buffers);
+  read_faults(faults_min0_, faults_maj0_);
+
+  size_t page = opts_.huge_pages ? HUGE_PAGE : page_size();
+  buffer_bytes_ = round_up(opts_.max_slots * stride_, page);
+  mapped_bytes_ = buffer_bytes_ * opts_.n_buffers;
+  if (mapped_bytes_ == 0)
+    return;
+
+#ifdef _WIN32
+  base_ = static_cast<uint8_t *>(VirtualAlloc(
+      nullptr, mapped_bytes_, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+#else
+  void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (opts_.huge_pages) {
+    // no MAP_NORESERVE here: it would turn a short huge page pool into
+    // SIGBUS on first touch, instead of a failure we can fall back from
+    p = mmap(nullptr, mapped_bytes_, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    huge_ = p != MAP_FAILED;
+  }
+#endif
+  if (p == MAP_FAILED)
+    p = mmap(nullptr, mapped_bytes_, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED)
+    return;
+#ifdef MADV_HUGEPAGE
+  if (opts_.huge_pages && !huge_)
+    huge_ = madvise(p, mapped_bytes_, MADV_HUGEPAGE) == 0;
+#endif
+  base_ = static_cast<uint8_t *>(p);
+#endif
+}
+
+MaskArena::~MaskArena() noexcept {
+  if (!base_)
+    return;
+#ifdef _WIN32
+  VirtualFree(base_, 0, MEM_RELEASE);
+#else
+  // also drops any mlock()
+  munmap(base_, mapped_bytes_);
+#endif
+}
+
+int MaskArena::allocSlot() noexcept {
+  if (!base_)
+    return -1;
+  size_t slot;
+  if (!free_.empty()) {
+    std::pop_heap(free_.begin(), free_.end(), std::greater<size_t>());
+    slot = free_.back();
+    free_.pop_back();
+  } else if (high_water_ < opts_.max_slots) {
+    slot = high_water_++;
+  } else {
+    return -1;
+  }
+
+  if (opts_.lock_memory && high_water_ > locked_rows_) {
+#ifdef _WIN32
+    for (size_t b = 0; b < opts_.n_buffers; ++b)
+      VirtualLock(row(b, locked_rows_),
+                  (high_water_ - locked_rows_) * stride_);
+#else
+    // mlock() rounds to page boundaries itself
+    for (size_t b = 0; b < opts_.n_buffers; ++b)
+      mlock(row(b, locked_rows_), (high_water_ - locked_rows_) * stride_);
+#endif
+    locked_rows_ = high_water_;
+  }
+
+  for (size_t b = 0; b < opts_.n_buffers; ++b)
+    std::memset(row(b, slot), 0, stride_);
+  return static_cast<int>(slot);
+}
+
+void MaskArena::freeSlot(size_t slot) noexcept {
+  if (slot >= high_water_ ||
+      std::find(free_.begin(), free_.end(), slot) != free_.end())
+    return;
+  free_.push_back(slot);
+  std::push_heap(free_.begin(), free_.end(), std::greater<size_t>());
+}
+
+size_t MaskArena::advance() noexcept {
+  cur_ = (cur_ + 1) % opts_.n_buffers;
+  return cur_;
+}
+
+cbison_mask_layout_t MaskArena::layout(size_t b) const noexcept {
+  cbison_mask_layout_t l;
+  l.base = buffer(b);
+  l.row_stride = stride_;
+  l.padded_vocab = mask_byte_len_ * 8;
+  l.format = CBISON_MASK_FORMAT_BITS;
+  l.pad_allowed = 0;
+  return l;
+}
+
+MaskArenaStats MaskArena::stats() const noexcept {
+  MaskArenaStats st;
+  st.high_water = high_water_;
+  st.live_slots = high_water_ - free_.size();
+  st.fragmentation =
+      high_water_ ? double(free_.size()) / double(high_water_) : 0.0;
+  st.reserved_bytes = mapped_bytes_;
+  st.locked_bytes = locked_rows_ * stride_ * opts_.n_buffers;
+  st.huge_pages = huge_;
+
+  long mn, mj;
+  read_faults(mn, mj);
+  st.minor_faults = mn - faults_min0_;
+  st.major_faults = mj - faults_maj0_;
+
+#if defined(_WIN32)
+  st.resident_bytes = mapped_bytes_;
+#else
+  if (base_) {
+    size_t page = page_size();
+    size_t n_pages = mapped_bytes_ / page;
+#ifdef __APPLE__
+    std::vector<char> vec(n_pages);
+#else
+    std::vector<unsigned char> vec(n_pages);
+#endif
+    if (mincore(base_, mapped_bytes_, vec.data()) == 0)
+      for (auto v : vec)
+        if (v & 1)
+          st.resident_bytes += page;
+  }
+#endif
+  return st;
+}
+
+} // namespace cbison
@@ -0,0 +1,133 @@
+#pragma once
+
+// Wire protocol of cbison_maskd (see cpp/maskd/), and a client that
+// presents a remote factory as a local cbison_factory.
+//
+// The daemon hosts one factory per tokenizer and keeps all matcher state;
+// clients refer to matchers by 64-bit ids. Each request is a ReqHeader
+// followed by len bytes of payload, answered by a RespHeader followed by
+// len bytes of payload. Requests are synchronous (one in flight per
+// connection). Masks are not sent over the socket, but written into a
+// per-connection shared-memory ring of n_slots rows (mask_byte_len each),
+// whose descriptor is passed with the OP_HELLO response.
+//
+// POSIX only.
+
+#include "cbison_api.h"
+#include <cstdint>
+#include <string>
+
+namespace cbison::maskd {
+
+constexpr uint32_t PROTOCOL_MAGIC = 0x6b73616d; // "mask"
+constexpr uint32_t PROTOCOL_VERSION = 1;
+
+/// Upper bound for request/response payloads.
+constexpr uint32_t MAX_PAYLOAD = 64 << 20;
+
+enum Op : uint32_t {
+  /// payload: HelloReq + tokenizer name; response payload: HelloResp,
+  /// plus the ring descriptor (SCM_RIGHTS).
+  OP_HELLO = 1,
+  /// payload: grammar_type NUL grammar; status: validate_grammar() result,
+  /// response payload: message.
+  OP_VALIDATE_GRAMMAR,
+  /// payload: grammar_type NUL grammar; value: matcher id.
+  OP_NEW_MATCHER,
+  /// matcher: source; value: matcher id of the clone.
+  OP_CLONE_MATCHER,
+  /// matcher: id to free.
+  OP_FREE_MATCHER,
+  /// payload: uint64_t matcher ids; value: ring slot of the first mask,
+  /// the following ones wrap around the ring.
+  OP_COMPUTE_MASKS,
+  /// matcher, payload: uint32_t tokens.
+  OP_CONSUME_TOKENS,
+  /// matcher, payload: uint32_t tokens; status: validate_tokens() result.
+  OP_VALIDATE_TOKENS,
+  /// matcher, arg: max tokens; status: count, response payload: tokens.
+  OP_COMPUTE_FF_TOKENS,
+  /// matcher, arg: number of tokens.
+  OP_ROLLBACK,
+  /// matcher.
+  OP_RESET,
+  /// matcher; value: bytes.
+  OP_MATCHER_MEMORY,
+  /// value: bytes.
+  OP_FACTORY_MEMORY,
+};
+
+/// Matcher state returned with every matcher response, so that
+/// is_accepting(), is_stopped() and get_error() need no round-trip.
+enum MatcherFlags : uint32_t {
+  FLAG_ACCEPTING = 0x1,
+  FLAG_STOPPED = 0x2,
+  /// Response payload holds the error message.
+  FLAG_ERROR = 0x4,
+};
+
+/// Optional engine entries available in the daemon.
+enum Features : uint32_t {
+  FEAT_FF_TOKENS = 0x1,
+  FEAT_ROLLBACK = 0x2,
+  FEAT_RESET = 0x4,
+  FEAT_CLONE = 0x8,
+  FEAT_MEMORY = 0x10,
+};
+
+struct ReqHeader {
+  uint32_t op;
+  uint32_t len;
+  uint64_t matcher;
+  uint64_t arg;
+};
+
+struct RespHeader {
+  int32_t status;
+  uint32_t flags;
+  uint64_t value;
+  uint32_t len;
+  uint32_t reserved;
+};
+
+struct HelloReq {
+  uint32_t magic;
+  uint32_t version;
+};
+
+struct HelloResp {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t n_vocab;
+  uint64_t mask_byte_len;
+  uint64_t n_slots;
+  uint32_t eos_token_id;
+  uint32_t features;
+};
+
+namespace detail {
+// Blocking socket I/O shared by the daemon and the client.
+bool write_all(int fd, const void *buf, size_t len);
+bool read_all(int fd, void *buf, size_t len);
+// Like write_all()/read_all(), with a file descriptor attached.
+bool send_with_fd(int sock, const void *buf, size_t len, int fd);
+bool recv_with_fd(int sock, void *buf, size_t len, int *fd);
+} // namespace detail
+
+/**
+ * Connect to a cbison_maskd instance and return a factory backed by it.
+ * The factory can be used like one returned from
+ * CbisonEngineDll::new_factory(); calls on it are serialized over one
+ * connection, and batched compute_masks() calls are split by the ring size.
+ * If the connection is lost, all calls fail (matchers report an error).
+ *
+ * @param socket_path Path of the daemon's Unix domain socket.
+ * @param tokenizer Name of the tokenizer configured in the daemon.
+ * @param error_string Will be set to a diagnostic message, if any.
+ * @return Factory handle (refcount 1), or nullptr on error.
+ */
+cbison_factory_t connect_factory(const std::string &socket_path,
+                                 const std::string &tokenizer,
+                                 std::string &error_string);
+
+} // namespace cbison::maskd
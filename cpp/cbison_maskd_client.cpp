@@ -0,0 +1,546 @@
+#include "cbison_maskd.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define CBISON_MASKD_IMPL_MAGIC 0x6d61736b
+
+namespace cbison::maskd {
+
+#ifdef _WIN32
+
+cbison_factory_t connect_factory(const std::string &, const std::string &,
+                                 std::string &error_string) {
+  error_string = "cbison_maskd is not supported on this platform";
+  return nullptr;
+}
+
+#else
+
+namespace detail {
+
+bool write_all(int fd, const void *buf, size_t len) {
+  auto p = static_cast<const uint8_t *>(buf);
+  while (len > 0) {
+    ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= size_t(n);
+  }
+  return true;
+}
+
+bool read_all(int fd, void *buf, size_t len) {
+  auto p = static_cast<uint8_t *>(buf);
+  while (len > 0) {
+    ssize_t n = recv(fd, p, len, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= size_t(n);
+  }
+  return true;
+}
+
+bool send_with_fd(int sock, const void *buf, size_t len, int fd) {
+  struct iovec iov = {const_cast<void *>(buf), len};
+  alignas(struct cmsghdr) char ctrl[CMSG_SPACE(sizeof(int))] = {};
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctrl;
+  msg.msg_controllen = sizeof(ctrl);
+  struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(sizeof(int));
+  std::memcpy(CMSG_DATA(c), &fd, sizeof(int));
+
+  ssize_t n;
+  do
+    n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  while (n < 0 && errno == EINTR);
+  if (n <= 0)
+    return false;
+  // the descriptor went with the first byte
+  return write_all(sock, static_cast<const uint8_t *>(buf) + n, len - n);
+}
+
+bool recv_with_fd(int sock, void *buf, size_t len, int *fd) {
+  *fd = -1;
+  struct iovec iov = {buf, len};
+  alignas(struct cmsghdr) char ctrl[CMSG_SPACE(sizeof(int))] = {};
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctrl;
+  msg.msg_controllen = sizeof(ctrl);
+
+  ssize_t n;
+  do
+    n = recvmsg(sock, &msg, 0);
+  while (n < 0 && errno == EINTR);
+  if (n <= 0)
+    return false;
+  for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+    if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+      std::memcpy(fd, CMSG_DATA(c), sizeof(int));
+  return read_all(sock, static_cast<uint8_t *>(buf) + n, len - n);
+}
+
+} // namespace detail
+
+namespace {
+
+struct RemoteFactory;
+
+struct RemoteMatcher {
+  RemoteFactory *rf;
+  uint64_t id;
+  uint32_t flags;
+  std::string error;
+};
+
+struct RemoteFactory {
+  cbison_factory api;
+  std::atomic<int> ref_count{1};
+  std::mutex mutex;
+  int fd = -1;
+  const uint8_t *ring = nullptr;
+  size_t ring_bytes = 0;
+  size_t n_slots = 0;
+  bool broken = false;
+
+  ~RemoteFactory() {
+    if (ring)
+      munmap(const_cast<uint8_t *>(ring), ring_bytes);
+    if (fd >= 0)
+      close(fd);
+  }
+
+  // Sends a request and reads the response; caller holds mutex.
+  bool call(const ReqHeader &req, const void *payload, RespHeader &resp,
+            std::vector<uint8_t> &resp_payload) {
+    if (broken)
+      return false;
+    if (!detail::write_all(fd, &req, sizeof(req)) ||
+        (req.len && !detail::write_all(fd, payload, req.len)) ||
+        !detail::read_all(fd, &resp, sizeof(resp)) ||
+        resp.len > MAX_PAYLOAD) {
+      broken = true;
+      return false;
+    }
+    resp_payload.resize(resp.len);
+    if (resp.len && !detail::read_all(fd, resp_payload.data(), resp.len)) {
+      broken = true;
+      return false;
+    }
+    return true;
+  }
+
+  void copy_slot(size_t slot, uint32_t *dest) const {
+    std::memcpy(dest, ring + (slot % n_slots) * api.mask_byte_len,
+                api.mask_byte_len);
+  }
+};
+
+RemoteFactory *from_api(cbison_factory_t api) {
+  return reinterpret_cast<RemoteFactory *>(api->impl_data);
+}
+
+RemoteMatcher *from_c(cbison_matcher_t m) {
+  return reinterpret_cast<RemoteMatcher *>(m);
+}
+
+cbison_matcher_t to_c(RemoteMatcher *m) {
+  return reinterpret_cast<cbison_matcher_t>(m);
+}
+
+// The daemon drops connections sending more than MAX_PAYLOAD bytes, so
+// larger requests fail on the client side; this also keeps the length in
+// ReqHeader::len.
+bool too_large(size_t len) { return len > MAX_PAYLOAD; }
+
+ReqHeader make_req(Op op, uint64_t matcher = 0, uint64_t arg = 0,
+                   size_t len = 0) {
+  assert(!too_large(len));
+  ReqHeader r = {};
+  r.op = op;
+  r.len = static_cast<uint32_t>(len);
+  r.matcher = matcher;
+  r.arg = arg;
+  return r;
+}
+
+// Runs a matcher request and updates the cached flags and error.
+int32_t matcher_call(RemoteMatcher *m, const ReqHeader &req,
+                     const void *payload, RespHeader &resp,
+                     std::vector<uint8_t> &out) {
+  std::lock_guard<std::mutex> lock(m->rf->mutex);
+  if (!m->rf->call(req, payload, resp, out)) {
+    m->flags = FLAG_STOPPED | FLAG_ERROR;
+    m->error = "cbison_maskd connection lost";
+    return -1;
+  }
+  if (req.op == OP_CONSUME_TOKENS || req.op == OP_ROLLBACK ||
+      req.op == OP_RESET || (resp.flags & FLAG_ERROR)) {
+    m->flags = resp.flags;
+    if (resp.flags & FLAG_ERROR)
+      m->error.assign(out.begin(), out.end());
+  }
+  return resp.status;
+}
+
+void incr_ref(cbison_factory_t api) {
+  from_api(api)->ref_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void decr_ref(cbison_factory_t api) {
+  RemoteFactory *rf = from_api(api);
+  if (rf->ref_count.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    delete rf;
+}
+
+std::string grammar_payload(const char *type, const char *grammar) {
+  std::string p(type);
+  p.push_back('\0');
+  p += grammar;
+  return p;
+}
+
+int32_t validate_grammar(cbison_factory_t api, const char *type,
+                         const char *grammar, char *message,
+                         size_t message_len) {
+  RemoteFactory *rf = from_api(api);
+  auto p = grammar_payload(type, grammar);
+  RespHeader resp;
+  std::vector<uint8_t> out;
+  std::string msg;
+  int32_t r = -1;
+  if (too_large(p.size())) {
+    msg = "cbison_maskd: grammar too large";
+  } else {
+    std::lock_guard<std::mutex> lock(rf->mutex);
+    if (rf->call(make_req(OP_VALIDATE_GRAMMAR, 0, 0, p.size()), p.data(),
+                 resp, out)) {
+      r = resp.status;
+      msg.assign(out.begin(), out.end());
+    } else {
+      msg = "cbison_maskd connection lost";
+    }
+  }
+  if (message && message_len) {
+    size_t n = std::min(message_len - 1, msg.size());
+    std::memcpy(message, msg.data(), n);
+    message[n] = '\0';
+  }
+  return r;
+}
+
+// Wraps the response to OP_NEW_MATCHER or OP_CLONE_MATCHER; error is used
+// when the request was not sent.
+cbison_matcher_t new_remote(RemoteFactory *rf, bool ok, const RespHeader &resp,
+                            const std::vector<uint8_t> &out,
+                            const char *error =
+                                "cbison_maskd connection lost") {
+  auto m = new RemoteMatcher{rf, 0, FLAG_STOPPED | FLAG_ERROR, ""};
+  incr_ref(&rf->api);
+  if (!ok) {
+    m->error = error;
+  } else {
+    m->id = resp.value;
+    m->flags = resp.flags;
+    if (resp.flags & FLAG_ERROR)
+      m->error.assign(out.begin(), out.end());
+  }
+  return to_c(m);
+}
+
+cbison_matcher_t new_matcher(cbison_factory_t api, const char *type,
+                             const char *grammar) {
+  RemoteFactory *rf = from_api(api);
+  auto p = grammar_payload(type, grammar);
+  RespHeader resp;
+  std::vector<uint8_t> out;
+  if (too_large(p.size()))
+    return new_remote(rf, false, resp, out, "cbison_maskd: grammar too large");
+  std::lock_guard<std::mutex> lock(rf->mutex);
+  bool ok =
+      rf->call(make_req(OP_NEW_MATCHER, 0, 0, p.size()), p.data(), resp, out);
+  return new_remote(rf, ok, resp, out);
+}
+
+cbison_matcher_t clone_matcher(cbison_matcher_t matcher) {
+  RemoteMatcher *m = from_c(matcher);
+  RespHeader resp;
+  std::vector<uint8_t> out;
+  std::lock_guard<std::mutex> lock(m->rf->mutex);
+  bool ok = m->rf->call(make_req(OP_CLONE_MATCHER, m->id), nullptr, resp, out);
+  return new_remote(m->rf, ok, resp, out);
+}
+
+void free_matcher(cbison_matcher_t matcher) {
+  RemoteMatcher *m = from_c(matcher);
+  RemoteFactory *rf = m->rf;
+  if (m->id) {
+    RespHeader resp;
+    std::vector<uint8_t> out;
+    std::lock_guard<std::mutex> lock(rf->mutex);
+    rf->call(make_req(OP_FREE_MATCHER, m->id), nullptr, resp, out);
+  }
+  delete m;
+  decr_ref(&rf->api);
+}
+
+const char *get_error(cbison_matcher_t matcher) {
+  RemoteMatcher *m = from_c(matcher);
+  return (m->flags & FLAG_ERROR) ? m->error.c_str() : nullptr;
+}
+
+bool is_accepting(cbison_matcher_t matcher) {
+  return (from_c(matcher)->flags & FLAG_ACCEPTING) != 0;
+}
+
+bool is_stopped(cbison_matcher_t matcher) {
+  return (from_c(matcher)->flags & FLAG_STOPPED) != 0;
+}
+
+int32_t compute_masks(cbison_factory_t api, cbison_mask_req_t *reqs,
+                      size_t n_reqs) {
+  RemoteFactory *rf = from_api(api);
+  std::lock_guard<std::mutex> lock(rf->mutex);
+  int32_t result = 0;
+  std::vector<uint64_t> ids;
+  RespHeader resp;
+  std::vector<uint8_t> out;
+  // the ring holds n_slots masks; larger batches go in chunks
+  size_t chunk = std::min(rf->n_slots, MAX_PAYLOAD / sizeof(uint64_t));
+  for (size_t start = 0; start < n_reqs; start += chunk) {
+    size_t n = std::min(chunk, n_reqs - start);
+    ids.resize(n);
+    for (size_t i = 0; i < n; ++i)
+      ids[i] = from_c(reqs[start + i].matcher)->id;
+    if (!rf->call(make_req(OP_COMPUTE_MASKS, 0, 0, n * sizeof(uint64_t)),
+                  ids.data(), resp, out))
+      return -1;
+    if (resp.status != 0)
+      result = -1;
+    for (size_t i = 0; i < n; ++i)
+      rf->copy_slot(resp.value + i, reqs[start + i].mask_dest);
+  }
+  return result;
+}
+
+int32_t compute_mask(cbison_matcher_t matcher, uint32_t *mask_dest,
+                     size_t mask_byte_len) {
+  RemoteMatcher *m = from_c(matcher);
+  if (mask_byte_len != m->rf->api.mask_byte_len)
+    return -1;
+  cbison_mask_req_t req = {matcher, mask_dest};
+  return compute_masks(&m->rf->api, &req, 1);
+}
+
+int32_t consume_tokens(cbison_matcher_t matcher, const uint32_t *tokens,
+                       size_t n_tokens) {
+  RemoteMatcher *m = from_c(matcher);
+  if (too_large(n_tokens * sizeof(uint32_t)))
+    return -1;
+  RespHeader resp;
+  std::vector<uint8_t> out;
+  return matcher_call(
+      m, make_req(OP_CONSUME_TOKENS, m->id, 0, n_tokens * sizeof(uint32_t)),
+      tokens, resp, out);
+}
+
+int32_t validate_tokens(cbison_matcher_t matcher, const uint32_t *tokens,
+                        size_t n_tokens) {
+  RemoteMatcher *m = from_c(matcher);
+  if (too_large(n_tokens * sizeof(uint32_t)))
+    return -1;
+  RespHeader resp;
+  std::vector<uint8_t> out;
+  return matcher_call(
+      m, make_req(OP_VALIDATE_TOKENS, m->id, 0, n_tokens * sizeof(uint32_t)),
+      tokens, resp, out);
+}
+
+int32_t compute_ff_tokens(cbison_matcher_t matcher, uint32_t *output,
+                          size_t output_len) {
+  RemoteMatcher *m = from_c(matcher);
+  RespHeader resp;
+  std::vector<uint8_t> out;
+  int32_t r = matcher_call(m, make_req(OP_COMPUTE_FF_TOKENS, m->id, output_len),
+                           nullptr, resp, out);
+  if (r > 0)
+    std::memcpy(output, out.data(),
+                std::min(out.size(), output_len * sizeof(uint32_t)));
+  return r;
+}
+
+int32_t rollback(cbison_matcher_t matcher, size_t num_tokens) {
+  RemoteMatcher *m = from_c(matcher);
+  RespHeader resp;
+  std::vector<uint8_t> out;
+  return matcher_call(m, make_req(OP_ROLLBACK, m->id, num_tokens), nullptr,
+                      resp, out);
+}
+
+int32_t reset(cbison_matcher_t matcher) {
+  RemoteMatcher *m = from_c(matcher);
+  RespHeader resp;
+  std::vector<uint8_t> out;
+  return matcher_call(m, make_req(OP_RESET, m->id), nullptr, resp, out);
+}
+
+size_t matcher_memory_usage(cbison_matcher_t matcher) {
+  RemoteMatcher *m = from_c(matcher);
+  RespHeader resp;
+  std::vector<uint8_t> out;
+  if (matcher_call(m, make_req(OP_MATCHER_MEMORY, m->id), nullptr, resp,
+                   out) != 0)
+    return 0;
+  return resp.value;
+}
+
+size_t factory_memory_usage(cbison_factory_t api) {
+  RemoteFactory *rf = from_api(api);
+  RespHeader resp;
+  std::vector<uint8_t> out;
+  std::lock_guard<std::mutex> lock(rf->mutex);
+  if (!rf->call(make_req(OP_FACTORY_MEMORY), nullptr, resp, out))
+    return 0;
+  return resp.value;
+}
+
+} // namespace
+
+cbison_factory_t connect_factory(const std::string &socket_path,
+                                 const std::string &tokenizer,
+                                 std::string &error_string) {
+  struct sockaddr_un addr = {};
+  if (socket_path.size() >= sizeof(addr.sun_path)) {
+    error_string = "Socket path too long: " + socket_path;
+    return nullptr;
+  }
+  addr.sun_family = AF_UNIX;
+  std::memcpy(addr.sun_path, socket_path.c_str(), socket_path.size());
+
+  auto rf = new RemoteFactory();
+  auto fail = [&](const std::string &msg) -> cbison_factory_t {
+    error_string = msg;
+    delete rf;
+    return nullptr;
+  };
+
+  rf->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (rf->fd < 0 ||
+      connect(rf->fd, reinterpret_cast<struct sockaddr *>(&addr),
+              sizeof(addr)) != 0)
+    return fail("Failed to connect to " + socket_path + ": " +
+                std::strerror(errno));
+
+  std::string p(sizeof(HelloReq), '\0');
+  HelloReq hello = {PROTOCOL_MAGIC, PROTOCOL_VERSION};
+  std::memcpy(p.data(), &hello, sizeof(hello));
+  p += tokenizer;
+  if (too_large(p.size()))
+    return fail("Tokenizer name too long: " + tokenizer);
+  ReqHeader req = make_req(OP_HELLO, 0, 0, p.size());
+  RespHeader resp;
+  if (!detail::write_all(rf->fd, &req, sizeof(req)) ||
+      !detail::write_all(rf->fd, p.data(), p.size()) ||
+      !detail::read_all(rf->fd, &resp, sizeof(resp)) ||
+      resp.len > MAX_PAYLOAD)
+    return fail("cbison_maskd handshake failed");
+
+  std::vector<uint8_t> out(resp.len);
+  int ring_fd = -1;
+  if (resp.len && !detail::recv_with_fd(rf->fd, out.data(), out.size(), &ring_fd))
+    return fail("cbison_maskd handshake failed");
+  if (resp.status != 0) {
+    if (ring_fd >= 0)
+      close(ring_fd);
+    return fail(std::string(out.begin(), out.end()));
+  }
+  HelloResp info;
+  if (out.size() != sizeof(info) || ring_fd < 0) {
+    if (ring_fd >= 0)
+      close(ring_fd);
+    return fail("cbison_maskd: invalid handshake response");
+  }
+  std::memcpy(&info, out.data(), sizeof(info));
+  if (info.magic != PROTOCOL_MAGIC || info.version != PROTOCOL_VERSION ||
+      info.n_slots == 0) {
+    close(ring_fd);
+    return fail("cbison_maskd: protocol version mismatch");
+  }
+
+  rf->n_slots = info.n_slots;
+  rf->ring_bytes = info.n_slots * info.mask_byte_len;
+  void *ring = mmap(nullptr, rf->ring_bytes, PROT_READ, MAP_SHARED, ring_fd, 0);
+  close(ring_fd);
+  if (ring == MAP_FAILED)
+    return fail("cbison_maskd: failed to map mask ring");
+  rf->ring = static_cast<const uint8_t *>(ring);
+
+  cbison_factory &api = rf->api;
+  std::memset(&api, 0, sizeof(api));
+  api.magic = CBISON_FACTORY_MAGIC;
+  api.impl_magic = CBISON_MASKD_IMPL_MAGIC;
+  api.version_major = CBISON_FACTORY_VERSION_MAJOR;
+  api.version_minor = CBISON_FACTORY_VERSION_MINOR;
+  api.n_vocab = info.n_vocab;
+  api.mask_byte_len = info.mask_byte_len;
+  api.eos_token_id = info.eos_token_id;
+  api.impl_data = rf;
+  api.incr_ref_count = incr_ref;
+  api.decr_ref_count = decr_ref;
+  api.validate_grammar = validate_grammar;
+  api.new_matcher = new_matcher;
+  api.get_error = get_error;
+  api.compute_mask = compute_mask;
+  api.consume_tokens = consume_tokens;
+  api.is_accepting = is_accepting;
+  api.is_stopped = is_stopped;
+  api.validate_tokens = validate_tokens;
+  api.free_matcher = free_matcher;
+  api.compute_masks = compute_masks;
+  if (info.features & FEAT_FF_TOKENS)
+    api.compute_ff_tokens = compute_ff_tokens;
+  if (info.features & FEAT_ROLLBACK)
+    api.rollback = rollback;
+  if (info.features & FEAT_RESET)
+    api.reset = reset;
+  if (info.features & FEAT_CLONE)
+    api.clone_matcher = clone_matcher;
+  if (info.features & FEAT_MEMORY) {
+    api.matcher_memory_usage = matcher_memory_usage;
+    api.factory_memory_usage = factory_memory_usage;
+  }
+  error_string.clear();
+  return &api;
+}
+
+#endif
+
+} // namespace cbison::maskd
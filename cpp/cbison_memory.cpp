@@ -0,0 +1,106 @@
+#include "cbison.hpp"
+#include <algorithm>
+
+namespace cbison {
+
+void MemoryBudget::setCap(size_t cap_bytes) noexcept {
+  std::lock_guard<std::mutex> lock(mu_);
+  cap_ = cap_bytes;
+}
+
+size_t MemoryBudget::cap() const noexcept {
+  std::lock_guard<std::mutex> lock(mu_);
+  return cap_;
+}
+
+void MemoryBudget::addFactory(const Factory &f) noexcept {
+  std::lock_guard<std::mutex> lock(mu_);
+  if (std::find(factories_.begin(), factories_.end(), f.get()) ==
+      factories_.end())
+    factories_.push_back(f.get());
+}
+
+void MemoryBudget::removeFactory(const Factory &f) noexcept {
+  std::lock_guard<std::mutex> lock(mu_);
+  factories_.erase(std::remove(factories_.begin(), factories_.end(), f.get()),
+                   factories_.end());
+}
+
+void MemoryBudget::track(const Matcher &m,
+                         const std::string &grammar_type) noexcept {
+  std::lock_guard<std::mutex> lock(mu_);
+  matchers_[&m] = grammar_type;
+}
+
+void MemoryBudget::untrack(const Matcher &m) noexcept {
+  std::lock_guard<std::mutex> lock(mu_);
+  matchers_.erase(&m);
+}
+
+void MemoryBudget::addTrimCallback(TrimFn fn, int priority) noexcept {
+  std::lock_guard<std::mutex> lock(mu_);
+  trimmers_.emplace_back(priority, std::move(fn));
+  std::stable_sort(trimmers_.begin(), trimmers_.end(),
+                   [](const auto &a, const auto &b) {
+                     return a.first < b.first;
+                   });
+}
+
+MemoryUsage MemoryBudget::usageLocked() const {
+  MemoryUsage u;
+  for (auto f : factories_)
+    if (f->version_minor >= 3 && f->factory_memory_usage)
+      u.factories += f->factory_memory_usage(f);
+
+  for (auto &[m, type] : matchers_) {
+    auto it = std::find_if(u.by_type.begin(), u.by_type.end(),
+                           [&](const auto &e) { return e.first == type; });
+    if (it == u.by_type.end()) {
+      u.by_type.emplace_back(type, GrammarMemoryUsage());
+      it = u.by_type.end() - 1;
+    }
+    auto &g = it->second;
+    g.matchers++;
+    cbison_factory_t api = m->api();
+    if (m->get() && api->version_minor >= 3 && api->matcher_memory_usage) {
+      size_t b = api->matcher_memory_usage(m->get());
+      g.bytes += b;
+      u.matchers += b;
+    } else {
+      g.unknown++;
+    }
+  }
+
+  u.total = u.factories + u.matchers;
+  return u;
+}
+
+MemoryUsage MemoryBudget::usage() const noexcept {
+  std::lock_guard<std::mutex> lock(mu_);
+  return usageLocked();
+}
+
+MemoryUsage MemoryBudget::enforce() noexcept {
+  std::vector<std::pair<int, TrimFn>> trimmers;
+  size_t cap;
+  MemoryUsage u;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    u = usageLocked();
+    cap = cap_;
+    // callbacks typically untrack matchers, so they run without the lock
+    trimmers = trimmers_;
+  }
+  if (cap == 0)
+    return u;
+
+  for (auto &[prio, fn] : trimmers) {
+    if (u.total <= cap)
+      break;
+    fn(u.total - cap);
+    u = usage();
+  }
+  return u;
+}
+
+} // namespace cbison
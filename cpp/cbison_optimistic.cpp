@@ -0,0 +1,114 @@
+#include "cbison.hpp"
+#include <chrono>
+
+namespace cbison {
+
+using Clock = std::chrono::steady_clock;
+
+// weight of a new sample in the moving averages
+static constexpr double EMA_ALPHA = 0.05;
+
+static double ema(double avg, double sample) {
+  return avg == 0 ? sample : avg + EMA_ALPHA * (sample - avg);
+}
+
+OptimisticStats &
+OptimisticDecoder::typeStats(const std::string &grammar_type) {
+  for (auto &e : types_)
+    if (e.first == grammar_type)
+      return e.second;
+  types_.emplace_back(grammar_type, OptimisticStats());
+  return types_.back().second;
+}
+
+bool OptimisticDecoder::shouldTryOptimistic(const std::string &grammar_type) {
+  std::lock_guard<std::mutex> lock(mu_);
+  auto &st = typeStats(grammar_type);
+  if (!st.always_mask)
+    return true;
+  return opts_.probe_interval && st.steps % opts_.probe_interval == 0;
+}
+
+void OptimisticDecoder::record(const std::string &grammar_type, bool tried,
+                               bool fell_back, double validate_us,
+                               double mask_us) {
+  std::lock_guard<std::mutex> lock(mu_);
+  auto &st = typeStats(grammar_type);
+  st.steps++;
+  if (tried) {
+    st.optimistic++;
+    st.validate_us = ema(st.validate_us, validate_us);
+    // not ema(): zero is a valid rate here
+    double f = fell_back ? 1.0 : 0.0;
+    st.recent_fallback_rate =
+        st.optimistic == 1
+            ? f
+            : st.recent_fallback_rate +
+                  EMA_ALPHA * (f - st.recent_fallback_rate);
+  }
+  if (fell_back)
+    st.fallbacks++;
+  if (!tried || fell_back) {
+    st.masked++;
+    st.mask_us = ema(st.mask_us, mask_us);
+  }
+
+  if (st.steps < opts_.min_steps || st.mask_us == 0 || st.optimistic == 0)
+    return;
+  // expected optimistic cost per step vs. always computing the mask; the
+  // recent rate, so that probes can switch back after the grammar's
+  // behavior changes
+  double cost = st.validate_us + st.recent_fallback_rate * st.mask_us;
+  st.always_mask = cost > st.mask_us;
+}
+
+int OptimisticDecoder::select(const Matcher &m,
+                              const std::string &grammar_type,
+                              const std::vector<uint32_t> &candidates,
+                              uint32_t &token, uint32_t *mask) noexcept {
+  bool tried = !candidates.empty() && m.api()->validate_tokens &&
+               shouldTryOptimistic(grammar_type);
+  double validate_us = 0;
+
+  if (tried) {
+    auto t0 = Clock::now();
+    uint32_t eos = m.api()->eos_token_id;
+    for (auto c : candidates) {
+      bool ok = c == eos ? m.isAccepting() : m.validateTokens({c}) == 1;
+      if (ok) {
+        validate_us = std::chrono::duration<double, std::micro>(
+                          Clock::now() - t0)
+                          .count();
+        record(grammar_type, true, false, validate_us, 0);
+        token = c;
+        return 1;
+      }
+    }
+    validate_us =
+        std::chrono::duration<double, std::micro>(Clock::now() - t0).count();
+  }
+
+  auto t1 = Clock::now();
+  int rc = m.computeMask(mask);
+  double mask_us =
+      std::chrono::duration<double, std::micro>(Clock::now() - t1).count();
+  record(grammar_type, tried, tried, validate_us, mask_us);
+  return rc == 0 ? 0 : -1;
+}
+
+OptimisticStats
+OptimisticDecoder::stats(const std::string &grammar_type) const noexcept {
+  std::lock_guard<std::mutex> lock(mu_);
+  for (auto &e : types_)
+    if (e.first == grammar_type)
+      return e.second;
+  return OptimisticStats();
+}
+
+std::vector<std::pair<std::string, OptimisticStats>>
+OptimisticDecoder::allStats() const noexcept {
+  std::lock_guard<std::mutex> lock(mu_);
+  return types_;
+}
+
+} // namespace cbison
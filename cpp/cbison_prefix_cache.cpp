@@ -0,0 +1,294 @@
+#include "cbison.hpp"
+#include <algorithm>
+
+namespace cbison {
+
+// A cached state. Entries are shared with the lookups forking from them,
+// so that forks and restores run outside of mu_ and eviction does not
+// pull the state from under them.
+struct MatcherPrefixCache::Entry {
+  std::mutex mu; // serializes forks of matcher
+  std::optional<Matcher> matcher;
+  std::optional<MatcherSnapshot> snap;
+  size_t bytes = 0;
+};
+
+struct MatcherPrefixCache::Node {
+  std::string key; // set on roots only
+  std::vector<uint32_t> edge;
+  Node *parent = nullptr;
+  std::unordered_map<uint32_t, std::unique_ptr<Node>> children;
+  std::shared_ptr<Entry> entry;
+  std::list<Node *>::iterator lru;
+
+  bool cached() const { return entry != nullptr; }
+};
+
+static std::string cacheKey(const std::string &type,
+                            const std::string &grammar) {
+  std::string key = type;
+  key.push_back('\0');
+  key += grammar;
+  return key;
+}
+
+MatcherPrefixCache::MatcherPrefixCache(const Factory &factory,
+                                       PrefixCacheOptions opts)
+    : factory_(factory), opts_(opts) {
+  opts_.min_prefix = std::max<size_t>(opts_.min_prefix, 1);
+}
+
+MatcherPrefixCache::~MatcherPrefixCache() noexcept { clear(); }
+
+bool MatcherPrefixCache::canFork() const noexcept {
+  cbison_factory_t f = factory_.get();
+  return f->clone_matcher != nullptr ||
+         (f->version_minor >= 6 && f->fork_matcher != nullptr);
+}
+
+Matcher MatcherPrefixCache::newMatcher(const std::string &type,
+                                       const std::string &grammar,
+                                       const std::vector<uint32_t> &tokens,
+                                       size_t *n_cached) noexcept {
+  std::string key = cacheKey(type, grammar);
+  std::optional<Matcher> m;
+  std::shared_ptr<Entry> hit;
+  size_t start = 0;
+  size_t branch = 0; // length of the longest prefix present in the tree
+
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    stats_.lookups++;
+    auto it = roots_.find(key);
+    if (it != roots_.end()) {
+      Node *n = it->second.get();
+      Node *best = nullptr;
+      size_t d = 0;
+      for (;;) {
+        if (n->cached()) {
+          best = n;
+          start = d;
+        }
+        branch = d;
+        if (d == tokens.size())
+          break;
+        auto c = n->children.find(tokens[d]);
+        if (c == n->children.end())
+          break;
+        Node *child = c->second.get();
+        size_t k = 0;
+        while (k < child->edge.size() && d + k < tokens.size() &&
+               child->edge[k] == tokens[d + k])
+          ++k;
+        if (k < child->edge.size()) {
+          branch = d + k;
+          break;
+        }
+        n = child;
+        d += k;
+      }
+
+      if (best) {
+        hit = best->entry;
+        lru_.splice(lru_.begin(), lru_, best->lru);
+      } else {
+        start = 0;
+      }
+    }
+  }
+
+  if (hit) {
+    if (hit->matcher) {
+      std::lock_guard<std::mutex> lock(hit->mu);
+      m.emplace(hit->matcher->fork());
+    } else {
+      m.emplace(factory_.restoreMatcher(type, grammar, *hit->snap));
+    }
+    hit.reset();
+    if (m->getError()) {
+      m.reset();
+      start = 0;
+    } else {
+      std::lock_guard<std::mutex> lock(mu_);
+      stats_.hits++;
+      stats_.tokens_reused += start;
+    }
+  }
+
+  if (!m)
+    m.emplace(factory_.newMatcher(type, grammar));
+  if (n_cached)
+    *n_cached = start;
+  if (m->getError())
+    return std::move(*m);
+
+  auto consume = [&](size_t from, size_t to) {
+    if (to <= from)
+      return true;
+    std::vector<uint32_t> slice(tokens.begin() + from, tokens.begin() + to);
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      stats_.tokens_replayed += slice.size();
+    }
+    return m->consumeTokens(slice) == 0;
+  };
+
+  // keep the state where this sequence leaves the cached paths, so that
+  // the next sequence branching there does not replay the shared part
+  if (branch > start && branch < tokens.size() &&
+      branch >= opts_.min_prefix) {
+    if (!consume(start, branch))
+      return std::move(*m);
+    start = branch;
+    store(key, tokens, branch, *m);
+  }
+  if (!consume(start, tokens.size()))
+    return std::move(*m);
+  if (tokens.size() >= opts_.min_prefix && start < tokens.size())
+    store(key, tokens, tokens.size(), *m);
+  return std::move(*m);
+}
+
+void MatcherPrefixCache::insert(const std::string &type,
+                                const std::string &grammar,
+                                const std::vector<uint32_t> &tokens,
+                                const Matcher &m) noexcept {
+  if (tokens.size() < opts_.min_prefix || m.getError())
+    return;
+  store(cacheKey(type, grammar), tokens, tokens.size(), m);
+}
+
+void MatcherPrefixCache::store(const std::string &key,
+                               const std::vector<uint32_t> &tokens, size_t len,
+                               const Matcher &m) {
+  auto e = std::make_shared<Entry>();
+  if (canFork()) {
+    e->matcher.emplace(m.fork());
+    if (e->matcher->getError())
+      return;
+    e->bytes = e->matcher->memoryUsage().value_or(opts_.state_bytes);
+  } else if (m.hasSnapshot()) {
+    e->snap.emplace(m.snapshot());
+    // the engine may still fail to serialize this state, and a snapshot
+    // to replay from scratch saves nothing
+    if (e->snap->data.empty())
+      return;
+    e->bytes = e->snap->data.size();
+  } else {
+    return;
+  }
+  e->bytes += len * sizeof(uint32_t);
+  // declared after e, so that an unused entry is freed outside of mu_
+  std::lock_guard<std::mutex> lock(mu_);
+  insertLocked(key, tokens, len, e);
+}
+
+void MatcherPrefixCache::insertLocked(const std::string &key,
+                                      const std::vector<uint32_t> &tokens,
+                                      size_t len, std::shared_ptr<Entry> &e) {
+  auto &root = roots_[key];
+  if (!root) {
+    root = std::make_unique<Node>();
+    root->key = key;
+  }
+
+  Node *n = root.get();
+  size_t d = 0;
+  while (d < len) {
+    auto it = n->children.find(tokens[d]);
+    if (it == n->children.end()) {
+      auto c = std::make_unique<Node>();
+      c->edge.assign(tokens.begin() + d, tokens.begin() + len);
+      c->parent = n;
+      Node *cp = c.get();
+      n->children.emplace(tokens[d], std::move(c));
+      n = cp;
+      break;
+    }
+    Node *c = it->second.get();
+    size_t k = 0;
+    while (k < c->edge.size() && d + k < len && c->edge[k] == tokens[d + k])
+      ++k;
+    if (k < c->edge.size()) {
+      // split the edge at the divergence point
+      auto mid = std::make_unique<Node>();
+      mid->edge.assign(c->edge.begin(), c->edge.begin() + k);
+      mid->parent = n;
+      c->edge.erase(c->edge.begin(), c->edge.begin() + k);
+      c->parent = mid.get();
+      mid->children.emplace(c->edge[0], std::move(it->second));
+      it->second = std::move(mid);
+      c = it->second.get();
+    }
+    n = c;
+    d += k;
+  }
+
+  if (n->cached()) {
+    lru_.splice(lru_.begin(), lru_, n->lru);
+    return;
+  }
+  n->entry = std::move(e);
+  n->lru = lru_.insert(lru_.begin(), n);
+  stats_.insertions++;
+  stats_.entries++;
+  stats_.bytes += n->entry->bytes;
+  evictUntilLocked(opts_.max_bytes);
+}
+
+void MatcherPrefixCache::evictLocked(Node *n) {
+  if (n->cached()) {
+    lru_.erase(n->lru);
+    stats_.bytes -= n->entry->bytes;
+    stats_.entries--;
+    stats_.evictions++;
+    n->entry.reset();
+  }
+
+  // drop empty leaves, then merge a pass-through node into its only child
+  while (n->parent && !n->cached() && n->children.empty()) {
+    Node *p = n->parent;
+    p->children.erase(n->edge[0]);
+    n = p;
+  }
+  if (n->parent && !n->cached() && n->children.size() == 1) {
+    auto child = std::move(n->children.begin()->second);
+    child->edge.insert(child->edge.begin(), n->edge.begin(), n->edge.end());
+    child->parent = n->parent;
+    n->parent->children[child->edge[0]] = std::move(child);
+  } else if (!n->parent && !n->cached() && n->children.empty()) {
+    std::string key = n->key;
+    roots_.erase(key);
+  }
+}
+
+size_t MatcherPrefixCache::evictUntilLocked(size_t max_bytes) {
+  size_t freed = 0;
+  while (stats_.bytes > max_bytes && !lru_.empty()) {
+    Node *n = lru_.back();
+    freed += n->entry->bytes;
+    evictLocked(n);
+  }
+  return freed;
+}
+
+size_t MatcherPrefixCache::trim(size_t bytes) noexcept {
+  std::lock_guard<std::mutex> lock(mu_);
+  return evictUntilLocked(stats_.bytes > bytes ? stats_.bytes - bytes : 0);
+}
+
+void MatcherPrefixCache::clear() noexcept {
+  std::lock_guard<std::mutex> lock(mu_);
+  stats_.evictions += stats_.entries;
+  roots_.clear();
+  lru_.clear();
+  stats_.entries = 0;
+  stats_.bytes = 0;
+}
+
+PrefixCacheStats MatcherPrefixCache::stats() const noexcept {
+  std::lock_guard<std::mutex> lock(mu_);
+  return stats_;
+}
+
+} // namespace cbison
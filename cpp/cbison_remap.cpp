@@ -0,0 +1,432 @@
+#include "cbison.hpp"
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cstring>
+#include <unordered_map>
+
+#if (defined(__x86_64__) || defined(__i386__)) &&                              \
+    (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define CBISON_REMAP_AVX2 1
+#endif
+
+#define CBISON_REMAP_IMPL_MAGIC 0x7e3a9c01
+
+namespace cbison {
+
+namespace {
+
+struct RemappedMatcher {
+  RemappedFactory *rf;
+  cbison_matcher_t inner;
+  // engine mask plus one trailing zero word (target of unmapped tokens)
+  std::vector<uint32_t> scratch;
+  std::string error;
+};
+
+RemappedMatcher *from_c(cbison_matcher_t m) {
+  return reinterpret_cast<RemappedMatcher *>(m);
+}
+
+cbison_matcher_t to_c(RemappedMatcher *m) {
+  return reinterpret_cast<cbison_matcher_t>(m);
+}
+
+void gather_scalar(const uint32_t *src, const uint32_t *idx, uint32_t *dst,
+                   size_t n_words) {
+  for (size_t w = 0; w < n_words; ++w) {
+    uint32_t v = 0;
+    for (size_t b = 0; b < 32; ++b) {
+      uint32_t e = idx[w * 32 + b];
+      v |= ((src[e >> 5] >> (e & 31)) & 1u) << b;
+    }
+    dst[w] = v;
+  }
+}
+
+#ifdef CBISON_REMAP_AVX2
+__attribute__((target("avx2"))) void
+gather_avx2(const uint32_t *src, const uint32_t *idx, uint32_t *dst,
+            size_t n_words) {
+  const __m256i five = _mm256_set1_epi32(5);
+  const __m256i low = _mm256_set1_epi32(31);
+  for (size_t w = 0; w < n_words; ++w) {
+    uint32_t v = 0;
+    for (size_t j = 0; j < 4; ++j) {
+      __m256i e = _mm256_loadu_si256(
+          reinterpret_cast<const __m256i *>(idx + w * 32 + j * 8));
+      __m256i words = _mm256_i32gather_epi32(
+          reinterpret_cast<const int *>(src), _mm256_srlv_epi32(e, five), 4);
+      __m256i bits = _mm256_srlv_epi32(words, _mm256_and_si256(e, low));
+      int m = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_slli_epi32(bits, 31)));
+      v |= uint32_t(m) << (j * 8);
+    }
+    dst[w] = v;
+  }
+}
+
+bool has_avx2() {
+  static const bool r = __builtin_cpu_supports("avx2");
+  return r;
+}
+#endif
+
+} // namespace
+
+void RemappedFactory::remapMask(const uint32_t *engine_mask,
+                                uint32_t *model_mask) const noexcept {
+  size_t n_words = api_struct_.mask_byte_len / 4;
+
+  size_t allowed = 0;
+  for (size_t i = 0; i < inner_words_; ++i)
+    allowed += std::popcount(engine_mask[i]);
+
+  // dense gather costs a fixed amount per model token; with few allowed
+  // tokens it is cheaper to clear and scatter them
+  if (allowed * 16 < api_struct_.n_vocab) {
+    n_scatter_.fetch_add(1, std::memory_order_relaxed);
+    std::memset(model_mask, 0, n_words * 4);
+    size_t n_engine = to_model_start_.size() - 1;
+    for (size_t i = 0; i < inner_words_; ++i) {
+      for (uint32_t w = engine_mask[i]; w; w &= w - 1) {
+        size_t e = i * 32 + std::countr_zero(w);
+        if (e >= n_engine)
+          break;
+        for (uint32_t k = to_model_start_[e]; k < to_model_start_[e + 1]; ++k)
+          model_mask[to_model_[k] >> 5] |= 1u << (to_model_[k] & 31);
+      }
+    }
+    return;
+  }
+
+  n_gather_.fetch_add(1, std::memory_order_relaxed);
+#ifdef CBISON_REMAP_AVX2
+  if (has_avx2()) {
+    gather_avx2(engine_mask, to_engine_.data(), model_mask, n_words);
+    return;
+  }
+#endif
+  gather_scalar(engine_mask, to_engine_.data(), model_mask, n_words);
+}
+
+struct RemappedFactoryImpl {
+  static RemappedFactory *fromC(cbison_factory_t api) {
+    assert(api && api->impl_magic == CBISON_REMAP_IMPL_MAGIC);
+    return reinterpret_cast<RemappedFactory *>(api->impl_data);
+  }
+
+  static cbison_factory_t inner(cbison_matcher_t m) {
+    return from_c(m)->rf->inner_;
+  }
+
+  static void incr_ref(cbison_factory_t api) {
+    fromC(api)->ref_count_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  static void decr_ref(cbison_factory_t api) {
+    RemappedFactory *self = fromC(api);
+    if (self->ref_count_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      delete self;
+  }
+
+  static cbison_matcher_t wrap(RemappedFactory *rf, cbison_matcher_t inner,
+                               const std::string &error = {}) {
+    auto m = new RemappedMatcher{rf, inner, {}, error};
+    incr_ref(&rf->api_struct_);
+    return to_c(m);
+  }
+
+  // Translates tokens to engine space; stops at the first unmapped one.
+  static std::vector<uint32_t> translate(const RemappedFactory *rf,
+                                         const uint32_t *tokens, size_t n) {
+    std::vector<uint32_t> r;
+    r.reserve(n);
+    uint32_t unmapped = uint32_t(rf->inner_words_ * 32);
+    for (size_t i = 0; i < n; ++i) {
+      if (tokens[i] >= rf->api_struct_.n_vocab ||
+          rf->to_engine_[tokens[i]] == unmapped)
+        break;
+      r.push_back(rf->to_engine_[tokens[i]]);
+    }
+    return r;
+  }
+
+  static int32_t validate_grammar(cbison_factory_t api, const char *type,
+                                  const char *grammar, char *message,
+                                  size_t message_len) {
+    cbison_factory_t f = fromC(api)->inner_;
+    return f->validate_grammar(f, type, grammar, message, message_len);
+  }
+
+  static cbison_matcher_t new_matcher(cbison_factory_t api, const char *type,
+                                      const char *grammar) {
+    RemappedFactory *rf = fromC(api);
+    return wrap(rf, rf->inner_->new_matcher(rf->inner_, type, grammar));
+  }
+
+  static const char *get_error(cbison_matcher_t matcher) {
+    RemappedMatcher *m = from_c(matcher);
+    if (!m->error.empty())
+      return m->error.c_str();
+    return inner(matcher)->get_error(m->inner);
+  }
+
+  static int32_t compute_masks(cbison_factory_t api, cbison_mask_req_t *reqs,
+                               size_t n_reqs) {
+    RemappedFactory *rf = fromC(api);
+    cbison_factory_t f = rf->inner_;
+    size_t inner_bytes = f->mask_byte_len;
+    std::vector<cbison_mask_req_t> inner_reqs(n_reqs);
+    for (size_t i = 0; i < n_reqs; ++i) {
+      RemappedMatcher *m = from_c(reqs[i].matcher);
+      m->scratch.resize(rf->inner_words_ + 1);
+      m->scratch.back() = 0;
+      inner_reqs[i] = {m->inner, m->scratch.data()};
+    }
+
+    int32_t r = 0;
+    if (f->compute_masks) {
+      r = f->compute_masks(f, inner_reqs.data(), n_reqs);
+    } else {
+      for (auto &req : inner_reqs)
+        if (f->compute_mask(req.matcher, req.mask_dest, inner_bytes) != 0)
+          r = -1;
+    }
+    for (size_t i = 0; i < n_reqs; ++i)
+      rf->remapMask(inner_reqs[i].mask_dest, reqs[i].mask_dest);
+    return r;
+  }
+
+  static int32_t compute_mask(cbison_matcher_t matcher, uint32_t *mask_dest,
+                              size_t mask_byte_len) {
+    RemappedFactory *rf = from_c(matcher)->rf;
+    if (mask_byte_len != rf->api_struct_.mask_byte_len)
+      return -1;
+    cbison_mask_req_t req = {matcher, mask_dest};
+    return compute_masks(&rf->api_struct_, &req, 1);
+  }
+
+  static int32_t consume_tokens(cbison_matcher_t matcher,
+                                const uint32_t *tokens, size_t n_tokens) {
+    RemappedMatcher *m = from_c(matcher);
+    if (!m->error.empty())
+      return -1;
+    auto t = translate(m->rf, tokens, n_tokens);
+    int32_t r = inner(matcher)->consume_tokens(m->inner, t.data(), t.size());
+    if (r == 0 && t.size() < n_tokens) {
+      m->error = "token " + std::to_string(tokens[t.size()]) +
+                 " has no counterpart in the engine vocabulary";
+      return -1;
+    }
+    return r;
+  }
+
+  static bool is_accepting(cbison_matcher_t matcher) {
+    RemappedMatcher *m = from_c(matcher);
+    return m->error.empty() && inner(matcher)->is_accepting(m->inner);
+  }
+
+  static bool is_stopped(cbison_matcher_t matcher) {
+    RemappedMatcher *m = from_c(matcher);
+    return !m->error.empty() || inner(matcher)->is_stopped(m->inner);
+  }
+
+  static int32_t validate_tokens(cbison_matcher_t matcher,
+                                 const uint32_t *tokens, size_t n_tokens) {
+    RemappedMatcher *m = from_c(matcher);
+    auto t = translate(m->rf, tokens, n_tokens);
+    return inner(matcher)->validate_tokens(m->inner, t.data(), t.size());
+  }
+
+  static int32_t compute_ff_tokens(cbison_matcher_t matcher, uint32_t *output,
+                                   size_t output_len) {
+    RemappedMatcher *m = from_c(matcher);
+    RemappedFactory *rf = m->rf;
+    int32_t n = inner(matcher)->compute_ff_tokens(m->inner, output, output_len);
+    // map back in place; stop at tokens the model does not have
+    for (int32_t i = 0; i < n; ++i) {
+      uint32_t e = output[i];
+      if (e + 1 >= rf->to_model_start_.size() ||
+          rf->to_model_start_[e] == rf->to_model_start_[e + 1])
+        return i;
+      output[i] = rf->to_model_[rf->to_model_start_[e]];
+    }
+    return n;
+  }
+
+  static void free_matcher(cbison_matcher_t matcher) {
+    RemappedMatcher *m = from_c(matcher);
+    RemappedFactory *rf = m->rf;
+    rf->inner_->free_matcher(m->inner);
+    delete m;
+    decr_ref(&rf->api_struct_);
+  }
+
+  static int32_t rollback(cbison_matcher_t matcher, size_t num_tokens) {
+    RemappedMatcher *m = from_c(matcher);
+    if (!m->error.empty())
+      return -1;
+    return inner(matcher)->rollback(m->inner, num_tokens);
+  }
+
+  static int32_t reset(cbison_matcher_t matcher) {
+    RemappedMatcher *m = from_c(matcher);
+    if (!m->error.empty())
+      return -1;
+    return inner(matcher)->reset(m->inner);
+  }
+
+  static cbison_matcher_t clone_matcher(cbison_matcher_t matcher) {
+    RemappedMatcher *m = from_c(matcher);
+    return wrap(m->rf, inner(matcher)->clone_matcher(m->inner), m->error);
+  }
+
+  static cbison_matcher_t fork_matcher(cbison_matcher_t matcher) {
+    RemappedMatcher *m = from_c(matcher);
+    return wrap(m->rf, inner(matcher)->fork_matcher(m->inner), m->error);
+  }
+
+  static size_t matcher_memory_usage(cbison_matcher_t matcher) {
+    RemappedMatcher *m = from_c(matcher);
+    return inner(matcher)->matcher_memory_usage(m->inner) +
+           sizeof(*m) + m->scratch.capacity() * 4 + m->error.capacity();
+  }
+
+  static size_t factory_memory_usage(cbison_factory_t api) {
+    RemappedFactory *rf = fromC(api);
+    return rf->inner_->factory_memory_usage(rf->inner_) +
+           (rf->to_engine_.capacity() + rf->to_model_start_.capacity() +
+            rf->to_model_.capacity()) *
+               4;
+  }
+
+  static size_t snapshot_matcher(cbison_matcher_t matcher, uint8_t *output,
+                                 size_t output_len) {
+    RemappedMatcher *m = from_c(matcher);
+    if (!m->error.empty())
+      return 0;
+    return inner(matcher)->snapshot_matcher(m->inner, output, output_len);
+  }
+
+  static cbison_matcher_t restore_matcher(cbison_factory_t api,
+                                          const char *type,
+                                          const char *grammar,
+                                          const uint8_t *snapshot,
+                                          size_t snapshot_len) {
+    RemappedFactory *rf = fromC(api);
+    return wrap(rf, rf->inner_->restore_matcher(rf->inner_, type, grammar,
+                                                snapshot, snapshot_len));
+  }
+};
+
+RemappedFactory::RemappedFactory(cbison_factory_t inner,
+                                 std::vector<uint32_t> model_to_engine,
+                                 uint32_t eos_token_id)
+    : inner_(inner), inner_words_(inner->mask_byte_len / 4),
+      to_engine_(std::move(model_to_engine)) {
+  inner_->incr_ref_count(inner_);
+
+  size_t n_vocab = to_engine_.size();
+  size_t n_engine = inner_->n_vocab;
+  uint32_t unmapped = uint32_t(inner_words_ * 32);
+  if (eos_token_id < n_vocab)
+    to_engine_[eos_token_id] = inner_->eos_token_id;
+  for (auto &e : to_engine_)
+    if (e >= n_engine)
+      e = unmapped;
+
+  // inverse mapping
+  to_model_start_.assign(n_engine + 1, 0);
+  for (auto e : to_engine_)
+    if (e != unmapped)
+      to_model_start_[e + 1]++;
+  for (size_t i = 0; i < n_engine; ++i)
+    to_model_start_[i + 1] += to_model_start_[i];
+  to_model_.resize(to_model_start_[n_engine]);
+  std::vector<uint32_t> fill(to_model_start_.begin(), to_model_start_.end() - 1);
+  for (size_t i = 0; i < n_vocab; ++i)
+    if (to_engine_[i] != unmapped)
+      to_model_[fill[to_engine_[i]]++] = uint32_t(i);
+
+  to_engine_.resize((n_vocab + 31) / 32 * 32, unmapped);
+
+  using I = RemappedFactoryImpl;
+  cbison_factory &a = api_struct_;
+  std::memset(&a, 0, sizeof(a));
+  a.magic = CBISON_FACTORY_MAGIC;
+  a.impl_magic = CBISON_REMAP_IMPL_MAGIC;
+  a.version_major = CBISON_FACTORY_VERSION_MAJOR;
+  a.version_minor = std::min<uint32_t>(inner_->version_minor,
+                                       CBISON_FACTORY_VERSION_MINOR);
+  a.n_vocab = n_vocab;
+  a.mask_byte_len = (n_vocab + 31) / 32 * 4;
+  a.eos_token_id = eos_token_id;
+  a.impl_data = this;
+  a.incr_ref_count = I::incr_ref;
+  a.decr_ref_count = I::decr_ref;
+  a.validate_grammar = I::validate_grammar;
+  a.new_matcher = I::new_matcher;
+  a.get_error = I::get_error;
+  a.compute_mask = I::compute_mask;
+  a.consume_tokens = I::consume_tokens;
+  a.is_accepting = I::is_accepting;
+  a.is_stopped = I::is_stopped;
+  a.validate_tokens = I::validate_tokens;
+  a.free_matcher = I::free_matcher;
+  a.compute_masks = I::compute_masks;
+  if (inner_->compute_ff_tokens)
+    a.compute_ff_tokens = I::compute_ff_tokens;
+  if (inner_->rollback)
+    a.rollback = I::rollback;
+  if (inner_->reset)
+    a.reset = I::reset;
+  if (inner_->clone_matcher)
+    a.clone_matcher = I::clone_matcher;
+  if (a.version_minor >= 3 && inner_->matcher_memory_usage &&
+      inner_->factory_memory_usage) {
+    a.matcher_memory_usage = I::matcher_memory_usage;
+    a.factory_memory_usage = I::factory_memory_usage;
+  }
+  if (a.version_minor >= 4 && inner_->snapshot_matcher &&
+      inner_->restore_matcher) {
+    a.snapshot_matcher = I::snapshot_matcher;
+    a.restore_matcher = I::restore_matcher;
+  }
+  if (a.version_minor >= 6 && inner_->fork_matcher)
+    a.fork_matcher = I::fork_matcher;
+}
+
+RemappedFactory::~RemappedFactory() { inner_->decr_ref_count(inner_); }
+
+std::vector<uint32_t> RemappedFactory::mapByBytes(cbison_tokenizer_t model,
+                                                  cbison_tokenizer_t engine) {
+  Tokenizer m(model), e(engine);
+  // special tokens are keyed separately, so that they never match text
+  auto key = [](const Tokenizer &t, uint32_t id) {
+    auto b = t.getToken(id);
+    std::string k(1, t.isSpecialToken(id) ? '\1' : '\0');
+    k.append(b.begin(), b.end());
+    return k;
+  };
+
+  std::unordered_map<std::string, uint32_t> by_bytes;
+  by_bytes.reserve(engine->n_vocab);
+  for (uint32_t i = 0; i < engine->n_vocab; ++i) {
+    auto k = key(e, i);
+    if (k.size() > 1)
+      by_bytes.emplace(std::move(k), i);
+  }
+
+  std::vector<uint32_t> r(model->n_vocab, CBISON_NO_TOKEN);
+  for (uint32_t i = 0; i < model->n_vocab; ++i) {
+    auto it = by_bytes.find(key(m, i));
+    if (it != by_bytes.end())
+      r[i] = it->second;
+  }
+  if (model->eos_token_id < r.size())
+    r[model->eos_token_id] = engine->eos_token_id;
+  return r;
+}
+
+} // namespace cbison
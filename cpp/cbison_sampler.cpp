@@ -0,0 +1,382 @@
+#include "cbison.hpp"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <limits>
+
+#if (defined(__x86_64__) || defined(__i386__)) &&                              \
+    (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define CBISON_SAMPLER_AVX2 1
+#endif
+
+namespace cbison {
+
+namespace {
+
+constexpr float NEG_INF = -std::numeric_limits<float>::infinity();
+
+struct Candidate {
+  float z; // scaled logit
+  uint32_t token;
+};
+
+// uniform double in [0, 1) from the seed
+double seed_to_unit(uint64_t seed) {
+  uint64_t z = seed + 0x9e3779b97f4a7c15ull;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  z ^= z >> 31;
+  return double(z >> 11) * 0x1.0p-53;
+}
+
+// mask word w with bits past n_vocab cleared
+uint32_t mask_word(const uint32_t *mask, size_t w, size_t n_vocab) {
+  uint32_t m = mask[w];
+  size_t rem = n_vocab - w * 32;
+  if (rem < 32)
+    m &= (1u << rem) - 1;
+  return m;
+}
+
+float masked_max_scalar(const float *logits, const uint32_t *mask,
+                        size_t n_vocab) {
+  float best = NEG_INF;
+  size_t words = (n_vocab + 31) / 32;
+  for (size_t w = 0; w < words; ++w)
+    for (uint32_t m = mask_word(mask, w, n_vocab); m; m &= m - 1)
+      best = std::max(best, logits[w * 32 + std::countr_zero(m)]);
+  return best;
+}
+
+#ifdef CBISON_SAMPLER_AVX2
+__attribute__((target("avx2"))) float
+masked_max_avx2(const float *logits, const uint32_t *mask, size_t n_vocab) {
+  const __m256i bit = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  const __m256 neg_inf = _mm256_set1_ps(NEG_INF);
+  __m256 best = neg_inf;
+  size_t full = n_vocab / 32;
+  for (size_t w = 0; w < full; ++w) {
+    uint32_t m = mask[w];
+    if (!m)
+      continue;
+    for (size_t j = 0; j < 4; ++j) {
+      __m256i b = _mm256_set1_epi32(int((m >> (j * 8)) & 0xff));
+      __m256i sel = _mm256_cmpeq_epi32(_mm256_and_si256(b, bit), bit);
+      __m256 v = _mm256_loadu_ps(logits + w * 32 + j * 8);
+      v = _mm256_blendv_ps(neg_inf, v, _mm256_castsi256_ps(sel));
+      best = _mm256_max_ps(best, v);
+    }
+  }
+  alignas(32) float lanes[8];
+  _mm256_store_ps(lanes, best);
+  float r = *std::max_element(lanes, lanes + 8);
+  if (full * 32 < n_vocab)
+    for (uint32_t m = mask_word(mask, full, n_vocab); m; m &= m - 1)
+      r = std::max(r, logits[full * 32 + std::countr_zero(m)]);
+  return r;
+}
+
+bool has_avx2() {
+  static const bool r = __builtin_cpu_supports("avx2");
+  return r;
+}
+#endif
+
+float masked_max(const float *logits, const uint32_t *mask, size_t n_vocab) {
+#ifdef CBISON_SAMPLER_AVX2
+  if (has_avx2())
+    return masked_max_avx2(logits, mask, n_vocab);
+#endif
+  return masked_max_scalar(logits, mask, n_vocab);
+}
+
+// temperature, min-p, top-k and top-p over the candidate list, then sample
+uint32_t sample_candidates(std::vector<Candidate> &cand,
+                           const SamplingParams &p, double u) {
+  auto best = std::max_element(
+      cand.begin(), cand.end(),
+      [](const Candidate &a, const Candidate &b) { return a.z < b.z; });
+  if (p.temperature <= 0 || best->z == NEG_INF)
+    return best->token;
+
+  float mx = best->z;
+  float inv_t = 1.0f / p.temperature;
+  for (auto &c : cand)
+    c.z = (c.z - mx) * inv_t;
+  if (p.min_p > 0) {
+    float thr = std::log(p.min_p);
+    cand.erase(std::remove_if(cand.begin(), cand.end(),
+                              [&](const Candidate &c) { return c.z < thr; }),
+               cand.end());
+  }
+
+  auto by_z = [](const Candidate &a, const Candidate &b) {
+    return a.z > b.z || (a.z == b.z && a.token < b.token);
+  };
+  if (p.top_k > 0 && p.top_k < cand.size()) {
+    std::nth_element(cand.begin(), cand.begin() + p.top_k, cand.end(), by_z);
+    cand.resize(p.top_k);
+  }
+  if (p.top_p < 1.0f) {
+    double total = 0;
+    for (auto &c : cand)
+      total += std::exp(double(c.z));
+    // the head covering top_p is usually short: sort a growing prefix
+    // instead of all candidates
+    double acc = 0;
+    size_t keep = 0, sorted = 0;
+    for (size_t k = 64; keep == sorted && sorted < cand.size(); k *= 4) {
+      size_t end = std::min(cand.size(), sorted + k);
+      if (end < cand.size())
+        std::nth_element(cand.begin() + sorted, cand.begin() + end,
+                         cand.end(), by_z);
+      std::sort(cand.begin() + sorted, cand.begin() + end, by_z);
+      sorted = end;
+      while (keep < sorted && acc < p.top_p * total)
+        acc += std::exp(double(cand[keep++].z));
+    }
+    cand.resize(std::max<size_t>(keep, 1));
+  }
+
+  double sum = 0;
+  for (auto &c : cand)
+    sum += std::exp(double(c.z));
+  double target = u * sum, acc = 0;
+  for (auto &c : cand) {
+    acc += std::exp(double(c.z));
+    if (acc > target)
+      return c.token;
+  }
+  return cand.back().token;
+}
+
+#ifdef CBISON_SAMPLER_AVX2
+// exp() of 8 floats (Cephes polynomial, within a few ulp); inputs below
+// -87 give about 1e-38 rather than 0
+__attribute__((target("avx2"))) __m256 exp256(__m256 x) {
+  x = _mm256_min_ps(x, _mm256_set1_ps(88.3762626647949f));
+  x = _mm256_max_ps(x, _mm256_set1_ps(-87.3365447505531f));
+  __m256 n = _mm256_round_ps(
+      _mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)),
+      _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  x = _mm256_sub_ps(x, _mm256_mul_ps(n, _mm256_set1_ps(0.693359375f)));
+  x = _mm256_sub_ps(x, _mm256_mul_ps(n, _mm256_set1_ps(-2.12194440e-4f)));
+  __m256 y = _mm256_set1_ps(1.9875691500e-4f);
+  y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(1.3981999507e-3f));
+  y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(8.3334519073e-3f));
+  y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(4.1665795894e-2f));
+  y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(1.6666665459e-1f));
+  y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(5.0000001201e-1f));
+  y = _mm256_add_ps(_mm256_mul_ps(y, _mm256_mul_ps(x, x)),
+                    _mm256_add_ps(x, _mm256_set1_ps(1.0f)));
+  __m256i e = _mm256_slli_epi32(
+      _mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+  return _mm256_mul_ps(y, _mm256_castsi256_ps(e));
+}
+
+// weights exp((logit - mx) * inv_t) of the allowed tokens at or above thr
+// (0 for the others) of full mask words, and their sum per word; zero
+// words are skipped
+__attribute__((target("avx2"))) void
+dense_weights_avx2(const float *logits, const uint32_t *mask, size_t full,
+                   float mx, float inv_t, float thr, float *weights,
+                   double *word_sum) {
+  const __m256i bit = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  const __m256 vmx = _mm256_set1_ps(mx), vinv = _mm256_set1_ps(inv_t),
+               vthr = _mm256_set1_ps(thr), zero = _mm256_setzero_ps();
+  for (size_t w = 0; w < full; ++w) {
+    uint32_t m = mask[w];
+    word_sum[w] = 0;
+    if (!m)
+      continue;
+    __m256 acc = zero;
+    for (size_t j = 0; j < 4; ++j) {
+      __m256i b = _mm256_set1_epi32(int((m >> (j * 8)) & 0xff));
+      __m256 sel = _mm256_castsi256_ps(
+          _mm256_cmpeq_epi32(_mm256_and_si256(b, bit), bit));
+      __m256 v = _mm256_loadu_ps(logits + w * 32 + j * 8);
+      sel = _mm256_and_ps(sel, _mm256_cmp_ps(v, vthr, _CMP_GE_OQ));
+      __m256 e = exp256(_mm256_mul_ps(_mm256_sub_ps(v, vmx), vinv));
+      e = _mm256_blendv_ps(zero, e, sel);
+      _mm256_storeu_ps(weights + w * 32 + j * 8, e);
+      acc = _mm256_add_ps(acc, e);
+    }
+    alignas(32) float lanes[8];
+    _mm256_store_ps(lanes, acc);
+    double ws = 0;
+    for (float l : lanes)
+      ws += l;
+    word_sum[w] = ws;
+  }
+}
+#endif
+
+// temperature and min-p over the allowed tokens of a dense mask
+uint32_t sample_dense(const float *logits, const uint32_t *mask,
+                      size_t n_vocab, const SamplingParams &p, double u) {
+  size_t words = (n_vocab + 31) / 32;
+  float mx = masked_max(logits, mask, n_vocab);
+
+  uint32_t first = CBISON_NO_TOKEN;
+  if (p.temperature <= 0 || mx == NEG_INF) {
+    for (size_t w = 0; w < words; ++w)
+      for (uint32_t m = mask_word(mask, w, n_vocab); m; m &= m - 1) {
+        uint32_t t = uint32_t(w * 32 + std::countr_zero(m));
+        if (first == CBISON_NO_TOKEN)
+          first = t;
+        if (logits[t] == mx)
+          return t;
+      }
+    return first;
+  }
+
+  // token weights (only read for allowed tokens) and their sums per mask
+  // word, so that exp() is computed once per allowed token and the draw
+  // only scans the weights of one word
+  thread_local std::vector<float> weights;
+  thread_local std::vector<double> word_sum;
+  weights.resize(words * 32);
+  word_sum.resize(words);
+  float inv_t = 1.0f / p.temperature;
+  float thr = p.min_p > 0 ? mx + p.temperature * std::log(p.min_p) : NEG_INF;
+  size_t w0 = 0;
+#ifdef CBISON_SAMPLER_AVX2
+  if (has_avx2()) {
+    w0 = n_vocab / 32;
+    dense_weights_avx2(logits, mask, w0, mx, inv_t, thr, weights.data(),
+                       word_sum.data());
+  }
+#endif
+  for (size_t w = w0; w < words; ++w) {
+    double ws = 0;
+    for (uint32_t m = mask_word(mask, w, n_vocab); m; m &= m - 1) {
+      size_t t = w * 32 + std::countr_zero(m);
+      float l = logits[t];
+      float e = l >= thr ? std::exp((l - mx) * inv_t) : 0.0f;
+      weights[t] = e;
+      ws += e;
+    }
+    word_sum[w] = ws;
+  }
+
+  double sum = 0;
+  for (double ws : word_sum)
+    sum += ws;
+  double target = u * sum, acc = 0;
+  uint32_t last = CBISON_NO_TOKEN;
+  for (size_t w = 0; w < words; ++w) {
+    if (word_sum[w] == 0)
+      continue;
+    if (acc + word_sum[w] <= target && w + 1 < words) {
+      acc += word_sum[w];
+      continue;
+    }
+    for (uint32_t m = mask_word(mask, w, n_vocab); m; m &= m - 1) {
+      uint32_t t = uint32_t(w * 32 + std::countr_zero(m));
+      if (weights[t] == 0.0f)
+        continue;
+      acc += weights[t];
+      last = t;
+      if (acc > target)
+        return t;
+    }
+  }
+  return last;
+}
+
+} // namespace
+
+void ConstrainedSampler::sampleRow(SampleRow &row) noexcept {
+  row.token = CBISON_NO_TOKEN;
+  rows_.fetch_add(1, std::memory_order_relaxed);
+  const SamplingParams &p = row.params;
+  double u = seed_to_unit(row.seed);
+
+  thread_local std::vector<Candidate> cand;
+  cand.clear();
+  if (row.mask) {
+    size_t words = (n_vocab_ + 31) / 32;
+    size_t allowed = 0;
+    for (size_t w = 0; w < words; ++w)
+      allowed += std::popcount(mask_word(row.mask, w, n_vocab_));
+    if (allowed == 0) {
+      empty_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    // the candidate list pays off for sparse masks, and is needed for
+    // top-k/top-p anyway
+    bool dense = allowed * 16 >= n_vocab_;
+    if (dense && p.top_k == 0 && p.top_p >= 1.0f) {
+      dense_.fetch_add(1, std::memory_order_relaxed);
+      row.token = sample_dense(row.logits, row.mask, n_vocab_, p, u);
+      return;
+    }
+    cand.reserve(allowed);
+    for (size_t w = 0; w < words; ++w)
+      for (uint32_t m = mask_word(row.mask, w, n_vocab_); m; m &= m - 1) {
+        uint32_t t = uint32_t(w * 32 + std::countr_zero(m));
+        cand.push_back(Candidate{row.logits[t], t});
+      }
+    (dense ? dense_ : sparse_).fetch_add(1, std::memory_order_relaxed);
+  } else {
+    for (size_t i = 0; i < row.n_allowed; ++i)
+      if (row.allowed[i] < n_vocab_)
+        cand.push_back(Candidate{row.logits[row.allowed[i]], row.allowed[i]});
+    if (cand.empty()) {
+      empty_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    sparse_.fetch_add(1, std::memory_order_relaxed);
+  }
+  row.token = sample_candidates(cand, p, u);
+}
+
+uint32_t ConstrainedSampler::sample(const float *logits, const uint32_t *mask,
+                                    const SamplingParams &params,
+                                    uint64_t seed) noexcept {
+  SampleRow row;
+  row.logits = logits;
+  row.mask = mask;
+  row.params = params;
+  row.seed = seed;
+  sampleRow(row);
+  return row.token;
+}
+
+uint32_t ConstrainedSampler::sample(const float *logits,
+                                    const std::vector<uint32_t> &allowed,
+                                    const SamplingParams &params,
+                                    uint64_t seed) noexcept {
+  SampleRow row;
+  row.logits = logits;
+  row.allowed = allowed.data();
+  row.n_allowed = allowed.size();
+  row.params = params;
+  row.seed = seed;
+  sampleRow(row);
+  return row.token;
+}
+
+int ConstrainedSampler::sampleBatch(std::vector<SampleRow> &rows) noexcept {
+  if (pool_ && rows.size() > 1)
+    pool_->parallelFor(rows.size(), [&](size_t i) { sampleRow(rows[i]); });
+  else
+    for (auto &r : rows)
+      sampleRow(r);
+  for (auto &r : rows)
+    if (r.token == CBISON_NO_TOKEN)
+      return -1;
+  return 0;
+}
+
+SamplerStats ConstrainedSampler::stats() const noexcept {
+  SamplerStats st;
+  st.rows = rows_.load(std::memory_order_relaxed);
+  st.dense = dense_.load(std::memory_order_relaxed);
+  st.sparse = sparse_.load(std::memory_order_relaxed);
+  st.empty = empty_.load(std::memory_order_relaxed);
+  return st;
+}
+
+} // namespace cbison
@@ -0,0 +1,204 @@
+#include "cbison.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace cbison {
+
+using Clock = std::chrono::steady_clock;
+
+// weight of a new sample in the moving averages
+static constexpr double EMA_ALPHA = 0.05;
+
+static double ema(double avg, double sample) {
+  return avg == 0 ? sample : avg + EMA_ALPHA * (sample - avg);
+}
+
+static double elapsed_us(Clock::time_point t0) {
+  return std::chrono::duration<double, std::micro>(Clock::now() - t0).count();
+}
+
+struct SpeculativeMasker::Branch {
+  uint32_t token;
+  std::optional<Matcher> m;
+  std::vector<uint32_t> mask;
+  // the rest is guarded by Shared::mu
+  bool cancelled = false;
+  bool started = false;
+  bool done = false;
+  int rc = -1; // 0: mask ready, 1: stopped without mask, -1: failed
+  double cpu_us = 0;
+};
+
+struct SpeculativeMasker::Prepared {
+  uint64_t version; // of the matcher when prepared
+  std::vector<Branch> branches;
+};
+
+// State shared with the branch tasks.
+struct SpeculativeMasker::Shared {
+  std::mutex mu;
+  std::condition_variable cv;
+  // by Matcher::id(): the engine pointer may be reused once freed
+  std::unordered_map<uint64_t, std::shared_ptr<Prepared>> pending;
+  size_t running = 0;
+  SpeculativeStats stats;
+};
+
+SpeculativeMasker::SpeculativeMasker(const Factory &factory,
+                                     SpeculativeOptions opts, size_t n_threads)
+    : factory_(factory), opts_(opts), sh_(std::make_shared<Shared>()),
+      pool_(n_threads) {}
+
+SpeculativeMasker::~SpeculativeMasker() noexcept {
+  std::unique_lock<std::mutex> lock(sh_->mu);
+  for (auto &e : sh_->pending)
+    for (auto &b : e.second->branches)
+      b.cancelled = true;
+  sh_->pending.clear();
+  sh_->cv.wait(lock, [&] { return sh_->running == 0; });
+}
+
+std::shared_ptr<SpeculativeMasker::Prepared>
+SpeculativeMasker::take(uint64_t id) noexcept {
+  std::lock_guard<std::mutex> lock(sh_->mu);
+  auto it = sh_->pending.find(id);
+  if (it == sh_->pending.end())
+    return nullptr;
+  auto p = std::move(it->second);
+  sh_->pending.erase(it);
+  return p;
+}
+
+void SpeculativeMasker::cancel(const Matcher &m) noexcept {
+  auto p = take(m.id());
+  if (!p)
+    return;
+  std::lock_guard<std::mutex> lock(sh_->mu);
+  for (auto &b : p->branches)
+    b.cancelled = true;
+}
+
+void SpeculativeMasker::prepare(
+    const Matcher &m, const std::vector<uint32_t> &candidates) noexcept {
+  cancel(m);
+  cbison_factory_t api = factory_.get();
+  if (!api->clone_matcher && !m.hasFork())
+    return;
+
+  auto p = std::make_shared<Prepared>();
+  p->version = m.version();
+  size_t words = factory_.maskByteLen() / 4;
+  for (uint32_t t : candidates) {
+    if (p->branches.size() >= opts_.max_branches)
+      break;
+    bool dup = false;
+    for (auto &b : p->branches)
+      dup = dup || b.token == t;
+    if (dup)
+      continue;
+    Matcher f = m.fork();
+    if (f.getError())
+      continue;
+    Branch b;
+    b.token = t;
+    b.m.emplace(std::move(f));
+    b.mask.resize(words);
+    p->branches.push_back(std::move(b));
+  }
+
+  size_t n = p->branches.size();
+  {
+    std::lock_guard<std::mutex> lock(sh_->mu);
+    sh_->pending[m.id()] = p;
+    sh_->running += n;
+    sh_->stats.prepared++;
+    sh_->stats.branches += n;
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    pool_.submit([sh = sh_, p, i] {
+      Branch &b = p->branches[i];
+      bool run;
+      {
+        std::lock_guard<std::mutex> lock(sh->mu);
+        run = !b.cancelled;
+        b.started = run;
+      }
+      int rc = -1;
+      double us = 0;
+      if (run) {
+        auto t0 = Clock::now();
+        if (b.m->consumeTokens({b.token}) == 0) {
+          if (b.m->computeMask(b.mask.data()) == 0)
+            rc = 0;
+          else if (b.m->isStopped())
+            rc = 1;
+        }
+        us = elapsed_us(t0);
+      }
+      std::lock_guard<std::mutex> lock(sh->mu);
+      b.rc = rc;
+      b.cpu_us = us;
+      b.done = true;
+      sh->stats.branch_cpu_us += us;
+      sh->running--;
+      sh->cv.notify_all();
+    });
+  }
+}
+
+int SpeculativeMasker::commit(Matcher &m, uint32_t token,
+                              uint32_t *mask) noexcept {
+  auto t0 = Clock::now();
+  if (auto p = take(m.id())) {
+    Branch *hit = nullptr;
+    bool waited = false;
+    // m changed since prepare() (other than by commit()): stale branches
+    bool stale = p->version != m.version();
+    {
+      std::unique_lock<std::mutex> lock(sh_->mu);
+      for (auto &b : p->branches) {
+        if (b.token == token && b.started && !stale)
+          hit = &b;
+        else
+          b.cancelled = true;
+      }
+      if (hit) {
+        waited = !hit->done;
+        sh_->cv.wait(lock, [&] { return hit->done; });
+        if (hit->rc < 0)
+          hit = nullptr;
+      }
+    }
+
+    if (hit) {
+      m.replaceWith(std::move(*hit->m), 0, {token});
+      if (hit->rc == 0)
+        std::memcpy(mask, hit->mask.data(), factory_.maskByteLen());
+      std::lock_guard<std::mutex> lock(sh_->mu);
+      auto &st = sh_->stats;
+      st.hits++;
+      st.waited += waited;
+      st.useful_cpu_us += hit->cpu_us;
+      st.hit_commit_us = ema(st.hit_commit_us, elapsed_us(t0));
+      return 1;
+    }
+  }
+
+  int rc = -1;
+  if (m.consumeTokens({token}) == 0 &&
+      (m.computeMask(mask) == 0 || m.isStopped()))
+    rc = 0;
+  std::lock_guard<std::mutex> lock(sh_->mu);
+  auto &st = sh_->stats;
+  st.misses++;
+  st.miss_commit_us = ema(st.miss_commit_us, elapsed_us(t0));
+  return rc;
+}
+
+SpeculativeStats SpeculativeMasker::stats() const noexcept {
+  std::lock_guard<std::mutex> lock(sh_->mu);
+  return sh_->stats;
+}
+
+} // namespace cbison
@@ -0,0 +1,271 @@
+#pragma once
+
+// Compile-time binding to a statically linked engine.
+//
+// cbison::Matcher and cbison::Factory dispatch every call through the
+// function pointers of a (typically dlopen()ed) cbison_factory. When the
+// engine is linked into the same binary, the templates below call its
+// entry points directly, so they can be inlined (with LTO even across the
+// C boundary).
+//
+// The Engine parameter is a traits type with static member functions
+// named and typed like the cbison_factory entries (without the
+// cbison_factory_t argument where the matcher suffices):
+//
+//   struct MyEngine {
+//     static cbison_matcher_ptr_t new_matcher(cbison_factory_t, const char *,
+//                                             const char *);
+//     static int32_t compute_mask(cbison_matcher_t, uint32_t *, size_t);
+//     ...
+//   };
+//
+// Optional entries (validate_tokens, compute_ff_tokens, rollback, reset,
+// clone_matcher, fork_matcher, compute_masks) may be left out; the
+// corresponding methods then behave as in cbison::Matcher when the pointer
+// is NULL.
+// CBISON_DECLARE_STATIC_ENGINE() defines such a type for engines exporting
+// <prefix>_cbison_<entry> symbols, as described in cbison_api.h (see
+// test_static.cpp for an example).
+
+#include <concepts>
+#include "cbison.hpp"
+
+namespace cbison {
+namespace static_binding {
+
+/// Required entries of an engine traits type.
+template <typename E>
+concept EngineTraits = requires(cbison_factory_t f, cbison_matcher_t m,
+                                uint32_t *buf, const uint32_t *toks,
+                                size_t n, const char *s, char *msg) {
+  { E::validate_grammar(f, s, s, msg, n) } -> std::same_as<int32_t>;
+  { E::new_matcher(f, s, s) } -> std::same_as<cbison_matcher_ptr_t>;
+  { E::get_error(m) } -> std::same_as<const char *>;
+  { E::compute_mask(m, buf, n) } -> std::same_as<int32_t>;
+  { E::consume_tokens(m, toks, n) } -> std::same_as<int32_t>;
+  { E::is_accepting(m) } -> std::same_as<bool>;
+  { E::is_stopped(m) } -> std::same_as<bool>;
+  E::free_matcher(m);
+};
+
+/// Matcher bound at compile time to Engine; same interface as
+/// cbison::Matcher.
+template <EngineTraits Engine> class Matcher {
+  cbison_factory_t api_;
+  cbison_matcher_t m_;
+
+public:
+  /// Wrap existing matcher pointer (takes ownership of the matcher).
+  Matcher(cbison_factory_t api, cbison_matcher_t m) noexcept
+      : api_(api), m_(m) {}
+
+  ~Matcher() noexcept {
+    if (m_)
+      Engine::free_matcher(m_);
+  }
+
+  Matcher(const Matcher &) = delete;
+  Matcher &operator=(const Matcher &) = delete;
+
+  Matcher(Matcher &&o) noexcept : api_(o.api_), m_(o.m_) { o.m_ = nullptr; }
+  Matcher &operator=(Matcher &&o) noexcept {
+    if (m_)
+      Engine::free_matcher(m_);
+    api_ = o.api_;
+    m_ = o.m_;
+    o.m_ = nullptr;
+    return *this;
+  }
+
+  cbison_matcher_t get() const noexcept { return m_; }
+  cbison_factory_t api() const noexcept { return api_; }
+
+  Matcher clone() const noexcept {
+    if constexpr (requires { Engine::clone_matcher(m_); })
+      return Matcher(api_, Engine::clone_matcher(m_));
+    else
+      return Matcher(api_, nullptr);
+  }
+
+  Matcher fork() const noexcept {
+    if constexpr (requires { Engine::fork_matcher(m_); })
+      return Matcher(api_, Engine::fork_matcher(m_));
+    else
+      return clone();
+  }
+
+  int computeMask(uint32_t *dest) const noexcept {
+    return Engine::compute_mask(m_, dest, api_->mask_byte_len);
+  }
+
+  std::vector<uint32_t> computeMask() const noexcept {
+    std::vector<uint32_t> mask(api_->mask_byte_len / 4);
+    computeMask(mask.data());
+    return mask;
+  }
+
+  std::vector<uint32_t> computeFFTokens(size_t max_tokens = 100) const noexcept {
+    if constexpr (requires(uint32_t *b) {
+                    Engine::compute_ff_tokens(m_, b, max_tokens);
+                  }) {
+      std::vector<uint32_t> buf(max_tokens);
+      int32_t n = Engine::compute_ff_tokens(m_, buf.data(), max_tokens);
+      if (n < 0)
+        return {};
+      buf.resize(static_cast<size_t>(n));
+      return buf;
+    } else {
+      return {};
+    }
+  }
+
+  std::optional<std::string> getError() const noexcept {
+    auto e = Engine::get_error(m_);
+    if (!e)
+      return std::nullopt;
+    return std::string(e);
+  }
+
+  bool isAccepting() const noexcept { return Engine::is_accepting(m_); }
+  bool isStopped() const noexcept { return Engine::is_stopped(m_); }
+
+  int validateTokens(const uint32_t *tokens, size_t n) const noexcept {
+    if constexpr (requires { Engine::validate_tokens(m_, tokens, n); })
+      return Engine::validate_tokens(m_, tokens, n);
+    else
+      return -1;
+  }
+  int validateTokens(const std::vector<uint32_t> &tokens) const noexcept {
+    return validateTokens(tokens.data(), tokens.size());
+  }
+
+  int consumeTokens(const uint32_t *tokens, size_t n) const noexcept {
+    return Engine::consume_tokens(m_, tokens, n);
+  }
+  int consumeTokens(const std::vector<uint32_t> &tokens) const noexcept {
+    return consumeTokens(tokens.data(), tokens.size());
+  }
+
+  int reset() const noexcept {
+    if constexpr (requires { Engine::reset(m_); })
+      return Engine::reset(m_);
+    else
+      return -1;
+  }
+
+  int rollback(size_t n) const noexcept {
+    if constexpr (requires { Engine::rollback(m_, n); })
+      return Engine::rollback(m_, n);
+    else
+      return -1;
+  }
+};
+
+/// Factory bound at compile time to Engine; same interface as
+/// cbison::Factory.
+template <EngineTraits Engine> class Factory {
+  cbison_factory_t f_;
+
+public:
+  /// Wrap existing factory (increments its reference count).
+  explicit Factory(cbison_factory_t f) noexcept : f_(f) {
+    if (f_)
+      f_->incr_ref_count(f_);
+  }
+
+  ~Factory() noexcept {
+    if (f_)
+      f_->decr_ref_count(f_);
+  }
+
+  Factory(const Factory &) = delete;
+  Factory &operator=(const Factory &) = delete;
+
+  cbison_factory_t get() const noexcept { return f_; }
+  size_t nVocab() const noexcept { return f_->n_vocab; }
+  size_t maskByteLen() const noexcept { return f_->mask_byte_len; }
+
+  Matcher<Engine> newMatcher(const std::string &type,
+                             const std::string &grammar) const noexcept {
+    return Matcher<Engine>(
+        f_, Engine::new_matcher(f_, type.c_str(), grammar.c_str()));
+  }
+
+  std::pair<bool, std::string>
+  validateGrammar(const std::string &type,
+                  const std::string &grammar) const noexcept {
+    char buf[16 * 1024];
+    int32_t r = Engine::validate_grammar(f_, type.c_str(), grammar.c_str(),
+                                         buf, sizeof(buf));
+    if (r == 0)
+      return {true, ""};
+    return {r >= 0, std::string(buf)};
+  }
+
+  int computeMasks(const std::vector<std::pair<Matcher<Engine> *, uint32_t *>>
+                       &reqs) const noexcept {
+    size_t n = reqs.size();
+    std::vector<cbison_mask_req_t> c(n);
+    for (size_t i = 0; i < n; ++i) {
+      c[i].matcher = reqs[i].first->get();
+      c[i].mask_dest = reqs[i].second;
+    }
+    if constexpr (requires(cbison_mask_req_t *r) {
+                    Engine::compute_masks(f_, r, n);
+                  })
+      return Engine::compute_masks(f_, c.data(), n);
+    else
+      return -1;
+  }
+};
+
+} // namespace static_binding
+} // namespace cbison
+
+/// Declare the required entry points of a statically linked engine,
+/// exported as <prefix>_cbison_<entry>, and a traits type `name` forwarding
+/// to them. Optional entries can be added in a derived struct.
+#define CBISON_DECLARE_STATIC_ENGINE(name, prefix)                             \
+  extern "C" {                                                                 \
+  int32_t prefix##_cbison_validate_grammar(cbison_factory_t, const char *,     \
+                                           const char *, char *, size_t);     \
+  cbison_matcher_ptr_t prefix##_cbison_new_matcher(cbison_factory_t,           \
+                                                   const char *,               \
+                                                   const char *);              \
+  const char *prefix##_cbison_get_error(cbison_matcher_t);                     \
+  int32_t prefix##_cbison_compute_mask(cbison_matcher_t, uint32_t *, size_t);  \
+  int32_t prefix##_cbison_consume_tokens(cbison_matcher_t, const uint32_t *,   \
+                                         size_t);                              \
+  bool prefix##_cbison_is_accepting(cbison_matcher_t);                         \
+  bool prefix##_cbison_is_stopped(cbison_matcher_t);                           \
+  void prefix##_cbison_free_matcher(cbison_matcher_t);                         \
+  }                                                                            \
+  struct name {                                                                \
+    static int32_t validate_grammar(cbison_factory_t f, const char *t,         \
+                                    const char *g, char *msg, size_t len) {    \
+      return prefix##_cbison_validate_grammar(f, t, g, msg, len);              \
+    }                                                                          \
+    static cbison_matcher_ptr_t new_matcher(cbison_factory_t f, const char *t, \
+                                            const char *g) {                   \
+      return prefix##_cbison_new_matcher(f, t, g);                             \
+    }                                                                          \
+    static const char *get_error(cbison_matcher_t m) {                         \
+      return prefix##_cbison_get_error(m);                                     \
+    }                                                                          \
+    static int32_t compute_mask(cbison_matcher_t m, uint32_t *d, size_t n) {   \
+      return prefix##_cbison_compute_mask(m, d, n);                            \
+    }                                                                          \
+    static int32_t consume_tokens(cbison_matcher_t m, const uint32_t *t,       \
+                                  size_t n) {                                  \
+      return prefix##_cbison_consume_tokens(m, t, n);                          \
+    }                                                                          \
+    static bool is_accepting(cbison_matcher_t m) {                             \
+      return prefix##_cbison_is_accepting(m);                                  \
+    }                                                                          \
+    static bool is_stopped(cbison_matcher_t m) {                               \
+      return prefix##_cbison_is_stopped(m);                                    \
+    }                                                                          \
+    static void free_matcher(cbison_matcher_t m) {                             \
+      prefix##_cbison_free_matcher(m);                                         \
+    }                                                                          \
+  }
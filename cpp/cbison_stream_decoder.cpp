@@ -0,0 +1,198 @@
+#include "cbison.hpp"
+
+namespace cbison {
+
+// U+FFFD, written in place of invalid or truncated UTF-8
+static const char REPLACEMENT[] = "\xEF\xBF\xBD";
+
+StreamDecoder::StreamDecoder(const Tokenizer &tok,
+                             SpecialTokenPolicy special) noexcept
+    : policy_(special) {
+  cbison_tokenizer_t t = tok.get();
+  size_t n = tok.vocabSize();
+  offsets_.resize(n + 1);
+  special_.resize(n);
+  bytes_.reserve(n * 8);
+
+  std::vector<uint8_t> buf(256);
+  for (size_t i = 0; i < n; ++i) {
+    uint32_t id = static_cast<uint32_t>(i);
+    offsets_[i] = static_cast<uint32_t>(bytes_.size());
+    int len = t->get_token(t, id, buf.data(), buf.size());
+    if (len > 0 && static_cast<size_t>(len) > buf.size()) {
+      buf.resize(len);
+      len = t->get_token(t, id, buf.data(), buf.size());
+    }
+    if (len > 0)
+      bytes_.append(reinterpret_cast<const char *>(buf.data()), len);
+    special_[i] = tok.isSpecialToken(id);
+  }
+  offsets_[n] = static_cast<uint32_t>(bytes_.size());
+}
+
+std::string_view StreamDecoder::tokenBytes(uint32_t token_id) const noexcept {
+  if (token_id >= special_.size())
+    return {};
+  return std::string_view(bytes_.data() + offsets_[token_id],
+                          offsets_[token_id + 1] - offsets_[token_id]);
+}
+
+StreamDecoder::SeqState &StreamDecoder::state(size_t seq) {
+  if (seq >= seqs_.size())
+    seqs_.resize(seq + 1);
+  return seqs_[seq];
+}
+
+void StreamDecoder::appendUtf8(SeqState &st, const uint8_t *p, size_t n,
+                               std::string &out) noexcept {
+  size_t i = 0;
+  while (i < n) {
+    if (st.need == 0) {
+      // copy a run of ASCII at once
+      size_t j = i;
+      while (j < n && p[j] < 0x80)
+        ++j;
+      out.append(reinterpret_cast<const char *>(p + i), j - i);
+      i = j;
+      if (i == n)
+        break;
+      uint8_t b = p[i++];
+      uint8_t need = b >= 0xC2 && b <= 0xDF   ? 1
+                     : b >= 0xE0 && b <= 0xEF ? 2
+                     : b >= 0xF0 && b <= 0xF4 ? 3
+                                              : 0;
+      if (!need) {
+        out.append(REPLACEMENT);
+        continue;
+      }
+      st.pending[0] = b;
+      st.n_pending = 1;
+      st.need = need;
+      continue;
+    }
+
+    // the second byte is restricted to rule out overlong forms,
+    // surrogates and code points past U+10FFFF
+    uint8_t lo = 0x80, hi = 0xBF;
+    if (st.n_pending == 1) {
+      switch (st.pending[0]) {
+      case 0xE0:
+        lo = 0xA0;
+        break;
+      case 0xED:
+        hi = 0x9F;
+        break;
+      case 0xF0:
+        lo = 0x90;
+        break;
+      case 0xF4:
+        hi = 0x8F;
+        break;
+      }
+    }
+    uint8_t b = p[i];
+    if (b < lo || b > hi) {
+      // truncated character; b is looked at again as a lead byte
+      out.append(REPLACEMENT);
+      st.n_pending = 0;
+      st.need = 0;
+      continue;
+    }
+    st.pending[st.n_pending++] = b;
+    ++i;
+    if (--st.need == 0) {
+      out.append(reinterpret_cast<const char *>(st.pending), st.n_pending);
+      st.n_pending = 0;
+    }
+  }
+}
+
+void StreamDecoder::flushState(SeqState &st, std::string &out) noexcept {
+  if (st.n_pending)
+    out.append(REPLACEMENT);
+  st.n_pending = 0;
+  st.need = 0;
+}
+
+int StreamDecoder::append(SeqState &st, const uint32_t *tokens, size_t n,
+                          std::string &out) noexcept {
+  int rc = 0;
+  for (size_t i = 0; i < n; ++i) {
+    uint32_t t = tokens[i];
+    if (t >= special_.size()) {
+      rc = -1;
+      continue;
+    }
+    auto p = reinterpret_cast<const uint8_t *>(bytes_.data()) + offsets_[t];
+    size_t len = offsets_[t + 1] - offsets_[t];
+    if (special_[t]) {
+      if (policy_ == SpecialTokenPolicy::Skip)
+        continue;
+      flushState(st, out);
+      if (len > 0 && p[0] == 0xFF) {
+        ++p;
+        --len;
+      }
+      appendUtf8(st, p, len, out);
+      flushState(st, out);
+      continue;
+    }
+    appendUtf8(st, p, len, out);
+  }
+  return rc;
+}
+
+int StreamDecoder::decode(size_t seq, const std::vector<uint32_t> &tokens,
+                          std::string &out) noexcept {
+  return append(state(seq), tokens.data(), tokens.size(), out);
+}
+
+int StreamDecoder::decodeBatch(const std::vector<Req> &reqs, std::string &out,
+                               std::vector<size_t> &offsets) noexcept {
+  out.clear();
+  offsets.clear();
+  offsets.reserve(reqs.size() + 1);
+  offsets.push_back(0);
+  int rc = 0;
+  for (auto &r : reqs) {
+    if (append(state(r.seq), r.tokens, r.n_tokens, out) != 0)
+      rc = -1;
+    offsets.push_back(out.size());
+  }
+  return rc;
+}
+
+int StreamDecoder::decodeStep(const std::vector<uint32_t> &tokens,
+                              std::string &out,
+                              std::vector<size_t> &offsets) noexcept {
+  out.clear();
+  offsets.clear();
+  offsets.reserve(tokens.size() + 1);
+  offsets.push_back(0);
+  if (seqs_.size() < tokens.size())
+    seqs_.resize(tokens.size());
+  int rc = 0;
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    if (tokens[i] != CBISON_NO_TOKEN &&
+        append(seqs_[i], &tokens[i], 1, out) != 0)
+      rc = -1;
+    offsets.push_back(out.size());
+  }
+  return rc;
+}
+
+void StreamDecoder::flush(size_t seq, std::string &out) noexcept {
+  if (seq < seqs_.size())
+    flushState(seqs_[seq], out);
+}
+
+void StreamDecoder::reset(size_t seq) noexcept {
+  if (seq < seqs_.size())
+    seqs_[seq] = SeqState();
+}
+
+size_t StreamDecoder::pendingBytes(size_t seq) const noexcept {
+  return seq < seqs_.size() ? seqs_[seq].n_pending : 0;
+}
+
+} // namespace cbison
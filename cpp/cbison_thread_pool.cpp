@@ -0,0 +1,106 @@
+#include "cbison.hpp"
+#include <algorithm>
+
+namespace cbison {
+
+ThreadPool::ThreadPool(size_t n_threads) {
+  if (n_threads == 0)
+    n_threads = std::max(1u, std::thread::hardware_concurrency());
+  workers_.reserve(n_threads);
+  for (size_t i = 0; i < n_threads; ++i)
+    workers_.emplace_back([this] { workerLoop(); });
+}
+
+ThreadPool::~ThreadPool() noexcept {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  for (auto &w : workers_)
+    w.join();
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    queue_.push_back(std::move(task));
+  }
+  cv_.notify_one();
+}
+
+void ThreadPool::workerLoop() {
+  for (;;) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mu_);
+      cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+      if (queue_.empty())
+        return;
+      task = std::move(queue_.front());
+      queue_.pop_front();
+    }
+    task();
+  }
+}
+
+namespace {
+// Shared between the caller of parallelFor() and the helper tasks; helpers
+// that get scheduled after all work is done only touch this, never fn.
+struct ParallelForState {
+  std::atomic<size_t> next{0};
+  size_t n = 0;
+  const std::function<void(size_t)> *fn = nullptr;
+  std::mutex mu;
+  std::condition_variable cv;
+  size_t running = 0;
+
+  void run() {
+    for (;;) {
+      size_t i = next.fetch_add(1, std::memory_order_relaxed);
+      if (i >= n)
+        break;
+      (*fn)(i);
+    }
+  }
+};
+} // namespace
+
+void ThreadPool::parallelFor(size_t n,
+                             const std::function<void(size_t)> &fn) noexcept {
+  if (n == 0)
+    return;
+  if (n == 1 || workers_.empty()) {
+    for (size_t i = 0; i < n; ++i)
+      fn(i);
+    return;
+  }
+
+  auto st = std::make_shared<ParallelForState>();
+  st->n = n;
+  st->fn = &fn;
+
+  size_t n_helpers = std::min(n - 1, workers_.size());
+  for (size_t h = 0; h < n_helpers; ++h) {
+    submit([st] {
+      {
+        std::lock_guard<std::mutex> lock(st->mu);
+        // all indices already taken; fn may no longer be alive
+        if (st->next.load(std::memory_order_relaxed) >= st->n)
+          return;
+        st->running++;
+      }
+      st->run();
+      std::lock_guard<std::mutex> lock(st->mu);
+      if (--st->running == 0)
+        st->cv.notify_all();
+    });
+  }
+
+  st->run();
+
+  std::unique_lock<std::mutex> lock(st->mu);
+  st->cv.wait(lock, [&] { return st->running == 0; });
+}
+
+} // namespace cbison
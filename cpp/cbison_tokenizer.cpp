@@ -54,6 +54,53 @@ void CppTokenizer::decr_ref_trampoline(cbison_tokenizer_t api) {
     delete self;
 }
 
+size_t CppTokenizer::tokenize_bytes_batch_trampoline(
+    cbison_tokenizer_t api, const char *bytes, const size_t *input_offsets,
+    size_t n_inputs, uint32_t *output_tokens, size_t output_tokens_len,
+    size_t *output_offsets) {
+  std::vector<std::string_view> inputs(n_inputs);
+  for (size_t i = 0; i < n_inputs; ++i)
+    inputs[i] = std::string_view(bytes + input_offsets[i],
+                                 input_offsets[i + 1] - input_offsets[i]);
+  auto toks = fromC(api)->tokenizeBytesBatch(inputs);
+
+  size_t total = 0;
+  output_offsets[0] = 0;
+  for (size_t i = 0; i < n_inputs; ++i) {
+    total += toks[i].size();
+    output_offsets[i + 1] = total;
+  }
+  if (output_tokens && total <= output_tokens_len)
+    for (size_t i = 0; i < n_inputs; ++i)
+      if (!toks[i].empty())
+        std::memcpy(output_tokens + output_offsets[i], toks[i].data(),
+                    toks[i].size() * sizeof(uint32_t));
+  return total;
+}
+
+std::vector<std::vector<uint32_t>> CppTokenizer::tokenizeBytesBatch(
+    const std::vector<std::string_view> &inputs) const {
+  std::vector<std::vector<uint32_t>> r(inputs.size());
+  size_t total_bytes = 0;
+  for (auto &s : inputs)
+    total_bytes += s.size();
+
+  // not worth waking up threads for a handful of short strings
+  if (inputs.size() < 4 || total_bytes < 4096) {
+    for (size_t i = 0; i < inputs.size(); ++i)
+      r[i] = tokenizeBytes(std::string(inputs[i]));
+    return r;
+  }
+
+  static ThreadPool pool;
+  size_t n_chunks = std::min(inputs.size(), 4 * (pool.size() + 1));
+  pool.parallelFor(n_chunks, [&](size_t c) {
+    for (size_t i = c; i < inputs.size(); i += n_chunks)
+      r[i] = tokenizeBytes(std::string(inputs[i]));
+  });
+  return r;
+}
+
 CppTokenizer::CppTokenizer(size_t vocab, uint32_t eos, bool utf8_required)
     : n_vocab(vocab), eos_token_id(eos),
       tokenize_bytes_requires_utf8(utf8_required) {
@@ -71,6 +118,7 @@ CppTokenizer::CppTokenizer(size_t vocab, uint32_t eos, bool utf8_required)
   api_struct_.tokenize_bytes = tokenize_bytes_trampoline;
   api_struct_.incr_ref_count = incr_ref_trampoline;
   api_struct_.decr_ref_count = decr_ref_trampoline;
+  api_struct_.tokenize_bytes_batch = tokenize_bytes_batch_trampoline;
 }
 
 CppTokenizer::~CppTokenizer() = default;
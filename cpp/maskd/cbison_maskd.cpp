@@ -0,0 +1,129 @@
+// cbison_maskd: hosts one CBISON factory per tokenizer and serves mask
+// computation to local processes over a Unix domain socket; see
+// cbison_maskd.hpp for the protocol.
+//
+// Usage: cbison_maskd [options] <engine library> <prefix> <socket path>
+//                     <name>=<tokenizer.json|byte> ...
+// Options:
+//   --factory-options JSON  passed to new_factory() (default: {})
+//   --slots N               masks in each client's ring (default: 256)
+//   --workers N             worker threads (default: hardware concurrency)
+//   --quantum N             masks per scheduling quantum (default: 16)
+//   --max-queue N           requests queued before the daemon stops reading
+//                           sockets (default: 4 * workers)
+//
+// Scheduling: each connection has at most one request in flight. Requests
+// go to a FIFO run queue served by the workers; a compute_masks request is
+// processed quantum masks at a time, after which the connection goes to the
+// back of the queue, so that large batches of one client do not starve
+// others. When the queue is full, new requests are left in the socket
+// buffers, which blocks the clients (back-pressure). Sockets are
+// non-blocking, with requests and responses buffered per connection, so the
+// thread polling them never waits on a slow client.
+
+#include "cbison.hpp"
+#include "maskd_server.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace cbison::maskd;
+
+namespace {
+
+std::string read_file(const std::string &path, bool &ok) {
+  std::ifstream f(path, std::ios::binary);
+  std::stringstream ss;
+  ss << f.rdbuf();
+  ok = bool(f);
+  return ss.str();
+}
+
+int usage(const char *argv0) {
+  std::cerr << "Usage: " << argv0
+            << " [--factory-options JSON] [--slots N] [--workers N]"
+               " [--quantum N] [--max-queue N]\n"
+               "       <engine library> <prefix> <socket path>"
+               " <name>=<tokenizer.json|byte> ...\n";
+  return 1;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  std::string factory_options = "{}";
+  ServerOptions opts;
+  std::vector<std::string> args;
+  for (int i = 1; i < argc; ++i) {
+    std::string a = argv[i];
+    if (a.rfind("--", 0) == 0) {
+      if (i + 1 >= argc)
+        return usage(argv[0]);
+      std::string v = argv[++i];
+      if (a == "--factory-options")
+        factory_options = v;
+      else if (a == "--slots")
+        opts.slots = std::stoul(v);
+      else if (a == "--workers")
+        opts.workers = std::stoul(v);
+      else if (a == "--quantum")
+        opts.quantum = std::stoul(v);
+      else if (a == "--max-queue")
+        opts.max_queue = std::stoul(v);
+      else
+        return usage(argv[0]);
+    } else {
+      args.push_back(a);
+    }
+  }
+  if (args.size() < 4 || !opts.slots || !opts.workers || !opts.quantum)
+    return usage(argv[0]);
+
+  cbison::CbisonEngineDll engine;
+  if (!engine.load(args[0], args[1])) {
+    std::cerr << "Failed to load engine library: " << args[0] << '\n';
+    return 1;
+  }
+
+  std::vector<std::unique_ptr<Engine>> engines;
+  for (size_t i = 3; i < args.size(); ++i) {
+    auto eq = args[i].find('=');
+    if (eq == std::string::npos)
+      return usage(argv[0]);
+    std::string name = args[i].substr(0, eq);
+    std::string src = args[i].substr(eq + 1);
+    std::string err;
+    cbison_tokenizer_t tok;
+    if (src == "byte") {
+      tok = engine.new_byte_tokenizer();
+    } else {
+      bool ok;
+      std::string json = read_file(src, ok);
+      if (!ok) {
+        std::cerr << "Failed to read " << src << '\n';
+        return 1;
+      }
+      tok = engine.new_hf_tokenizer(json, "{}", err);
+    }
+    if (!tok) {
+      std::cerr << "Failed to create tokenizer " << name << ": " << err << '\n';
+      return 1;
+    }
+    cbison_factory_t f = engine.new_factory(tok, factory_options, err);
+    tok->decr_ref_count(tok);
+    if (!f) {
+      std::cerr << "Failed to create factory " << name << ": " << err << '\n';
+      return 1;
+    }
+    std::cerr << "Tokenizer " << name << ": n_vocab=" << f->n_vocab << '\n';
+    engines.push_back(
+        std::make_unique<Engine>(Engine{name, f, engine_features(f)}));
+  }
+
+  Server server(opts, std::move(engines));
+  if (!server.listen(args[2]))
+    return 1;
+  std::cerr << "Listening on " << args[2] << '\n';
+  server.run();
+}
@@ -0,0 +1,583 @@
+#include "maskd_server.hpp"
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+namespace cbison::maskd {
+
+struct Client {
+  int fd;
+  Engine *engine = nullptr;
+  uint8_t *ring = nullptr;
+  size_t ring_bytes = 0;
+  size_t next_slot = 0;
+  uint64_t next_id = 1;
+  std::unordered_map<uint64_t, cbison_matcher_t> matchers;
+
+  // set by the main thread when a request is queued, cleared by the worker
+  // once the response is in out; the connection is not polled while busy
+  std::atomic<bool> busy{false};
+  // request being read: got bytes of req, then of payload
+  ReqHeader req = {};
+  std::vector<uint8_t> payload;
+  size_t got = 0;
+  // response being written; out_fd goes with the byte at out_fd_at
+  std::string out;
+  size_t out_off = 0;
+  int out_fd = -1;
+  size_t out_fd_at = 0;
+  bool close_after_out = false;
+  // compute_masks progress
+  size_t done = 0;
+  size_t first_slot = 0;
+  int32_t status = 0;
+
+  explicit Client(int fd) : fd(fd) {}
+
+  ~Client() {
+    if (engine)
+      for (auto &[id, m] : matchers)
+        engine->factory->free_matcher(m);
+    if (ring)
+      munmap(ring, ring_bytes);
+    if (out_fd >= 0)
+      close(out_fd);
+    close(fd);
+  }
+
+  cbison_matcher_t find(uint64_t id) const {
+    auto it = matchers.find(id);
+    return it == matchers.end() ? nullptr : it->second;
+  }
+
+  void respond(RespHeader resp, const std::string &body) {
+    resp.len = uint32_t(body.size());
+    out.assign(reinterpret_cast<const char *>(&resp), sizeof(resp));
+    out += body;
+    out_off = 0;
+  }
+
+  // Reads what is available of the current request.
+  // @return 1 when it is complete, 0 if more is to come, -1 on hang-up or
+  // error.
+  int readSome() {
+    for (;;) {
+      uint8_t *dst;
+      size_t want;
+      if (got < sizeof(req)) {
+        dst = reinterpret_cast<uint8_t *>(&req) + got;
+        want = sizeof(req) - got;
+      } else {
+        dst = payload.data() + (got - sizeof(req));
+        want = sizeof(req) + req.len - got;
+      }
+      ssize_t n = recv(fd, dst, want, 0);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+      if (n <= 0)
+        return -1;
+      got += size_t(n);
+      if (got == sizeof(req)) {
+        if (req.len > MAX_PAYLOAD)
+          return -1;
+        payload.resize(req.len);
+      }
+      if (got >= sizeof(req) && got == sizeof(req) + req.len) {
+        got = 0;
+        return 1;
+      }
+    }
+  }
+
+  // Writes what the socket takes of the pending response.
+  // @return 1 when it is all written, 0 if more is to go, -1 on error.
+  int writeSome() {
+    while (out_off < out.size()) {
+      const char *p = out.data() + out_off;
+      size_t len = out.size() - out_off;
+      bool with_fd = out_fd >= 0 && out_off == out_fd_at;
+      if (out_fd >= 0 && out_off < out_fd_at)
+        len = out_fd_at - out_off;
+      ssize_t n = with_fd ? sendWithFd(p, len) : send(fd, p, len, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+      if (n <= 0)
+        return -1;
+      if (with_fd) {
+        close(out_fd);
+        out_fd = -1;
+      }
+      out_off += size_t(n);
+    }
+    out.clear();
+    out_off = 0;
+    return 1;
+  }
+
+  ssize_t sendWithFd(const char *p, size_t len) {
+    struct iovec iov = {const_cast<char *>(p), len};
+    alignas(struct cmsghdr) char ctrl[CMSG_SPACE(sizeof(int))] = {};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(c), &out_fd, sizeof(int));
+    return sendmsg(fd, &msg, MSG_NOSIGNAL);
+  }
+};
+
+uint32_t engine_features(cbison_factory_t f) {
+  uint32_t features = 0;
+  if (f->compute_ff_tokens)
+    features |= FEAT_FF_TOKENS;
+  if (f->rollback)
+    features |= FEAT_ROLLBACK;
+  if (f->reset)
+    features |= FEAT_RESET;
+  if (f->clone_matcher)
+    features |= FEAT_CLONE;
+  if (f->version_minor >= 3 && f->matcher_memory_usage &&
+      f->factory_memory_usage)
+    features |= FEAT_MEMORY;
+  return features;
+}
+
+Server::Server(ServerOptions opts, std::vector<std::unique_ptr<Engine>> engines)
+    : opts_(std::move(opts)), engines_(std::move(engines)) {
+  if (!opts_.max_queue)
+    opts_.max_queue = 4 * opts_.workers;
+}
+
+Server::~Server() {
+  stop();
+  for (auto &t : workers_)
+    t.join();
+  clients_.clear();
+  for (int fd : {listen_fd_, wake_[0], wake_[1]})
+    if (fd >= 0)
+      close(fd);
+}
+
+void Server::wake() {
+  char b = 0;
+  [[maybe_unused]] auto r = write(wake_[1], &b, 1);
+}
+
+void Server::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+    cv_.notify_all();
+  }
+  if (wake_[1] >= 0)
+    wake();
+}
+
+bool Server::listen(const std::string &path) {
+  struct sockaddr_un addr = {};
+  if (path.size() >= sizeof(addr.sun_path)) {
+    std::cerr << "Socket path too long: " << path << '\n';
+    return false;
+  }
+  addr.sun_family = AF_UNIX;
+  std::memcpy(addr.sun_path, path.c_str(), path.size());
+  unlink(path.c_str());
+  listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd_ < 0 ||
+      bind(listen_fd_, reinterpret_cast<struct sockaddr *>(&addr),
+           sizeof(addr)) != 0 ||
+      ::listen(listen_fd_, 64) != 0 || pipe(wake_) != 0) {
+    std::cerr << "Failed to listen on " << path << ": " << std::strerror(errno)
+              << '\n';
+    return false;
+  }
+  fcntl(wake_[0], F_SETFL, O_NONBLOCK);
+  fcntl(listen_fd_, F_SETFL, O_NONBLOCK);
+  return true;
+}
+
+void Server::accept_client() {
+  int fd = accept(listen_fd_, nullptr, nullptr);
+  if (fd < 0)
+    return;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  clients_.push_back(std::make_unique<Client>(fd));
+}
+
+// Creates a shared-memory object with no name left behind.
+static int create_ring(size_t bytes) {
+  static std::atomic<unsigned> counter{0};
+  std::string name = "/cbmaskd." + std::to_string(getpid()) + "." +
+                     std::to_string(counter.fetch_add(1));
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0)
+    return -1;
+  shm_unlink(name.c_str());
+  if (ftruncate(fd, off_t(bytes)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Handles OP_HELLO in the main thread; the response (and the ring
+// descriptor) is left in c.out.
+void Server::hello(Client &c) {
+  RespHeader resp = {};
+  HelloReq hreq;
+  auto fail = [&](const std::string &msg) {
+    resp.status = -1;
+    c.respond(resp, msg);
+    c.close_after_out = true;
+  };
+  if (c.engine || c.payload.size() < sizeof(hreq))
+    return fail("cbison_maskd: invalid hello");
+  std::memcpy(&hreq, c.payload.data(), sizeof(hreq));
+  std::string name(c.payload.begin() + sizeof(hreq), c.payload.end());
+
+  if (hreq.magic != PROTOCOL_MAGIC || hreq.version != PROTOCOL_VERSION)
+    return fail("cbison_maskd: protocol version mismatch");
+  for (auto &e : engines_)
+    if (e->name == name)
+      c.engine = e.get();
+  if (!c.engine)
+    return fail("cbison_maskd: unknown tokenizer: " + name);
+
+  cbison_factory_t f = c.engine->factory;
+  c.ring_bytes = opts_.slots * f->mask_byte_len;
+  int ring_fd = create_ring(c.ring_bytes);
+  void *ring = ring_fd < 0 ? MAP_FAILED
+                           : mmap(nullptr, c.ring_bytes, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED, ring_fd, 0);
+  if (ring == MAP_FAILED) {
+    if (ring_fd >= 0)
+      close(ring_fd);
+    c.engine = nullptr;
+    return fail("cbison_maskd: failed to allocate mask ring");
+  }
+  c.ring = static_cast<uint8_t *>(ring);
+
+  HelloResp info = {};
+  info.magic = PROTOCOL_MAGIC;
+  info.version = PROTOCOL_VERSION;
+  info.n_vocab = f->n_vocab;
+  info.mask_byte_len = f->mask_byte_len;
+  info.n_slots = opts_.slots;
+  info.eos_token_id = f->eos_token_id;
+  info.features = c.engine->features;
+  c.respond(resp, std::string(reinterpret_cast<const char *>(&info),
+                              sizeof(info)));
+  // the descriptor goes with the first byte of the HelloResp, which is
+  // where the client expects it
+  c.out_fd = ring_fd;
+  c.out_fd_at = sizeof(RespHeader);
+}
+
+static uint32_t matcher_flags(cbison_factory_t f, cbison_matcher_t m,
+                              std::string &out) {
+  uint32_t flags = 0;
+  if (f->is_accepting(m))
+    flags |= FLAG_ACCEPTING;
+  if (f->is_stopped(m))
+    flags |= FLAG_STOPPED;
+  if (const char *err = f->get_error(m)) {
+    flags |= FLAG_ERROR;
+    out = err;
+  }
+  return flags;
+}
+
+// Runs one quantum of the current request of c; returns true when the
+// request is complete and resp/out hold the response.
+bool Server::step(Client &c, RespHeader &resp, std::string &out) {
+  cbison_factory_t f = c.engine->factory;
+  const ReqHeader &req = c.req;
+  const uint8_t *p = c.payload.data();
+  size_t n_tokens = c.payload.size() / sizeof(uint32_t);
+  std::vector<uint32_t> tokens(n_tokens);
+  if (n_tokens)
+    std::memcpy(tokens.data(), p, n_tokens * sizeof(uint32_t));
+
+  if (req.op == OP_COMPUTE_MASKS) {
+    size_t n = c.payload.size() / sizeof(uint64_t);
+    if (c.done == 0) {
+      c.status = n <= opts_.slots ? 0 : -1;
+      c.first_slot = c.next_slot;
+      if (c.status == 0)
+        c.next_slot = (c.next_slot + n) % opts_.slots;
+      else
+        n = 0;
+    }
+    size_t end = std::min(n, c.done + opts_.quantum);
+    std::vector<cbison_mask_req_t> reqs;
+    for (size_t i = c.done; i < end; ++i) {
+      uint64_t id;
+      std::memcpy(&id, p + i * sizeof(id), sizeof(id));
+      auto dest = reinterpret_cast<uint32_t *>(
+          c.ring + (c.first_slot + i) % opts_.slots * f->mask_byte_len);
+      cbison_matcher_t m = c.find(id);
+      if (!m) {
+        std::memset(dest, 0, f->mask_byte_len);
+        c.status = -1;
+      } else if (!f->compute_masks) {
+        if (f->compute_mask(m, dest, f->mask_byte_len) != 0)
+          c.status = -1;
+      } else {
+        reqs.push_back({m, dest});
+      }
+    }
+    if (!reqs.empty() && f->compute_masks(f, reqs.data(), reqs.size()) != 0)
+      c.status = -1;
+    c.done = end;
+    if (c.done < n)
+      return false;
+    resp.status = c.status;
+    resp.value = c.first_slot;
+    return true;
+  }
+
+  if (req.op == OP_VALIDATE_GRAMMAR || req.op == OP_NEW_MATCHER) {
+    auto str = reinterpret_cast<const char *>(p);
+    std::string type(str, strnlen(str, c.payload.size()));
+    std::string grammar;
+    if (type.size() < c.payload.size())
+      grammar.assign(c.payload.begin() + type.size() + 1, c.payload.end());
+    if (req.op == OP_VALIDATE_GRAMMAR) {
+      char msg[1024] = {};
+      resp.status = f->validate_grammar(f, type.c_str(), grammar.c_str(), msg,
+                                        sizeof(msg));
+      out = msg;
+    } else {
+      cbison_matcher_t m = f->new_matcher(f, type.c_str(), grammar.c_str());
+      resp.value = c.next_id++;
+      c.matchers[resp.value] = m;
+      resp.flags = matcher_flags(f, m, out);
+    }
+    return true;
+  }
+
+  if (req.op == OP_FACTORY_MEMORY) {
+    resp.value = f->version_minor >= 3 && f->factory_memory_usage
+                     ? f->factory_memory_usage(f)
+                     : 0;
+    return true;
+  }
+
+  cbison_matcher_t m = c.find(req.matcher);
+  if (!m) {
+    resp.status = -1;
+    resp.flags = FLAG_STOPPED | FLAG_ERROR;
+    out = "cbison_maskd: unknown matcher";
+    return true;
+  }
+
+  switch (req.op) {
+  case OP_CLONE_MATCHER:
+    if (f->clone_matcher) {
+      // forks are cheaper and indistinguishable from clones
+      cbison_matcher_t m2 = f->version_minor >= 6 && f->fork_matcher
+                                ? f->fork_matcher(m)
+                                : f->clone_matcher(m);
+      resp.value = c.next_id++;
+      c.matchers[resp.value] = m2;
+      resp.flags = matcher_flags(f, m2, out);
+    } else {
+      resp.status = -1;
+    }
+    return true;
+  case OP_FREE_MATCHER:
+    f->free_matcher(m);
+    c.matchers.erase(req.matcher);
+    return true;
+  case OP_CONSUME_TOKENS:
+    resp.status = f->consume_tokens(m, tokens.data(), tokens.size());
+    break;
+  case OP_VALIDATE_TOKENS:
+    resp.status = f->validate_tokens(m, tokens.data(), tokens.size());
+    break;
+  case OP_COMPUTE_FF_TOKENS: {
+    if (!f->compute_ff_tokens) {
+      resp.status = -1;
+      break;
+    }
+    std::vector<uint32_t> ff(std::min<uint64_t>(req.arg, MAX_PAYLOAD / 4));
+    resp.status = f->compute_ff_tokens(m, ff.data(), ff.size());
+    if (resp.status > 0) {
+      uint32_t flags = matcher_flags(f, m, out);
+      resp.flags = flags & ~FLAG_ERROR;
+      out.assign(reinterpret_cast<const char *>(ff.data()),
+                 size_t(resp.status) * sizeof(uint32_t));
+      return true;
+    }
+    break;
+  }
+  case OP_ROLLBACK:
+    resp.status = f->rollback ? f->rollback(m, req.arg) : -1;
+    break;
+  case OP_RESET:
+    resp.status = f->reset ? f->reset(m) : -1;
+    break;
+  case OP_MATCHER_MEMORY:
+    resp.value = f->version_minor >= 3 && f->matcher_memory_usage
+                     ? f->matcher_memory_usage(m)
+                     : 0;
+    break;
+  default:
+    resp.status = -1;
+    out = "cbison_maskd: unknown request";
+    return true;
+  }
+  resp.flags = matcher_flags(f, m, out);
+  return true;
+}
+
+void Server::worker() {
+  for (;;) {
+    Client *c;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [&] { return stop_ || !run_queue_.empty(); });
+      if (stop_)
+        return;
+      c = run_queue_.front();
+      run_queue_.pop_front();
+    }
+
+    RespHeader resp = {};
+    std::string out;
+    if (!step(*c, resp, out)) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      run_queue_.push_back(c);
+      cv_.notify_one();
+      continue;
+    }
+    c->respond(resp, out);
+    c->busy.store(false);
+    wake();
+  }
+}
+
+void Server::run() {
+  signal(SIGPIPE, SIG_IGN);
+  for (size_t i = 0; i < opts_.workers; ++i)
+    workers_.emplace_back([this] { worker(); });
+
+  std::vector<struct pollfd> fds;
+  std::vector<Client *> polled;
+  std::vector<Client *> closed;
+  auto drop_closed = [&] {
+    if (!closed.empty())
+      std::erase_if(clients_, [&](auto &c) {
+        return std::find(closed.begin(), closed.end(), c.get()) !=
+               closed.end();
+      });
+    closed.clear();
+  };
+  // flushes c.out; false if c is to be closed
+  auto flush = [&](Client &c) {
+    int r = c.writeSome();
+    return r == 0 || (r == 1 && !c.close_after_out);
+  };
+
+  while (!stop_) {
+    size_t queued;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queued = run_queue_.size();
+    }
+    fds.clear();
+    polled.clear();
+    fds.push_back({listen_fd_, POLLIN, 0});
+    fds.push_back({wake_[0], POLLIN, 0});
+    for (auto &c : clients_) {
+      if (c->busy.load())
+        continue;
+      if (!c->out.empty() && !flush(*c)) {
+        closed.push_back(c.get());
+        continue;
+      }
+      // back-pressure: leave requests in the socket buffers; only look for
+      // hang-ups
+      short ev = !c->out.empty()               ? POLLOUT
+                 : queued < opts_.max_queue ? POLLIN
+                                            : 0;
+      fds.push_back({c->fd, ev, 0});
+      polled.push_back(c.get());
+    }
+    drop_closed();
+
+    if (poll(fds.data(), fds.size(), -1) < 0)
+      continue;
+    if (fds[1].revents) {
+      char buf[256];
+      while (read(wake_[0], buf, sizeof(buf)) > 0) {
+      }
+    }
+
+    for (size_t i = 0; i < polled.size(); ++i) {
+      Client *c = polled[i];
+      short ev = fds[i + 2].revents;
+      if (!ev)
+        continue;
+      if (ev & POLLOUT) {
+        if (!flush(*c))
+          closed.push_back(c);
+        continue;
+      }
+      int r = (ev & POLLIN) ? c->readSome() : -1;
+      if (r < 0) {
+        closed.push_back(c);
+        continue;
+      }
+      if (r == 0)
+        continue;
+      if (c->req.op == OP_HELLO) {
+        hello(*c);
+        continue;
+      }
+      if (!c->engine) {
+        closed.push_back(c);
+        continue;
+      }
+      c->done = 0;
+      c->busy.store(true);
+      std::lock_guard<std::mutex> lock(mutex_);
+      run_queue_.push_back(c);
+      cv_.notify_one();
+    }
+    drop_closed();
+
+    if (fds[0].revents & POLLIN)
+      accept_client();
+  }
+
+  stop();
+  for (auto &t : workers_)
+    t.join();
+  workers_.clear();
+}
+
+} // namespace cbison::maskd
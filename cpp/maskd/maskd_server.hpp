@@ -0,0 +1,78 @@
+#pragma once
+
+// Server side of cbison_maskd (see cbison_maskd.cpp for the daemon and
+// cbison_maskd.hpp for the protocol). POSIX only.
+
+#include "cbison_maskd.hpp"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace cbison::maskd {
+
+struct ServerOptions {
+  size_t slots = 256;
+  size_t workers = std::max(1u, std::thread::hardware_concurrency());
+  size_t quantum = 16;
+  size_t max_queue = 0; // 0 means 4 * workers
+};
+
+/// A factory served under a tokenizer name; not owned by the server.
+struct Engine {
+  std::string name;
+  cbison_factory_t factory;
+  uint32_t features;
+};
+
+/// FEAT_* flags for the optional entries of f.
+uint32_t engine_features(cbison_factory_t f);
+
+struct Client;
+
+/// Accepts connections on a Unix domain socket and serves requests from a
+/// thread pool. Sockets are non-blocking: requests and responses are
+/// buffered per connection, so a slow or stalled client does not hold up
+/// the others.
+class Server {
+public:
+  Server(ServerOptions opts, std::vector<std::unique_ptr<Engine>> engines);
+  ~Server();
+
+  Server(const Server &) = delete;
+  Server &operator=(const Server &) = delete;
+
+  bool listen(const std::string &path);
+
+  /// Serve until stop() is called.
+  void run();
+
+  /// Make run() return; callable from any thread.
+  void stop();
+
+private:
+  ServerOptions opts_;
+  std::vector<std::unique_ptr<Engine>> engines_;
+  int listen_fd_ = -1;
+  int wake_[2] = {-1, -1};
+  std::vector<std::unique_ptr<Client>> clients_;
+  std::atomic<bool> stop_{false};
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Client *> run_queue_;
+  std::vector<std::thread> workers_;
+
+  void accept_client();
+  void hello(Client &c);
+  bool step(Client &c, RespHeader &resp, std::string &out);
+  void worker();
+  void wake();
+};
+
+} // namespace cbison::maskd
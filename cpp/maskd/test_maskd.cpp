@@ -0,0 +1,119 @@
+// In-process round trip through cbison_maskd: a Server over the mock engine
+// on one side, the connect_factory() client on the other.
+
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "cbison.hpp"
+#include "maskd_server.hpp"
+#include "test_mock_engine.hpp"
+
+using namespace cbison::maskd;
+
+static bool allowed(const std::vector<uint32_t> &mask, uint32_t t) {
+  return (mask[t / 32] >> (t % 32)) & 1;
+}
+
+// Connects and sends the first bytes of a request header, leaving the rest
+// unsent; the server must keep serving other clients meanwhile.
+static int stalled_client(const std::string &path) {
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  std::memcpy(addr.sun_path, path.c_str(), path.size());
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  assert(fd >= 0);
+  int rc = connect(fd, reinterpret_cast<struct sockaddr *>(&addr),
+                   sizeof(addr));
+  assert(rc == 0);
+  ReqHeader req = {};
+  req.op = OP_HELLO;
+  req.len = 100;
+  assert(write(fd, &req, 3) == 3);
+  return fd;
+}
+
+static void test_round_trip(const std::string &path) {
+  int stalled = stalled_client(path);
+
+  std::string err;
+  cbison_factory_t api = connect_factory(path, "mock", err);
+  assert(api && err.empty());
+  cbison::Factory f(api);
+  api->decr_ref_count(api);
+  assert(f.nVocab() == 257 && api->eos_token_id == 256);
+
+  auto bad = connect_factory(path, "nope", err);
+  assert(!bad && !err.empty());
+
+  cbison::Matcher m = f.newMatcher("lit", "ab");
+  assert(!m.getError());
+  std::vector<uint32_t> mask(f.maskByteLen() / 4);
+  assert(m.computeMask(mask.data()) == 0);
+  assert(allowed(mask, 'a') && !allowed(mask, 'b'));
+
+  assert(m.consumeTokens({'a'}) == 0);
+  assert(m.computeMask(mask.data()) == 0);
+  assert(allowed(mask, 'b') && !allowed(mask, 'a'));
+  assert(m.validateTokens({'b', 256}) == 2);
+
+  assert(m.consumeTokens({'b', 256}) == 0);
+  assert(m.isStopped() && m.isAccepting());
+
+  // payloads over MAX_PAYLOAD are refused before anything is sent
+  cbison::Matcher m2 = f.newMatcher("lit", "ab");
+  uint32_t tok = 'a';
+  assert(api->consume_tokens(m2.get(), &tok, MAX_PAYLOAD / 4 + 1) < 0);
+  assert(m2.consumeTokens({'b'}) != 0);
+  assert(m2.getError() && m2.isStopped());
+
+  // more rows than ring slots, in several quanta
+  std::vector<cbison::Matcher> ms;
+  std::vector<std::vector<uint32_t>> masks(6, mask);
+  std::vector<cbison_mask_req_t> reqs;
+  for (size_t i = 0; i < masks.size(); ++i) {
+    ms.push_back(f.newMatcher("lit", std::string(1, char('a' + i))));
+    reqs.push_back({ms.back().get(), masks[i].data()});
+  }
+  assert(api->compute_masks(api, reqs.data(), reqs.size()) == 0);
+  for (size_t i = 0; i < masks.size(); ++i)
+    assert(allowed(masks[i], 'a' + i) && !allowed(masks[i], 'z'));
+
+  close(stalled);
+}
+
+int main() {
+  cbison_factory_t mock = mock_new_factory(257);
+  std::string path =
+      "/tmp/cbison_test_maskd." + std::to_string(getpid()) + ".sock";
+
+  {
+    ServerOptions opts;
+    opts.slots = 4;
+    opts.workers = 2;
+    opts.quantum = 2;
+    std::vector<std::unique_ptr<Engine>> engines;
+    engines.push_back(std::make_unique<Engine>(
+        Engine{"mock", mock, engine_features(mock)}));
+    Server server(opts, std::move(engines));
+    bool ok = server.listen(path);
+    assert(ok);
+    std::thread t([&] { server.run(); });
+
+    test_round_trip(path);
+
+    server.stop();
+    t.join();
+    unlink(path.c_str());
+  }
+  mock->decr_ref_count(mock);
+  std::cout << "maskd: ok\n";
+  return 0;
+}
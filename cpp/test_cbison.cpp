@@ -5,6 +5,570 @@
 #include <utility>
 #include "cbison.hpp"
 
+// test_static.cpp
+void test_static_binding();
+
+static void test_constrained_batch(const cbison::Factory &f,
+                                   const cbison::Tokenizer &t) {
+  cbison::ConstrainedBatch b(f, 2, 2);
+  int slot = b.admit(f.newMatcher("json", "{}"));
+  assert(slot == 0);
+  assert(b.numActive() == 1);
+
+  cbison::ConstrainedBatch::StepResult res;
+  int rc = b.step({}, res);
+  assert(rc == 0 && res.stopped.empty());
+
+  auto tokens = t.tokenizeString("{\"a\":12}");
+  // a slot sampled twice is rejected before anything is consumed
+  rc = b.step({{slot, tokens[0]}, {slot, tokens[0]}}, res);
+  assert(rc == -1 && b.numActive() == 1);
+  for (auto tok : tokens) {
+    const uint32_t *row = b.maskRow(slot);
+    assert(row[tok / 32] & (1u << (tok % 32)));
+    rc = b.step({{slot, tok}}, res);
+    assert(rc == 0);
+  }
+  assert(res.stopped.size() == 1 && res.stopped[0] == 0);
+  assert(res.errors.empty());
+  assert(b.numActive() == 0);
+
+  // preempt and re-admit
+  slot = b.admit(f.newMatcher("json", "{}"));
+  auto m = b.preempt(slot);
+  assert(m && b.numActive() == 0);
+  slot = b.admit(std::move(*m));
+  assert(slot >= 0 && b.isActive(slot));
+  assert(b.stats().steps == tokens.size() + 1);
+}
+
+static void test_step_batch(const cbison::Factory &f,
+                            const cbison::Tokenizer &t) {
+  size_t n = f.nVocab();
+  uint32_t x = t.tokenizeString("x")[0];
+  uint32_t y = t.tokenizeString("y")[0];
+  uint32_t z = t.tokenizeString("z")[0];
+  size_t padded = (n + 63) / 64 * 64;
+  for (uint32_t format : {CBISON_MASK_FORMAT_BITS, CBISON_MASK_FORMAT_BOOL}) {
+    size_t row_bytes = format == CBISON_MASK_FORMAT_BITS ? padded / 8 : padded;
+    size_t stride = row_bytes + 16;
+    std::vector<uint8_t> buf(3 * stride, 0xaa);
+    cbison_mask_layout_t layout = {buf.data(), stride, padded, format, 1};
+    auto allowed = [&](size_t row, size_t i) {
+      const uint8_t *r = buf.data() + row * stride;
+      if (format == CBISON_MASK_FORMAT_BOOL)
+        return r[i] == 1;
+      return bool((reinterpret_cast<const uint32_t *>(r)[i / 32] >> (i % 32)) &
+                  1);
+    };
+    auto check_row = [&](size_t row, const std::vector<uint32_t> &mask) {
+      for (size_t i = 0; i < padded; ++i)
+        assert(allowed(row, i) == (i >= n || ((mask[i / 32] >> (i % 32)) & 1)));
+      for (size_t i = row_bytes; i < stride; ++i)
+        assert(buf[row * stride + i] == 0xaa);
+    };
+
+    auto ff = f.newMatcher("regex", "abc(d|e)");
+    auto go = f.newMatcher("regex", "xy");
+    auto bad = f.newMatcher("regex", "xy");
+    auto ff_ref = f.newMatcher("regex", "abc(d|e)");
+    auto go_ref = f.newMatcher("regex", "xy");
+    std::vector<uint32_t> ff_tokens(16);
+    std::vector<cbison_step_req_t> reqs = {
+        {ff.get(), CBISON_NO_TOKEN, 0, 0, ff_tokens.data(), ff_tokens.size(),
+         0},
+        {go.get(), x, 0, 1, nullptr, 0, 0},
+        {bad.get(), z, 0, 2, nullptr, 0, 0},
+    };
+    cbison::ThreadPool pool(2);
+    assert(f.stepBatch(reqs, &layout, &pool) == 0);
+
+    // fast-forward tokens are consumed before the mask is computed
+    assert(reqs[0].flags == 0);
+    if (f.get()->compute_ff_tokens)
+      assert(reqs[0].n_ff_tokens > 0);
+    assert(ff_ref.consumeTokens(std::vector<uint32_t>(
+               ff_tokens.begin(), ff_tokens.begin() + reqs[0].n_ff_tokens)) ==
+           0);
+    check_row(0, ff_ref.computeMask());
+
+    assert(reqs[1].flags == 0 && reqs[1].n_ff_tokens == 0);
+    assert(go_ref.consumeTokens({x}) == 0);
+    check_row(1, go_ref.computeMask());
+
+    assert(reqs[2].flags & CBISON_STEP_ERROR);
+
+    // stopped matchers have their row left alone
+    std::fill(buf.begin() + stride, buf.begin() + 2 * stride, 0xaa);
+    reqs = {{go.get(), y, 0, 1, nullptr, 0, 0}};
+    assert(f.stepBatch(reqs, &layout) == 0);
+    assert(reqs[0].flags == (CBISON_STEP_STOPPED | CBISON_STEP_ACCEPTING));
+    for (size_t i = stride; i < 2 * stride; ++i)
+      assert(buf[i] == 0xaa);
+
+    // stride too small for the format
+    cbison_mask_layout_t bad_layout = layout;
+    bad_layout.row_stride = row_bytes - 4;
+    assert(f.stepBatch(reqs, &bad_layout) == -1);
+  }
+}
+
+static void test_fast_forward(const cbison::Factory &f,
+                              const cbison::Tokenizer &t) {
+  auto m = f.newMatcher("regex", "abc");
+  assert(!m.getError());
+  cbison::FastForward ffw(t);
+  ffw.setEmulate(true);
+  cbison::FastForwardResult res;
+  int rc = ffw.run(m, {}, res);
+  assert(rc == 0);
+  assert(res.emulated);
+  assert(res.tokens == t.tokenizeString("abc"));
+  assert(res.n_drop == 0 && res.kv_recompute_from == 0);
+  assert(m.isAccepting());
+}
+
+static void test_optimistic(const cbison::Factory &f,
+                            const cbison::Tokenizer &t) {
+  auto m = f.newMatcher("json", "{}");
+  cbison::OptimisticDecoder dec;
+  std::vector<uint32_t> mask(f.maskByteLen() / 4);
+  uint32_t bad = t.tokenizeString("x")[0];
+  uint32_t good = t.tokenizeString("{")[0];
+  uint32_t tok = 0;
+  int rc = dec.select(m, "json", {bad, good}, tok, mask.data());
+  assert(rc == 1 && tok == good);
+  rc = dec.select(m, "json", {bad}, tok, mask.data());
+  assert(rc == 0);
+  assert(mask == m.computeMask());
+  auto st = dec.stats("json");
+  assert(st.steps == 2 && st.fallbacks == 1);
+
+  // rejected candidates switch to always-mask; once probes succeed again,
+  // the recent fallback rate drops and optimistic mode comes back, despite
+  // the many fallbacks before
+  cbison::OptimisticDecoder::Options opts;
+  opts.min_steps = 4;
+  opts.probe_interval = 2;
+  cbison::OptimisticDecoder sw(opts);
+  for (int i = 0; i < 200; ++i)
+    assert(sw.select(m, "json", {bad}, tok, mask.data()) == 0);
+  assert(sw.stats("json").always_mask);
+  for (int i = 0; i < 2000 && sw.stats("json").always_mask; ++i)
+    assert(sw.select(m, "json", {good}, tok, mask.data()) >= 0);
+  st = sw.stats("json");
+  assert(!st.always_mask && st.fallbackRate() > 0.5);
+}
+
+static void test_snapshot(const cbison::Factory &f,
+                          const cbison::Tokenizer &t) {
+  auto prefix = t.tokenizeString("{\"a\":1");
+  auto m = f.newMatcher("json", "{}");
+  m.consumeTokens(prefix);
+  auto expected = m.computeMask();
+
+  // natively serialized, or replayed from prefix
+  auto snap = m.snapshot(prefix);
+  assert(!snap.data.empty() || snap.tokens == prefix);
+  m = f.newMatcher("json", "{}"); // drop the original state
+
+  auto r = f.restoreMatcher("json", "{}", snap);
+  assert(!r.getError());
+  assert(r.computeMask() == expected);
+}
+
+static void test_remap(const cbison::Factory &f, const cbison::Tokenizer &t) {
+  // model vocabulary: engine tokens in reverse order, plus one extra token
+  size_t n = f.nVocab();
+  std::vector<uint32_t> map(n + 1, CBISON_NO_TOKEN);
+  for (uint32_t i = 0; i < n; ++i)
+    map[n - 1 - i] = i;
+  uint32_t eos = uint32_t(n - 1 - t.eosTokenId());
+  auto rf = new cbison::RemappedFactory(f.get(), map, eos);
+  cbison::Factory rem(rf->c_api());
+  rf->c_api()->decr_ref_count(rf->c_api());
+  assert(rem.nVocab() == n + 1);
+
+  auto tokens = t.tokenizeString("{\"a\":1}");
+  auto m = f.newMatcher("json", "{}");
+  auto r = rem.newMatcher("json", "{}");
+  for (auto tok : tokens) {
+    auto mask = m.computeMask();
+    auto rmask = r.computeMask();
+    for (uint32_t i = 0; i <= n; ++i) {
+      bool allowed = i < n && (mask[(n - 1 - i) / 32] >> ((n - 1 - i) % 32)) & 1;
+      assert(bool((rmask[i / 32] >> (i % 32)) & 1) == allowed);
+    }
+    assert(m.consumeTokens({tok}) == 0);
+    assert(r.consumeTokens({uint32_t(n - 1 - tok)}) == 0);
+  }
+  assert(r.isAccepting());
+  assert(r.consumeTokens({uint32_t(n)}) == -1 && r.getError());
+}
+
+static void test_tokenize_batch(const cbison::Tokenizer &t) {
+  std::vector<std::string> strs = {"{\"a\":1}", "", "hello world", "\n"};
+  for (int i = 0; i < 40; ++i)
+    strs.push_back(std::string(200 + i, 'a' + i % 26));
+  std::vector<std::string_view> inputs(strs.begin(), strs.end());
+  std::vector<uint32_t> tokens;
+  std::vector<size_t> offsets;
+  t.tokenizeBytesBatch(inputs, tokens, offsets);
+  assert(offsets.size() == strs.size() + 1 && offsets.back() == tokens.size());
+  for (size_t i = 0; i < strs.size(); ++i)
+    assert(std::vector<uint32_t>(tokens.begin() + offsets[i],
+                                 tokens.begin() + offsets[i + 1]) ==
+           t.tokenizeString(strs[i]));
+}
+
+static void test_prefix_cache(const cbison::Factory &f,
+                              const cbison::Tokenizer &t) {
+  cbison::MatcherPrefixCache cache(f, {1 << 24, 2, 64 << 10});
+  std::vector<std::string> docs = {"{\"a\":1,\"b\":2}", "{\"a\":1,\"c\":3}",
+                                   "{\"a\":1,\"b\":4}"};
+  size_t total_cached = 0;
+  for (auto &doc : docs) {
+    auto tokens = t.tokenizeString(doc);
+    tokens.pop_back(); // stop before the closing brace
+    size_t n_cached = 0;
+    auto m = cache.newMatcher("json", "{}", tokens, &n_cached);
+    assert(!m.getError() && n_cached <= tokens.size());
+    total_cached += n_cached;
+    auto d = f.newMatcher("json", "{}");
+    assert(d.consumeTokens(tokens) == 0);
+    assert(m.computeMask() == d.computeMask());
+  }
+  auto stats = cache.stats();
+  assert(stats.lookups == docs.size());
+  assert(stats.tokens_reused == total_cached);
+  if (stats.entries > 0)
+    assert(total_cached > 0);
+  cache.clear();
+  assert(cache.stats().entries == 0 && cache.stats().bytes == 0);
+}
+
+static void test_checkpoint(const cbison::Factory &f,
+                            const cbison::Tokenizer &t) {
+  auto tokens = t.tokenizeString("{\"a\":[1,2,3],\"b\":\"hello\"}");
+  tokens.pop_back();
+  assert(tokens.size() > 8);
+  cbison::CheckpointOptions opts;
+  opts.prefer_native = false;
+  opts.min_interval = opts.max_interval = 3;
+  cbison::CheckpointedMatcher cm(f.newMatcher("json", "{}"), opts);
+  assert(!cm.isNative());
+  for (auto tok : tokens)
+    assert(cm.consumeTokens({tok}) == 0);
+  // a checkpoint at the start and every 3 tokens since
+  assert(cm.stats().checkpoints == tokens.size() / 3 + 1);
+  assert(cm.maxRollback() == tokens.size());
+
+  auto check = [&](size_t pos) {
+    auto d = f.newMatcher("json", "{}");
+    std::vector<uint32_t> prefix(tokens.begin(), tokens.begin() + pos);
+    assert(d.consumeTokens(prefix) == 0);
+    assert(cm.position() == pos);
+    assert(cm.matcher().computeMask() == d.computeMask());
+    assert(cm.matcher().isAccepting() == d.isAccepting());
+  };
+  size_t replayed = 0;
+  for (size_t target : {tokens.size() - 1, size_t(7), size_t(2), size_t(0)}) {
+    assert(cm.rollback(cm.position() - target) == 0);
+    // restored from the checkpoint at target rounded down to 3
+    replayed += target % 3;
+    check(target);
+  }
+  assert(cm.stats().rollbacks == 4);
+  assert(cm.stats().tokens_replayed == replayed);
+
+  assert(cm.consumeTokens(tokens) == 0);
+  check(tokens.size());
+  assert(cm.rollback(cm.maxRollback() + 1) == -1);
+  check(tokens.size());
+}
+
+static void test_mask_memo(const cbison::Factory &f,
+                           const cbison::Tokenizer &t) {
+  auto tokens = t.tokenizeString("{\"a\":1}");
+  auto m = f.newMatcher("json", "{}");
+  m.enableMaskMemo(4, true);
+  auto first = m.computeMask();
+  assert(m.consumeTokens({tokens[0]}) == 0);
+  auto second = m.computeMask();
+  assert(m.maskMemoStats().misses == 2 && m.maskMemoStats().hits == 0);
+  assert(m.rollback(1) == 0);
+  assert(m.computeMask() == first);
+  assert(m.consumeTokens({tokens[0]}) == 0);
+  assert(m.computeMask() == second);
+  assert(m.maskMemoStats().hits == 2);
+  assert(m.reset() == 0);
+  assert(m.computeMask() == first);
+  assert(m.maskMemoStats().hits == 3);
+  assert(m.consumeTokens({tokens[0]}) == 0);
+  std::vector<uint32_t> mask(first.size());
+  std::vector<std::pair<cbison::Matcher *, uint32_t *>> reqs = {
+      {&m, mask.data()}};
+  if (f.hasComputeMasks()) {
+    assert(f.computeMasks(reqs) == 0);
+    assert(mask == second);
+  }
+  m.invalidateMaskMemo();
+  assert(m.maskMemoStats().entries == 0);
+
+  // enabled mid-stream: reset() must not serve the masks of that state
+  auto m2 = f.newMatcher("json", "{}");
+  assert(m2.consumeTokens({tokens[0]}) == 0);
+  m2.enableMaskMemo(4);
+  assert(m2.computeMask() == second);
+  assert(m2.reset() == 0);
+  assert(m2.computeMask() == first);
+  assert(m2.maskMemoStats().hits == 0);
+  // from there on, positions count from the initial state
+  assert(m2.consumeTokens({tokens[0]}) == 0);
+  assert(m2.reset() == 0);
+  assert(m2.computeMask() == first);
+  assert(m2.maskMemoStats().hits == 1);
+
+  // rolled back past the state the memo was enabled in
+  auto m3 = f.newMatcher("json", "{}");
+  assert(m3.consumeTokens({tokens[0]}) == 0);
+  m3.enableMaskMemo(4);
+  assert(m3.computeMask() == second);
+  assert(m3.rollback(1) == 0);
+  assert(m3.computeMask() == first);
+  assert(m3.consumeTokens({tokens[0]}) == 0);
+  assert(m3.reset() == 0);
+  assert(m3.computeMask() == first);
+  assert(m3.maskMemoStats().hits == 0);
+
+  // a failed consume drops everything
+  auto bad = t.tokenizeString("]");
+  assert(m3.consumeTokens({bad[0]}) != 0);
+  assert(m3.maskMemoStats().entries == 0);
+  m3.computeMask(mask.data());
+  assert(m3.maskMemoStats().hits == 0);
+
+  // the memo survives restoring a checkpoint
+  auto m4 = f.newMatcher("json", "{}");
+  m4.enableMaskMemo(4, true);
+  cbison::CheckpointOptions opts;
+  opts.prefer_native = false;
+  cbison::CheckpointedMatcher cm(std::move(m4), opts);
+  assert(cm.matcher().computeMask() == first);
+  assert(cm.consumeTokens({tokens[0]}) == 0);
+  assert(cm.rollback(1) == 0);
+  assert(cm.matcher().computeMask() == first);
+  assert(cm.matcher().maskMemoStats().hits == 1);
+}
+
+static void test_stream_decoder(const cbison::Tokenizer &t) {
+  std::vector<std::string> texts = {"{\"a\": \"h\u00e9llo \u20ac\"}",
+                                    "caf\u00e9 \U0001F600 ok"};
+  std::vector<std::vector<uint32_t>> tokens;
+  for (auto &s : texts)
+    tokens.push_back(t.tokenizeString(s));
+  cbison::StreamDecoder dec(t);
+  std::vector<std::string> got(texts.size());
+  std::string out;
+  std::vector<size_t> offsets;
+  for (size_t step = 0;; ++step) {
+    std::vector<uint32_t> batch(texts.size(), CBISON_NO_TOKEN);
+    bool any = false;
+    for (size_t i = 0; i < texts.size(); ++i)
+      if (step < tokens[i].size()) {
+        batch[i] = tokens[i][step];
+        any = true;
+      }
+    if (!any)
+      break;
+    assert(dec.decodeStep(batch, out, offsets) == 0);
+    for (size_t i = 0; i < texts.size(); ++i)
+      got[i].append(out, offsets[i], offsets[i + 1] - offsets[i]);
+  }
+  for (size_t i = 0; i < texts.size(); ++i) {
+    assert(dec.pendingBytes(i) == 0);
+    assert(got[i] == texts[i]);
+  }
+
+  std::string eos;
+  dec.decode(0, {t.eosTokenId()}, eos);
+  if (t.isSpecialToken(t.eosTokenId()))
+    assert(eos.empty());
+}
+
+static void test_sampler(const cbison::Factory &f) {
+  size_t n = f.nVocab();
+  std::vector<float> logits(n);
+  for (size_t i = 0; i < n; ++i)
+    logits[i] = float((i * 7919) % 1000) / 100.0f;
+  auto m = f.newMatcher("json", "{}");
+  auto mask = m.computeMask();
+  auto allowed = [&](uint32_t tok) {
+    return tok < n && ((mask[tok / 32] >> (tok % 32)) & 1);
+  };
+
+  cbison::ThreadPool pool(2);
+  cbison::ConstrainedSampler sampler(n, &pool);
+  cbison::SamplingParams greedy;
+  greedy.temperature = 0;
+  uint32_t best = sampler.sample(logits.data(), mask.data(), greedy, 0);
+  assert(allowed(best));
+  for (size_t i = 0; i < n; ++i)
+    if (allowed(i))
+      assert(logits[i] <= logits[best]);
+
+  std::vector<cbison::SampleRow> rows(8);
+  for (size_t i = 0; i < rows.size(); ++i) {
+    rows[i].logits = logits.data();
+    rows[i].mask = mask.data();
+    rows[i].params.temperature = 0.8f;
+    rows[i].params.top_k = i % 2 ? 5 : 0;
+    rows[i].params.top_p = i % 4 < 2 ? 1.0f : 0.9f;
+    rows[i].params.min_p = 0.05f;
+    rows[i].seed = i;
+  }
+  assert(sampler.sampleBatch(rows) == 0);
+  for (auto &r : rows) {
+    assert(allowed(r.token));
+    assert(sampler.sample(logits.data(), mask.data(), r.params, r.seed) ==
+           r.token);
+  }
+  assert(sampler.stats().rows == 1 + 2 * rows.size());
+}
+
+static void test_sampler_dense() {
+  // most tokens allowed and no top-k/top-p: sampled straight over the mask,
+  // with the maximum taken by AVX2 where available
+  size_t n = 50021; // the last mask word is partial
+  std::vector<float> logits(n);
+  std::vector<uint32_t> mask((n + 31) / 32);
+  for (size_t i = 0; i < n; ++i) {
+    logits[i] = float((i * 7919) % 10007) / 1000.0f - 5.0f;
+    if (i % 7 != 3)
+      mask[i / 32] |= 1u << (i % 32);
+  }
+  mask.back() |= ~0u << (n % 32); // bits past n_vocab are ignored
+  logits[3] = 100.0f;             // not allowed
+  auto allowed = [&](size_t tok) { return (mask[tok / 32] >> (tok % 32)) & 1; };
+
+  cbison::ConstrainedSampler sampler(n);
+  cbison::SamplingParams greedy;
+  greedy.temperature = 0;
+  // maximum in the first word, a middle one, and the partial last one
+  for (size_t best : {size_t(1), n / 2, n - 1}) {
+    float saved = logits[best];
+    logits[best] = 50.0f;
+    float mx = -1e30f;
+    for (size_t i = 0; i < n; ++i)
+      if (allowed(i))
+        mx = std::max(mx, logits[i]);
+    uint32_t tok = sampler.sample(logits.data(), mask.data(), greedy, 0);
+    assert(tok == best && logits[tok] == mx);
+    logits[best] = saved;
+  }
+
+  // same draws as through the candidate list, which top_k = n forces
+  cbison::SamplingParams p;
+  p.temperature = 0.7f;
+  cbison::SamplingParams listed = p;
+  listed.top_k = n;
+  for (uint64_t seed = 0; seed < 16; ++seed) {
+    uint32_t tok = sampler.sample(logits.data(), mask.data(), p, seed);
+    assert(tok < n && allowed(tok));
+    assert(sampler.sample(logits.data(), mask.data(), listed, seed) == tok);
+  }
+  assert(sampler.stats().dense == 3 + 2 * 16);
+}
+
+static void test_speculative(const cbison::Factory &f,
+                             const cbison::Tokenizer &t) {
+  auto tokens = t.tokenizeString("{\"a\":[1,2]}");
+  auto m = f.newMatcher("json", "{}");
+  auto ref = f.newMatcher("json", "{}");
+  cbison::SpeculativeMasker spec(f, {}, 2);
+  std::vector<uint32_t> mask(f.maskByteLen() / 4);
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    // predict right on even steps only
+    std::vector<uint32_t> cands = {t.eosTokenId()};
+    if (i % 2 == 0)
+      cands.push_back(tokens[i]);
+    spec.prepare(m, cands);
+    int r = spec.commit(m, tokens[i], mask.data());
+    assert(r >= 0);
+    assert(ref.consumeTokens({tokens[i]}) == 0);
+    if (!ref.isStopped())
+      assert(mask == ref.computeMask());
+  }
+  assert(m.isAccepting());
+  auto st = spec.stats();
+  assert(st.hits + st.misses == tokens.size());
+  assert(st.useful_cpu_us <= st.branch_cpu_us);
+
+  // branches of a freed matcher are never promoted into a fresh one, even
+  // if the engine reuses its address
+  {
+    auto gone = f.newMatcher("json", "{}");
+    spec.prepare(gone, {tokens[0]});
+  }
+  auto fresh = f.newMatcher("json", "{}");
+  assert(spec.commit(fresh, tokens[0], mask.data()) == 0);
+  assert(mask == fresh.computeMask());
+
+  // nor those of a matcher advanced since prepare()
+  auto moved = f.newMatcher("json", "{}");
+  spec.prepare(moved, {tokens[1]});
+  assert(moved.consumeTokens({tokens[0]}) == 0);
+  assert(spec.commit(moved, tokens[1], mask.data()) == 0);
+  assert(fresh.consumeTokens({tokens[1]}) == 0);
+  assert(mask == fresh.computeMask());
+}
+
+static void test_deadline(const cbison::Factory &f,
+                          const cbison::Tokenizer &t) {
+  using cbison::MaskRowStatus;
+  auto tokens = t.tokenizeString("{\"a\":12}");
+  size_t words = f.maskByteLen() / 4;
+  for (auto policy :
+       {cbison::LatePolicy::FinishLate, cbison::LatePolicy::CachedMask,
+        cbison::LatePolicy::ValidateOnSample}) {
+    cbison::DeadlineMasker dm(f, policy, 2);
+    auto m = f.newMatcher("json", "{}");
+    std::vector<uint32_t> mask(words), prev(words);
+    std::vector<MaskRowStatus> status;
+
+    // generous deadline, so the row is ready
+    int rc = dm.computeMasks({{&m, prev.data()}}, std::chrono::seconds(10),
+                             status);
+    assert(rc == 0 && status[0] == MaskRowStatus::Ready);
+    assert(prev == m.computeMask());
+    assert(m.consumeTokens({tokens[0]}) == 0);
+
+    // zero budget: the row is most likely late
+    rc = dm.computeMasks({{&m, mask.data()}}, std::chrono::microseconds(0),
+                         status);
+    assert(rc == 0);
+    if (status[0] == MaskRowStatus::Cached)
+      assert(mask == prev);
+    // without native forks, a late row is computed in place and waited for
+    if (dm.stats().waited_rows)
+      assert(status[0] == MaskRowStatus::Ready && mask == m.computeMask());
+    // the matcher is usable right away, while a late mask may still be
+    // computed in the background
+    assert(m.validateTokens({tokens[1]}) == 1);
+    assert(m.consumeTokens({tokens[1]}) == 0);
+
+    // a second batch with the same matcher does not fail
+    rc = dm.computeMasks({{&m, mask.data()}}, std::chrono::seconds(10),
+                         status);
+    assert(rc == 0);
+    dm.waitLate();
+    if (status[0] != MaskRowStatus::ValidateOnSample &&
+        status[0] != MaskRowStatus::Cached)
+      assert(mask == m.computeMask());
+    assert(dm.stats().calls == 3);
+  }
+}
+
 static void test_for_tokenizer(cbison::CbisonEngineDll &engine,
                                cbison_tokenizer_t t0) {
   cbison::Tokenizer t(t0);
@@ -15,6 +579,27 @@ static void test_for_tokenizer(cbison::CbisonEngineDll &engine,
     abort();
   }
   cbison::Factory f(fptr);
+
+  // background construction with warmup
+  {
+    auto pending = engine.new_factory_async(
+        t0, "{}", cbison::CbisonEngineDll::default_warmup());
+    auto fptr2 = pending.wait(err);
+    assert(fptr2);
+    assert(fptr2->n_vocab == f.nVocab());
+    assert(pending.timings().factory_ms >= 0);
+    assert(pending.timings().warmup_ms >= 0);
+    fptr2->decr_ref_count(fptr2);
+
+    // assigning over a pending load waits for it and frees its factory
+    pending = engine.new_factory_async(t0, "{}", {});
+    pending = engine.new_factory_async(t0, "{}", {});
+    fptr2 = pending.wait(err);
+    assert(fptr2);
+    fptr2->decr_ref_count(fptr2);
+    pending = engine.new_factory_async(t0, "{}", {});
+    pending = cbison::PendingFactory();
+  }
   t0->decr_ref_count(t0);
 
   // validate grammar
@@ -81,6 +666,22 @@ static void test_for_tokenizer(cbison::CbisonEngineDll &engine,
   assert(m2.isAccepting());
   assert(m2.isStopped());
 
+  // forks diverge independently (through clone() if the engine has no
+  // fork_matcher(); test_static.cpp covers the mock's native fork)
+  m2.rollback(3);
+  {
+    auto m3 = m2.fork();
+    assert(!m3.getError());
+    m3.consumeTokens(last3);
+    assert(m3.isAccepting());
+    assert(!m2.isAccepting());
+    auto m4 = m3.fork();
+    m3.rollback(3);
+    assert(m4.isAccepting());
+    assert(m3.computeMask() == m2.computeMask());
+  }
+  m2.consumeTokens(last3);
+
   // compute mask and ff tokens
   m2.rollback(1);
   auto mask2 = m2.computeMask();
@@ -108,6 +709,83 @@ static void test_for_tokenizer(cbison::CbisonEngineDll &engine,
   assert(row2 == mask2);
   for (size_t i = words; i < 2 * words; ++i)
     assert(mask[i] == 0);
+
+  // strided, padded masks
+  size_t padded = (f.nVocab() + 255) / 256 * 256;
+  size_t stride = padded; // bytes, for bool format
+  std::vector<uint8_t> bools(2 * stride, 0xff);
+  cbison_mask_layout_t layout = {bools.data(), stride, padded,
+                                 CBISON_MASK_FORMAT_BOOL, 0};
+  rc = f.computeMasksStrided({nullptr, &m2}, layout);
+  assert(rc == 0);
+  for (size_t i = 0; i < padded; ++i) {
+    assert(bools[i] == 0xff);
+    bool allowed = i < f.nVocab() && (mask2[i / 32] >> (i % 32)) & 1;
+    assert(bools[stride + i] == (allowed ? 1 : 0));
+  }
+
+  test_step_batch(f, t);
+  test_constrained_batch(f, t);
+  test_fast_forward(f, t);
+  test_optimistic(f, t);
+  test_snapshot(f, t);
+  test_remap(f, t);
+  test_tokenize_batch(t);
+  test_prefix_cache(f, t);
+  test_checkpoint(f, t);
+  test_mask_memo(f, t);
+  test_stream_decoder(t);
+  test_sampler(f);
+  test_sampler_dense();
+  test_speculative(f, t);
+  test_deadline(f, t);
+
+  // memory accounting; the engine may or may not report usage
+  {
+    cbison::MemoryBudget mb;
+    mb.addFactory(f);
+    mb.track(m, "json");
+    mb.track(m2, "json");
+    auto u = mb.usage();
+    assert(u.by_type.size() == 1 && u.by_type[0].second.matchers == 2);
+    mb.untrack(m2);
+    assert(mb.usage().by_type[0].second.matchers == 1);
+
+    // rollback from a checkpoint replaces the engine matcher of the
+    // tracked wrapper
+    cbison::CheckpointOptions opts;
+    opts.prefer_native = false;
+    opts.min_interval = opts.max_interval = 2;
+    cbison::CheckpointedMatcher cm(f.newMatcher("json", "{}"), opts);
+    mb.track(cm.matcher(), "ckpt");
+    auto tokens = t.tokenizeString("{\"a\":[1,2]}");
+    for (auto tok : tokens)
+      assert(cm.consumeTokens({tok}) == 0);
+    assert(cm.rollback(3) == 0);
+    u = mb.usage();
+    assert(u.by_type.size() == 2 && u.by_type[1].second.matchers == 1);
+    mb.untrack(cm.matcher());
+  }
+
+  // masks in a double-buffered arena
+  {
+    cbison::MaskArenaOptions opts;
+    opts.max_slots = 16;
+    cbison::MaskArena arena(f.maskByteLen(), opts);
+    assert(arena.ok() && arena.rowStride() % 64 == 0);
+    int s0 = arena.allocSlot();
+    int s1 = arena.allocSlot();
+    assert(s0 == 0 && s1 == 1);
+    std::vector<cbison::Matcher *> rows = {nullptr, &m2};
+    rc = f.computeMasksStrided(rows, arena.layout(arena.advance()));
+    assert(rc == 0);
+    std::vector<uint32_t> arow(arena.row(1), arena.row(1) + words);
+    assert(arow == mask2);
+    assert(arena.row(0, 1) != arena.row(1, 1));
+    arena.freeSlot(0);
+    assert(arena.stats().live_slots == 1);
+    assert(arena.allocSlot() == 0);
+  }
 }
 
 class TrivialByteTokenizer : public cbison::CppTokenizer {
@@ -139,6 +817,8 @@ public:
 };
 
 int main(int argc, char *argv[]) {
+  test_static_binding();
+
   if (argc < 2) {
     std::cerr << "Usage: " << argv[0] << " <path to engine library> [prefix]\n";
     return 1;
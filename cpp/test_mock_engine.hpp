@@ -0,0 +1,194 @@
+#pragma once
+
+// Minimal engine for tests and benchmarks that don't need a real grammar
+// engine. Grammar type "lit" matches its grammar string literally, with one
+// token per byte (token ids 0..255); the EOS token is allowed at the end.
+// Forks share the grammar string copy-on-write (it is never written), while
+// clones copy it, so matcher_memory_usage() tells them apart.
+// Entry points are exported as mock_cbison_<entry>, so the engine can be
+// bound both through a cbison_factory and with cbison_static.hpp.
+// Include from one translation unit per binary.
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include "cbison_api.h"
+
+struct cbison_matcher {
+  std::shared_ptr<const std::string> lit;
+  size_t pos = 0;
+  size_t n_vocab = 0;
+  uint32_t eos = 0;
+  bool stopped = false;
+  const char *error = nullptr;
+};
+
+extern "C" {
+
+int32_t mock_cbison_validate_grammar(cbison_factory_t, const char *type,
+                                     const char *, char *message,
+                                     size_t message_len) {
+  if (std::strcmp(type, "lit") == 0)
+    return 0;
+  if (message_len)
+    std::snprintf(message, message_len, "unknown grammar type: %s", type);
+  return -1;
+}
+
+cbison_matcher_ptr_t mock_cbison_new_matcher(cbison_factory_t api,
+                                             const char *type,
+                                             const char *grammar) {
+  auto m = new cbison_matcher();
+  m->lit = std::make_shared<const std::string>(grammar);
+  m->n_vocab = api->n_vocab;
+  m->eos = api->eos_token_id;
+  if (std::strcmp(type, "lit") != 0)
+    m->error = "unknown grammar type";
+  return m;
+}
+
+const char *mock_cbison_get_error(cbison_matcher_t m) { return m->error; }
+
+static bool mock_allowed(cbison_matcher_t m, uint32_t t) {
+  if (m->error || m->stopped)
+    return false;
+  if (m->pos == m->lit->size())
+    return t == m->eos;
+  return t == static_cast<uint8_t>((*m->lit)[m->pos]);
+}
+
+int32_t mock_cbison_compute_mask(cbison_matcher_t m, uint32_t *dest,
+                                 size_t len) {
+  if (m->error || len * 8 < m->n_vocab)
+    return -1;
+  std::memset(dest, 0, len);
+  if (m->stopped)
+    return -1;
+  uint32_t t = m->pos == m->lit->size()
+                   ? m->eos
+                   : static_cast<uint8_t>((*m->lit)[m->pos]);
+  dest[t / 32] |= 1u << (t % 32);
+  return 0;
+}
+
+int32_t mock_cbison_validate_tokens(cbison_matcher_t m, const uint32_t *tokens,
+                                    size_t n) {
+  if (m->error)
+    return -1;
+  size_t pos = m->pos;
+  for (size_t i = 0; i < n; ++i) {
+    uint32_t t = tokens[i];
+    if (pos == m->lit->size())
+      return static_cast<int32_t>(i + (t == m->eos));
+    if (t != static_cast<uint8_t>((*m->lit)[pos]))
+      return static_cast<int32_t>(i);
+    pos++;
+  }
+  return static_cast<int32_t>(n);
+}
+
+int32_t mock_cbison_consume_tokens(cbison_matcher_t m, const uint32_t *tokens,
+                                   size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    if (!mock_allowed(m, tokens[i])) {
+      m->error = "token not allowed";
+      return -1;
+    }
+    if (tokens[i] == m->eos)
+      m->stopped = true;
+    else
+      m->pos++;
+  }
+  return 0;
+}
+
+bool mock_cbison_is_accepting(cbison_matcher_t m) {
+  return !m->error && m->pos == m->lit->size();
+}
+
+bool mock_cbison_is_stopped(cbison_matcher_t m) {
+  return m->error || m->stopped;
+}
+
+int32_t mock_cbison_rollback(cbison_matcher_t m, size_t n) {
+  if (m->error)
+    return -1;
+  if (m->stopped && n > 0) {
+    m->stopped = false;
+    n--;
+  }
+  if (n > m->pos)
+    return -1;
+  m->pos -= n;
+  return 0;
+}
+
+int32_t mock_cbison_reset(cbison_matcher_t m) {
+  m->pos = 0;
+  m->stopped = false;
+  m->error = nullptr;
+  return 0;
+}
+
+cbison_matcher_ptr_t mock_cbison_clone_matcher(cbison_matcher_t m) {
+  auto c = new cbison_matcher(*m);
+  c->lit = std::make_shared<const std::string>(*m->lit);
+  return c;
+}
+
+cbison_matcher_ptr_t mock_cbison_fork_matcher(cbison_matcher_t m) {
+  return new cbison_matcher(*m);
+}
+
+size_t mock_cbison_matcher_memory_usage(cbison_matcher_t m) {
+  // the grammar only counts while it is not shared with a fork
+  size_t own = m->lit.use_count() == 1 ? m->lit->capacity() : 0;
+  return sizeof(cbison_matcher) + own;
+}
+
+void mock_cbison_free_matcher(cbison_matcher_t m) { delete m; }
+
+} // extern "C"
+
+static void mock_incr_ref_count(cbison_factory_t f) {
+  ++*static_cast<size_t *>(f->impl_data);
+}
+
+static void mock_decr_ref_count(cbison_factory_t f) {
+  auto rc = static_cast<size_t *>(f->impl_data);
+  if (--*rc == 0) {
+    delete rc;
+    delete f;
+  }
+}
+
+/// Factory whose entries point at the mock_cbison_* functions, with a
+/// reference count of 1.
+inline cbison_factory_t mock_new_factory(size_t n_vocab) {
+  auto f = new cbison_factory();
+  f->impl_data = new size_t(1);
+  f->magic = CBISON_FACTORY_MAGIC;
+  f->version_major = CBISON_FACTORY_VERSION_MAJOR;
+  f->version_minor = CBISON_FACTORY_VERSION_MINOR;
+  f->n_vocab = n_vocab;
+  f->mask_byte_len = (n_vocab + 31) / 32 * 4;
+  f->eos_token_id = static_cast<uint32_t>(n_vocab - 1);
+  f->incr_ref_count = mock_incr_ref_count;
+  f->decr_ref_count = mock_decr_ref_count;
+  f->validate_grammar = mock_cbison_validate_grammar;
+  f->new_matcher = mock_cbison_new_matcher;
+  f->get_error = mock_cbison_get_error;
+  f->compute_mask = mock_cbison_compute_mask;
+  f->consume_tokens = mock_cbison_consume_tokens;
+  f->is_accepting = mock_cbison_is_accepting;
+  f->is_stopped = mock_cbison_is_stopped;
+  f->validate_tokens = mock_cbison_validate_tokens;
+  f->free_matcher = mock_cbison_free_matcher;
+  f->rollback = mock_cbison_rollback;
+  f->reset = mock_cbison_reset;
+  f->clone_matcher = mock_cbison_clone_matcher;
+  f->matcher_memory_usage = mock_cbison_matcher_memory_usage;
+  f->fork_matcher = mock_cbison_fork_matcher;
+  return f;
+}
@@ -0,0 +1,140 @@
+// Tests of cbison_static.hpp, against the mock engine.
+
+#include <cassert>
+#include <iostream>
+#include <optional>
+#include <thread>
+#include "cbison_static.hpp"
+#include "test_mock_engine.hpp"
+
+CBISON_DECLARE_STATIC_ENGINE(MockEngine, mock);
+
+// optional entries
+struct MockEngineFull : MockEngine {
+  static int32_t validate_tokens(cbison_matcher_t m, const uint32_t *t,
+                                 size_t n) {
+    return mock_cbison_validate_tokens(m, t, n);
+  }
+  static int32_t rollback(cbison_matcher_t m, size_t n) {
+    return mock_cbison_rollback(m, n);
+  }
+  static int32_t reset(cbison_matcher_t m) { return mock_cbison_reset(m); }
+  static cbison_matcher_ptr_t clone_matcher(cbison_matcher_t m) {
+    return mock_cbison_clone_matcher(m);
+  }
+  static cbison_matcher_ptr_t fork_matcher(cbison_matcher_t m) {
+    return mock_cbison_fork_matcher(m);
+  }
+};
+
+static std::vector<uint32_t> bytes(const std::string &s) {
+  return std::vector<uint32_t>(s.begin(), s.end());
+}
+
+// The static binding behaves like the dynamic one over the same engine.
+template <typename Engine> static void test_static_engine(bool full) {
+  using namespace cbison::static_binding;
+  cbison_factory_t api = mock_new_factory(257);
+  Factory<Engine> f(api);
+  cbison::Factory df(api);
+  api->decr_ref_count(api);
+
+  auto [ok, msg] = f.validateGrammar("lit", "abc");
+  assert(ok && msg.empty());
+  std::tie(ok, msg) = f.validateGrammar("foo", "abc");
+  assert(!ok && msg.find("foo") != std::string::npos);
+  assert(f.newMatcher("foo", "abc").getError());
+
+  auto m = f.newMatcher("lit", "abc");
+  auto d = df.newMatcher("lit", "abc");
+  assert(!m.getError());
+  assert(m.computeMask() == d.computeMask());
+  assert(m.consumeTokens(bytes("ab")) == 0 && d.consumeTokens(bytes("ab")) == 0);
+  assert(m.computeMask() == d.computeMask());
+  assert(!m.isAccepting());
+
+  assert(m.validateTokens(bytes("c")) == (full ? 1 : -1));
+  assert(m.rollback(1) == (full ? 0 : -1));
+  if (full) {
+    auto c = m.clone();
+    assert(c.get() && c.consumeTokens(bytes("bc")) == 0 && c.isAccepting());
+    auto k = m.fork();
+    assert(k.get() && k.consumeTokens(bytes("bc")) == 0 && k.isAccepting());
+    assert(!m.isAccepting());
+    assert(m.reset() == 0 && m.computeMask() == df.newMatcher("lit", "abc").computeMask());
+    assert(m.consumeTokens(bytes("ab")) == 0);
+  } else {
+    assert(m.clone().get() == nullptr);
+    assert(m.reset() == -1);
+  }
+  assert(m.computeFFTokens().empty());
+
+  assert(m.consumeTokens(bytes("c")) == 0);
+  assert(m.isAccepting() && !m.isStopped());
+  assert(m.consumeTokens({256}) == 0 && m.isStopped());
+  assert(m.consumeTokens({'x'}) == -1 && m.getError());
+
+  std::vector<uint32_t> mask(f.maskByteLen() / 4);
+  auto m2 = f.newMatcher("lit", "xyz");
+  assert(f.computeMasks({{&m2, mask.data()}}) == -1); // no compute_masks
+}
+
+// Forks through the dynamic binding, over the mock's copy-on-write
+// fork_matcher() rather than the clone fallback: forks are independent of
+// each other and of the original, whatever the order they are advanced,
+// rolled back or freed in, and from different threads.
+static void test_fork() {
+  cbison_factory_t api = mock_new_factory(257);
+  cbison::Factory f(api);
+  api->decr_ref_count(api);
+  std::string prefix(4096, 'a');
+
+  auto m = f.newMatcher("lit", prefix + "bc");
+  assert(m.hasFork());
+  assert(m.consumeTokens(bytes(prefix)) == 0);
+  size_t full = *m.memoryUsage();
+  {
+    // a fork shares the grammar, a clone copies it
+    auto c = m.clone();
+    auto a = m.fork();
+    assert(*c.memoryUsage() >= full && *a.memoryUsage() < full);
+
+    auto b = a.fork();
+    assert(a.consumeTokens(bytes("bc")) == 0 && a.isAccepting());
+    assert(!m.isAccepting() && !b.isAccepting());
+    assert(b.rollback(2) == 0);
+    assert(b.computeMask() != m.computeMask());
+    assert(a.rollback(2) == 0 && a.computeMask() == m.computeMask());
+  }
+  assert(*m.memoryUsage() == full);
+
+  // the original freed first
+  std::optional<cbison::Matcher> o = f.newMatcher("lit", prefix + "bc");
+  assert(o->consumeTokens(bytes(prefix)) == 0);
+  auto late = o->fork();
+  o.reset();
+  assert(late.consumeTokens(bytes("bc")) == 0 && late.isAccepting());
+
+  std::vector<cbison::Matcher> forks;
+  for (int i = 0; i < 4; ++i)
+    forks.push_back(m.fork());
+  std::vector<std::thread> threads;
+  for (auto &x : forks)
+    threads.emplace_back([&x] {
+      for (int j = 0; j < 100; ++j) {
+        auto y = x.fork();
+        assert(y.consumeTokens(bytes("b")) == 0);
+      }
+      assert(x.consumeTokens(bytes("bc")) == 0 && x.isAccepting());
+    });
+  for (auto &th : threads)
+    th.join();
+  assert(!m.isAccepting());
+}
+
+void test_static_binding() {
+  test_static_engine<MockEngine>(false);
+  test_static_engine<MockEngineFull>(true);
+  test_fork();
+  std::cout << "static binding: ok\n";
+}
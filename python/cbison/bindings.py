@@ -169,6 +169,34 @@ struct_cbison_mask_req._fields_ = [
 ]
 
 cbison_mask_req_t = struct_cbison_mask_req
+class struct_cbison_mask_layout(Structure):
+    pass
+
+struct_cbison_mask_layout._pack_ = 1 # source:False
+struct_cbison_mask_layout._fields_ = [
+    ('base', ctypes.POINTER(None)),
+    ('row_stride', ctypes.c_size_t),
+    ('padded_vocab', ctypes.c_size_t),
+    ('format', ctypes.c_uint32),
+    ('pad_allowed', ctypes.c_uint32),
+]
+
+cbison_mask_layout_t = struct_cbison_mask_layout
+class struct_cbison_step_req(Structure):
+    pass
+
+struct_cbison_step_req._pack_ = 1 # source:False
+struct_cbison_step_req._fields_ = [
+    ('matcher', cbison_matcher_t),
+    ('token', ctypes.c_uint32),
+    ('flags', ctypes.c_uint32),
+    ('mask_row', ctypes.c_size_t),
+    ('ff_tokens', ctypes.POINTER(ctypes.c_uint32)),
+    ('ff_tokens_len', ctypes.c_size_t),
+    ('n_ff_tokens', ctypes.c_size_t),
+]
+
+cbison_step_req_t = struct_cbison_step_req
 cbison_new_factory_fn_t = ctypes.CFUNCTYPE(ctypes.POINTER(struct_cbison_factory), ctypes.POINTER(struct_cbison_tokenizer), ctypes.c_char_p, ctypes.c_char_p, ctypes.c_size_t)
 cbison_new_byte_tokenizer_fn_t = ctypes.CFUNCTYPE(ctypes.POINTER(struct_cbison_tokenizer))
 cbison_new_hf_tokenizer_fn_t = ctypes.CFUNCTYPE(ctypes.POINTER(struct_cbison_tokenizer), ctypes.c_char_p, ctypes.c_char_p, ctypes.c_char_p, ctypes.c_size_t)
@@ -199,7 +227,15 @@ struct_cbison_factory._fields_ = [
     ('reset', ctypes.CFUNCTYPE(ctypes.c_int32, cbison_matcher_t)),
     ('clone_matcher', ctypes.CFUNCTYPE(cbison_matcher_t, cbison_matcher_t)),
     ('compute_masks', ctypes.CFUNCTYPE(ctypes.c_int32, cbison_factory_t, ctypes.POINTER(struct_cbison_mask_req), ctypes.c_size_t)),
-    ('reserved_ptr', ctypes.POINTER(None) * 16),
+    ('compute_masks_strided', ctypes.CFUNCTYPE(ctypes.c_int32, cbison_factory_t, ctypes.POINTER(cbison_matcher_t), ctypes.c_size_t, ctypes.POINTER(struct_cbison_mask_layout))),
+    ('compute_masks_deadline', ctypes.CFUNCTYPE(ctypes.c_int32, cbison_factory_t, ctypes.POINTER(struct_cbison_mask_req), ctypes.c_size_t, ctypes.c_uint64, ctypes.POINTER(ctypes.c_ubyte))),
+    ('matcher_memory_usage', ctypes.CFUNCTYPE(ctypes.c_size_t, cbison_matcher_t)),
+    ('factory_memory_usage', ctypes.CFUNCTYPE(ctypes.c_size_t, cbison_factory_t)),
+    ('snapshot_matcher', ctypes.CFUNCTYPE(ctypes.c_size_t, cbison_matcher_t, ctypes.POINTER(ctypes.c_ubyte), ctypes.c_size_t)),
+    ('restore_matcher', ctypes.CFUNCTYPE(cbison_matcher_t, cbison_factory_t, ctypes.c_char_p, ctypes.c_char_p, ctypes.POINTER(ctypes.c_ubyte), ctypes.c_size_t)),
+    ('step_batch', ctypes.CFUNCTYPE(ctypes.c_int32, cbison_factory_t, ctypes.POINTER(struct_cbison_step_req), ctypes.c_size_t, ctypes.POINTER(struct_cbison_mask_layout))),
+    ('fork_matcher', ctypes.CFUNCTYPE(cbison_matcher_t, cbison_matcher_t)),
+    ('reserved_ptr', ctypes.POINTER(None) * 8),
 ]
 
 struct_cbison_tokenizer._pack_ = 1 # source:False
@@ -219,13 +255,16 @@ struct_cbison_tokenizer._fields_ = [
     ('tokenize_bytes', ctypes.CFUNCTYPE(ctypes.c_size_t, ctypes.POINTER(struct_cbison_tokenizer), ctypes.c_char_p, ctypes.c_uint64, ctypes.POINTER(ctypes.c_uint32), ctypes.c_uint64)),
     ('incr_ref_count', ctypes.CFUNCTYPE(None, ctypes.POINTER(struct_cbison_tokenizer))),
     ('decr_ref_count', ctypes.CFUNCTYPE(None, ctypes.POINTER(struct_cbison_tokenizer))),
-    ('reserved_ptr', ctypes.POINTER(None) * 16),
+    ('tokenize_bytes_batch', ctypes.CFUNCTYPE(ctypes.c_size_t, ctypes.POINTER(struct_cbison_tokenizer), ctypes.c_char_p, ctypes.POINTER(ctypes.c_size_t), ctypes.c_size_t, ctypes.POINTER(ctypes.c_uint32), ctypes.c_size_t, ctypes.POINTER(ctypes.c_size_t))),
+    ('reserved_ptr', ctypes.POINTER(None) * 15),
 ]
 
 __all__ = \
-    ['cbison_factory_t', 'cbison_mask_req_t', 'cbison_matcher_ptr_t',
-    'cbison_matcher_t', 'cbison_new_byte_tokenizer_fn_t',
-    'cbison_new_factory_fn_t', 'cbison_new_hf_tokenizer_fn_t',
+    ['cbison_factory_t', 'cbison_mask_layout_t', 'cbison_mask_req_t',
+    'cbison_matcher_ptr_t', 'cbison_matcher_t',
+    'cbison_new_byte_tokenizer_fn_t', 'cbison_new_factory_fn_t',
+    'cbison_new_hf_tokenizer_fn_t', 'cbison_step_req_t',
     'cbison_tokenizer_ptr_t', 'cbison_tokenizer_t',
-    'struct_cbison_factory', 'struct_cbison_mask_req',
-    'struct_cbison_matcher', 'struct_cbison_tokenizer']
+    'struct_cbison_factory', 'struct_cbison_mask_layout',
+    'struct_cbison_mask_req', 'struct_cbison_matcher',
+    'struct_cbison_step_req', 'struct_cbison_tokenizer']
@@ -1,11 +1,18 @@
 import ctypes
-from .bindings import struct_cbison_factory, struct_cbison_matcher, cbison_mask_req_t, string_cast, struct_cbison_tokenizer
+from .bindings import struct_cbison_factory, struct_cbison_matcher, cbison_mask_req_t, cbison_mask_layout_t, cbison_matcher_t, cbison_step_req_t, string_cast, struct_cbison_tokenizer
 from typing import TYPE_CHECKING
 
 if TYPE_CHECKING:
     import numpy as np
     from numpy.typing import NDArray
 
+# flags returned by CbisonFactory.step_batch_numpy()
+STEP_STOPPED = 0x1
+STEP_ACCEPTING = 0x2
+STEP_ERROR = 0x4
+
+_NO_TOKEN = 0xffffffff
+
 
 class CbisonMatcher:
     """
@@ -48,6 +55,26 @@ class CbisonMatcher:
             raise RuntimeError("Failed to clone matcher")
         return CbisonMatcher(self.api, m)
 
+    def fork(self) -> 'CbisonMatcher':
+        """
+        Forks the matcher into a new instance, sharing unchanged state with
+        this one (copy-on-write); cheaper than copy() for beam search and
+        parallel sampling. Falls back to copy() if the engine does not
+        support forking.
+        
+        Returns:
+            A new CbisonMatcher with the same state.
+        
+        Raises:
+            RuntimeError: If forking fails.
+        """
+        if self.api.version_minor < 6 or not self.api.fork_matcher:
+            return self.copy()
+        m = self.api.fork_matcher(self.matcher)
+        if m is None:
+            raise RuntimeError("Failed to fork matcher")
+        return CbisonMatcher(self.api, m)
+
     def compute_mask(self) -> bytearray:
         """
         Allocates a bytearray and computes the token mask into it.
@@ -198,6 +225,35 @@ class CbisonMatcher:
         """
         return self.api.rollback(self.matcher, n)
 
+    def snapshot(self) -> bytes | None:
+        """
+        Serializes the matcher state, see CbisonFactory.restore_matcher().
+        
+        Returns:
+            The snapshot, or None if not supported by the engine or on error.
+        """
+        if self.api.version_minor < 4 or not self.api.snapshot_matcher:
+            return None
+        n = self.api.snapshot_matcher(self.matcher, None, 0)
+        if n == 0:
+            return None
+        buf = (ctypes.c_uint8 * n)()
+        n2 = self.api.snapshot_matcher(self.matcher, buf, n)
+        if n2 != n:
+            return None
+        return bytes(buf)
+
+    def memory_usage(self) -> int | None:
+        """
+        Returns the approximate number of bytes used by the matcher.
+        
+        Returns:
+            Number of bytes, or None if the engine does not report it.
+        """
+        if self.api.version_minor < 3 or not self.api.matcher_memory_usage:
+            return None
+        return self.api.matcher_memory_usage(self.matcher)
+
 
 def _check_addr(addr: int) -> None:
     if not isinstance(addr, int) or not addr or (addr & 0x3) != 0:
@@ -256,6 +312,19 @@ class CbisonFactory:
         """
         return self.handle.mask_byte_len
 
+    def memory_usage(self) -> int | None:
+        """
+        Returns the approximate number of bytes used by the factory,
+        excluding live matchers.
+        
+        Returns:
+            Number of bytes, or None if the engine does not report it.
+        """
+        h = self.handle
+        if h.version_minor < 3 or not h.factory_memory_usage:
+            return None
+        return h.factory_memory_usage(h)
+
     def new_matcher(self, grammar_type: str,
                     grammar: str | bytes) -> CbisonMatcher:
         """
@@ -276,6 +345,36 @@ class CbisonFactory:
                                     grammar)
         return CbisonMatcher(self.handle, m)
 
+    def restore_matcher(self, grammar_type: str, grammar: str | bytes,
+                        snapshot: bytes | None,
+                        replay_tokens: list[int] | None = None) -> CbisonMatcher:
+        """
+        Re-creates a matcher from CbisonMatcher.snapshot().
+        If the snapshot is None (or the engine cannot restore), a new matcher
+        is created and replay_tokens are consumed instead.
+        
+        Args:
+            grammar_type (str): Type of grammar the snapshot was taken with.
+            grammar (str | bytes): Grammar the snapshot was taken with.
+            snapshot (bytes | None): The snapshot.
+            replay_tokens (list[int] | None): Tokens to replay as a fallback.
+        
+        Returns:
+            A new CbisonMatcher; check get_error() for errors.
+        """
+        h = self.handle
+        if snapshot is None or h.version_minor < 4 or not h.restore_matcher:
+            m = self.new_matcher(grammar_type, grammar)
+            if replay_tokens:
+                m.consume_tokens(replay_tokens)
+            return m
+        if isinstance(grammar, str):
+            grammar = grammar.encode("utf-8")
+        buf = (ctypes.c_uint8 * len(snapshot)).from_buffer_copy(snapshot)
+        m = h.restore_matcher(h, grammar_type.encode("utf-8"), grammar, buf,
+                              len(snapshot))
+        return CbisonMatcher(h, m)
+
     def validate_grammar(self, grammar_type: str,
                          grammar: str | bytes) -> tuple[bool, str]:
         """
@@ -348,6 +447,136 @@ class CbisonFactory:
             trg[i].mask_dest = ctypes.cast(ptr + idx * mask_len, p_type)
         return self.handle.compute_masks(self.handle, trg, len(matchers))
 
+    def step_batch_numpy(self,
+                         reqs: list[tuple[CbisonMatcher, int | None, int]],
+                         bitmask: 'NDArray[np.int32] | None',
+                         max_ff_tokens: int = 0) -> list[tuple[int, list[int]]]:
+        """
+        Runs a decoding step for a batch of matchers in a single engine call
+        (if supported; otherwise composed from other calls).
+        For each matcher, consumes the token (unless None), computes and consumes
+        fast-forward tokens (if max_ff_tokens > 0), and unless the matcher is
+        stopped, computes its mask into the given row of bitmask.
+        
+        Args:
+            reqs (list[tuple[CbisonMatcher, int | None, int]]): List of (matcher, token, row index) tuples.
+            bitmask (NDArray[np.int32] | None): A (batch, mask_len) C-contiguous int32 NumPy array, or None to skip masks.
+            max_ff_tokens (int): Maximum number of fast-forward tokens per matcher; 0 to skip.
+        
+        Returns:
+            List of (flags, ff_tokens) tuples, where flags is a combination of
+            STEP_STOPPED, STEP_ACCEPTING and STEP_ERROR.
+        """
+        import numpy as np
+        mask_len = self.mask_byte_len
+        if bitmask is not None:
+            assert bitmask.dtype == np.int32, "Mask must be int32"
+            assert bitmask.ndim == 2, "Mask must be 2D"
+            assert bitmask.shape[1] == mask_len // 4, "Mask must be of size mask_byte_len"
+            assert bitmask.flags["C_CONTIGUOUS"], "Mask must be contiguous"
+            for _, _, idx in reqs:
+                assert idx < bitmask.shape[0], "Invalid index"
+
+        h = self.handle
+        if h.version_minor >= 5 and h.step_batch:
+            trg = (cbison_step_req_t * len(reqs))()
+            ff_bufs = []
+            for i, (m, token, idx) in enumerate(reqs):
+                trg[i].matcher = m.matcher
+                trg[i].token = _NO_TOKEN if token is None else token
+                trg[i].mask_row = idx
+                if max_ff_tokens > 0:
+                    buf = (ctypes.c_uint32 * max_ff_tokens)()
+                    ff_bufs.append(buf)
+                    trg[i].ff_tokens = buf
+                    trg[i].ff_tokens_len = max_ff_tokens
+            layout = None
+            if bitmask is not None:
+                layout = cbison_mask_layout_t()
+                layout.base = bitmask.ctypes.data
+                layout.row_stride = mask_len
+                layout.padded_vocab = mask_len * 8
+                layout.format = 0
+                layout.pad_allowed = 0
+                layout = ctypes.byref(layout)
+            if h.step_batch(h, trg, len(reqs), layout) != 0:
+                raise RuntimeError("step_batch() failed")
+            return [(r.flags,
+                     list(ff_bufs[i][:r.n_ff_tokens]) if ff_bufs else [])
+                    for i, r in enumerate(trg)]
+
+        res: list[tuple[int, list[int]]] = []
+        to_mask: list[tuple[CbisonMatcher, int]] = []
+        for m, token, idx in reqs:
+            ok = True
+            if token is not None:
+                ok = m.consume_tokens([token]) == 0
+            ff: list[int] = []
+            if ok and max_ff_tokens > 0 and h.compute_ff_tokens and not m.is_stopped():
+                ff = m.compute_ff_tokens()[:max_ff_tokens]
+                if ff:
+                    ok = m.consume_tokens(ff) == 0
+            flags = 0
+            if not ok or m.get_error():
+                flags |= STEP_ERROR
+            if m.is_stopped():
+                flags |= STEP_STOPPED
+            elif bitmask is not None:
+                to_mask.append((m, idx))
+            if m.is_accepting():
+                flags |= STEP_ACCEPTING
+            res.append((flags, ff))
+        if to_mask:
+            assert bitmask is not None
+            self.compute_masks_numpy(to_mask, bitmask)
+        return res
+
+    def has_compute_masks_strided(self) -> bool:
+        """
+        Checks if the engine supports compute_masks_strided().
+        """
+        return self.handle.version_minor >= 1 and bool(
+            self.handle.compute_masks_strided)
+
+    def unsafe_compute_masks_strided_ptr(self,
+                                         rows: list[CbisonMatcher | None],
+                                         base_pointer: int,
+                                         row_stride: int,
+                                         padded_vocab: int,
+                                         format: int = 0,
+                                         pad_allowed: bool = False) -> int:
+        """
+        Computes token masks directly into a model-shaped buffer.
+        
+        Args:
+            rows (list[CbisonMatcher | None]): Matcher for each row; rows with None are left untouched.
+            base_pointer (int): Pointer to row 0 of writable memory.
+            row_stride (int): Distance between rows in bytes.
+            padded_vocab (int): Number of token entries per row (at least n_vocab).
+            format (int): 0 for bits, 1 for bool (uint8), 2 for bfloat16 logit bias.
+            pad_allowed (bool): Whether entries past n_vocab are allowed.
+        
+        Returns:
+            0 on success, -1 on error.
+        
+        Raises:
+            RuntimeError: If the engine does not support strided masks.
+        """
+        if not self.has_compute_masks_strided():
+            raise RuntimeError("compute_masks_strided() not supported")
+        ms = (cbison_matcher_t * len(rows))()
+        for i, m in enumerate(rows):
+            if m is not None:
+                ms[i] = m.matcher
+        layout = cbison_mask_layout_t()
+        layout.base = base_pointer
+        layout.row_stride = row_stride
+        layout.padded_vocab = padded_vocab
+        layout.format = format
+        layout.pad_allowed = 1 if pad_allowed else 0
+        return self.handle.compute_masks_strided(self.handle, ms, len(rows),
+                                                 ctypes.byref(layout))
+
 
 class CbisonTokenizer:
     """
@@ -423,3 +652,34 @@ class CbisonTokenizer:
         out = (ctypes.c_uint32 * est_tokens)()
         n = self.handle.tokenize_bytes(self.handle, b, len(b), out, est_tokens)
         return list(out[:min(n, est_tokens)])
+
+    def tokenize_bytes_batch(self, inputs: list[bytes | str]) -> list[list[int]]:
+        """
+        Tokenizes a number of strings or byte buffers in a single call
+        (if supported; otherwise calls tokenize_bytes() for each).
+        
+        Args:
+            inputs (list[bytes | str]): Strings or byte buffers to tokenize.
+        
+        Returns:
+            List of token lists, one per input.
+        """
+        bs = [b.encode("utf-8") if isinstance(b, str) else b for b in inputs]
+        h = self.handle
+        if h.version_minor < 1 or not h.tokenize_bytes_batch:
+            return [self.tokenize_bytes(b) for b in bs]
+        n = len(bs)
+        data = b"".join(bs)
+        in_offsets = (ctypes.c_size_t * (n + 1))()
+        for i, b in enumerate(bs):
+            in_offsets[i + 1] = in_offsets[i] + len(b)
+        out_offsets = (ctypes.c_size_t * (n + 1))()
+        est_tokens = len(data) + n
+        out = (ctypes.c_uint32 * est_tokens)()
+        total = h.tokenize_bytes_batch(h, data, in_offsets, n, out, est_tokens,
+                                       out_offsets)
+        if total > est_tokens:
+            out = (ctypes.c_uint32 * total)()
+            h.tokenize_bytes_batch(h, data, in_offsets, n, out, total,
+                                   out_offsets)
+        return [list(out[out_offsets[i]:out_offsets[i + 1]]) for i in range(n)]
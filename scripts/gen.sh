@@ -10,6 +10,8 @@ bindgen \
     --allowlist-type 'cbison_factory' \
     --allowlist-type 'cbison_tokenizer' \
     --allowlist-type 'cbison_mask_req.*' \
+    --allowlist-type 'cbison_mask_layout.*' \
+    --allowlist-type 'cbison_step_req.*' \
     --allowlist-item 'CBISON_.*' \
     --no-recursive-allowlist \
     cpp/cbison_api.h >> tmp.rs